@@ -0,0 +1,677 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bmplib.h"
+#include "bmpkernels.h"
+#include "threadpool.h"
+
+/*   Files written and read back by the stages, removed at the end   */
+#define BENCH_FILENAME "bench.bmp"
+#define BENCH_COMPRESSED_FILENAME "bench.bin"
+#define BENCH_COMPRESSED_V2_FILENAME "bench_v2.bin"
+#define BENCH_OUTPUT_FILENAME "bench_out.bmp"
+
+#define DEFAULT_WARMUP 1
+#define DEFAULT_REPETITIONS 5
+#define DEFAULT_THRESHOLD 30
+
+#define MAX_SIZES 16
+
+/*   Side of the blocks of the "blocks" pattern   */
+#define BLOCK_SIDE 48
+
+#define FILTER_COUNT 3
+
+/*   Synthetic images   */
+#define PATTERN_SOLID 0
+#define PATTERN_GRADIENT 1
+#define PATTERN_NOISE 2
+#define PATTERN_BLOCKS 3
+#define PATTERN_COUNT 4
+
+static const char *pattern_names[PATTERN_COUNT] = {
+	"solid", "gradient", "noise", "blocks"};
+
+static int filters[FILTER_COUNT][3][3] = {
+	{{-1, -1, -1},
+	 {-1, 8, -1},
+	 {-1, -1, -1}},
+	{{0, 1, 0},
+	 {1, -4, 1},
+	 {0, 1, 0}},
+	{{1, 0, -1},
+	 {0, 0, 0},
+	 {-1, 0, 1}}};
+
+/*   Structures declarations   */
+/**
+ *    The data shared by the stages run on an image: @result receives the
+ * grayscale, filter and compression of @image, and the planes the gray values
+ * and their filters. @planar holds the channels of @image split in planes and
+ * @planar_result their filter.
+ */
+typedef struct {
+	bmp_file_header_t file_header;
+	bmp_info_header_t info_header;
+	bitmap_t image;
+	bitmap_t result;
+	plane_t gray;
+	plane_t planes[FILTER_COUNT];
+	planar_t planar;
+	planar_t planar_result;
+	compress_workspace_t workspace;
+	int threshold;
+} bench_data_t;
+
+/**
+ *    A stage of the pipeline, run on @p_data.
+ *    @return 0 if successful or an error code otherwise;
+ */
+typedef int (*stage_fn_t)(bench_data_t *p_data);
+
+typedef struct {
+	const char *name;
+	stage_fn_t fn;
+} stage_t;
+
+/*   Options of the command line, see parse_options   */
+typedef struct {
+	int sizes[MAX_SIZES][2];
+	int size_count;
+	int patterns[PATTERN_COUNT];
+	int pattern_count;
+	int warmup;
+	int repetitions;
+	int threshold;
+} options_t;
+
+/*   Stages   */
+static int stage_read_bmp(bench_data_t *p_data)
+{
+	bmp_file_header_t file_header;
+	bmp_info_header_t info_header;
+	bitmap_t bitmap;
+	int e;
+
+	(void)p_data;
+	bitmap.buffer = NULL;
+	e = read_bmp(BENCH_FILENAME, &file_header, &info_header, &bitmap);
+	clear_bitmap(&bitmap);
+	return e;
+}
+
+static int stage_read_planar_bmp(bench_data_t *p_data)
+{
+	bmp_file_header_t file_header;
+	bmp_info_header_t info_header;
+
+	return read_planar_bmp(BENCH_FILENAME, &file_header, &info_header,
+		&p_data->planar);
+}
+
+static int stage_grayscale_bitmap(bench_data_t *p_data)
+{
+	return grayscale_bitmap(&p_data->result, &p_data->image);
+}
+
+static int stage_grayscale_plane(bench_data_t *p_data)
+{
+	return grayscale_plane(&p_data->gray, &p_data->image);
+}
+
+static int stage_grayscale_planar(bench_data_t *p_data)
+{
+	return grayscale_planar(&p_data->gray, &p_data->planar);
+}
+
+static int stage_filter_bitmap(bench_data_t *p_data)
+{
+	return filter_bitmap(&p_data->result, &p_data->image, filters[0]);
+}
+
+/**
+ *    Run the stage @fn on @p_data with rows that are never split in tiles,
+ * for the comparison with the tiled version.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int untiled(int (*fn)(bench_data_t *), bench_data_t *p_data)
+{
+	int bytes = threadpool_tile_bytes();
+	int e;
+
+	threadpool_set_tile_bytes(0);
+	e = fn(p_data);
+	threadpool_set_tile_bytes(bytes);
+	return e;
+}
+
+static int stage_filter_bitmap_rows(bench_data_t *p_data)
+{
+	return untiled(stage_filter_bitmap, p_data);
+}
+
+static int stage_filter_planar(bench_data_t *p_data)
+{
+	return filter_planar(&p_data->planar_result, &p_data->planar,
+		filters[0]);
+}
+
+static int stage_filter_plane_multi(bench_data_t *p_data)
+{
+	plane_t *p_planes[FILTER_COUNT];
+
+	for (int k = 0; k < FILTER_COUNT; ++k) {
+		p_planes[k] = &p_data->planes[k];
+	}
+	return filter_plane_multi(p_planes, &p_data->gray, filters,
+		FILTER_COUNT);
+}
+
+static int stage_filter_plane_multi_rows(bench_data_t *p_data)
+{
+	return untiled(stage_filter_plane_multi, p_data);
+}
+
+static int stage_convolve_bitmap_gaussian5(bench_data_t *p_data)
+{
+	return convolve_bitmap(&p_data->result, &p_data->image,
+		find_convolution("gaussian5"));
+}
+
+static int stage_convolve_bitmap_gaussian7(bench_data_t *p_data)
+{
+	return convolve_bitmap(&p_data->result, &p_data->image,
+		find_convolution("gaussian7"));
+}
+
+static int stage_convolve_bitmap_sharpen5(bench_data_t *p_data)
+{
+	return convolve_bitmap(&p_data->result, &p_data->image,
+		find_convolution("sharpen5"));
+}
+
+static int stage_box_blur_bitmap_r4(bench_data_t *p_data)
+{
+	return box_blur_bitmap(&p_data->result, &p_data->image, 4);
+}
+
+static int stage_box_blur_bitmap_r32(bench_data_t *p_data)
+{
+	return box_blur_bitmap(&p_data->result, &p_data->image, 32);
+}
+
+static int stage_gaussian_blur_bitmap_s8(bench_data_t *p_data)
+{
+	return gaussian_blur_bitmap(&p_data->result, &p_data->image, 8);
+}
+
+static int stage_write_bmp(bench_data_t *p_data)
+{
+	return write_bmp(BENCH_OUTPUT_FILENAME, &p_data->file_header,
+		&p_data->info_header, &p_data->image);
+}
+
+static int stage_write_planar_bmp(bench_data_t *p_data)
+{
+	return write_planar_bmp(BENCH_OUTPUT_FILENAME, &p_data->file_header,
+		&p_data->info_header, &p_data->planar);
+}
+
+static int stage_compress_bitmap(bench_data_t *p_data)
+{
+	return compress_bitmap_workspace(&p_data->result, &p_data->image,
+		p_data->threshold, &p_data->workspace);
+}
+
+static int stage_compress_bitmap_tiled(bench_data_t *p_data)
+{
+	int e;
+
+	p_data->workspace.tiled = 1;
+	e = stage_compress_bitmap(p_data);
+	p_data->workspace.tiled = 0;
+	return e;
+}
+
+static int stage_write_compressed_bmp(bench_data_t *p_data)
+{
+	return write_compressed_bmp(BENCH_COMPRESSED_FILENAME,
+		&p_data->file_header, &p_data->info_header, &p_data->result);
+}
+
+static int stage_write_compressed_bmp_v2(bench_data_t *p_data)
+{
+	return write_compressed_bmp_boundary(BENCH_COMPRESSED_V2_FILENAME,
+		&p_data->file_header, &p_data->info_header, &p_data->result,
+		&p_data->workspace, COMPRESSED_V2, COMPRESSED_COMPACT_RANS);
+}
+
+/**
+ *    Read back the compressed file located at @file_name.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int read_compressed(const char file_name[])
+{
+	bmp_file_header_t file_header;
+	bmp_info_header_t info_header;
+	bitmap_t bitmap;
+	int e;
+
+	bitmap.buffer = NULL;
+	e = read_compressed_bmp(file_name, &file_header, &info_header,
+		&bitmap);
+	clear_bitmap(&bitmap);
+	return e;
+}
+
+static int stage_read_compressed_bmp(bench_data_t *p_data)
+{
+	(void)p_data;
+	return read_compressed(BENCH_COMPRESSED_FILENAME);
+}
+
+static int stage_read_compressed_bmp_v2(bench_data_t *p_data)
+{
+	(void)p_data;
+	return read_compressed(BENCH_COMPRESSED_V2_FILENAME);
+}
+
+/*   The stages, in an order in which each one has the inputs it needs   */
+static const stage_t stages[] = {
+	{"read_bmp", stage_read_bmp},
+	{"read_planar_bmp", stage_read_planar_bmp},
+	{"grayscale_bitmap", stage_grayscale_bitmap},
+	{"grayscale_plane", stage_grayscale_plane},
+	{"grayscale_planar", stage_grayscale_planar},
+	{"filter_bitmap", stage_filter_bitmap},
+	{"filter_bitmap_rows", stage_filter_bitmap_rows},
+	{"filter_planar", stage_filter_planar},
+	{"filter_plane_multi", stage_filter_plane_multi},
+	{"filter_plane_multi_rows", stage_filter_plane_multi_rows},
+	{"convolve_bitmap_gaussian5", stage_convolve_bitmap_gaussian5},
+	{"convolve_bitmap_gaussian7", stage_convolve_bitmap_gaussian7},
+	{"convolve_bitmap_sharpen5", stage_convolve_bitmap_sharpen5},
+	{"box_blur_bitmap_r4", stage_box_blur_bitmap_r4},
+	{"box_blur_bitmap_r32", stage_box_blur_bitmap_r32},
+	{"gaussian_blur_bitmap_s8", stage_gaussian_blur_bitmap_s8},
+	{"write_bmp", stage_write_bmp},
+	{"write_planar_bmp", stage_write_planar_bmp},
+	{"compress_bitmap_tiled", stage_compress_bitmap_tiled},
+	{"compress_bitmap", stage_compress_bitmap},
+	{"write_compressed_bmp", stage_write_compressed_bmp},
+	{"write_compressed_bmp_v2", stage_write_compressed_bmp_v2},
+	{"read_compressed_bmp", stage_read_compressed_bmp},
+	{"read_compressed_bmp_v2", stage_read_compressed_bmp_v2}};
+
+#define STAGE_COUNT ((int)(sizeof(stages) / sizeof(stages[0])))
+
+/**
+ *    Get the next value of the xorshift generator of state @p_state.
+ */
+static inline uint32_t next_random(uint32_t *p_state)
+{
+	uint32_t x = *p_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*p_state = x;
+	return x;
+}
+
+/**
+ *    Fill @p_bitmap with the synthetic image @pattern:
+ *    - solid, a single color;
+ *    - gradient, smooth ramps in both directions;
+ *    - noise, random bytes;
+ *    - blocks, squares of BLOCK_SIDE pixels of random colors with a little
+ * noise, like the flat areas of a photo.
+ */
+static void generate_image(bitmap_t *p_bitmap, int pattern)
+{
+	int w = p_bitmap->width, h = p_bitmap->height;
+	uint32_t state = 0x9E3779B9u;
+
+	for (int i = 0; i < h; ++i) {
+		pixel_t *row = bitmap_row(p_bitmap, i);
+		for (int j = 0; j < w; ++j) {
+			uint32_t r = next_random(&state);
+			switch (pattern) {
+			case PATTERN_SOLID:
+				row[j].r = 200, row[j].g = 120, row[j].b = 40;
+				break;
+			case PATTERN_GRADIENT:
+				row[j].r = (uint64_t)j * 256 / w;
+				row[j].g = (uint64_t)i * 256 / h;
+				row[j].b = (uint64_t)(i + j) * 256 / (w + h);
+				break;
+			case PATTERN_NOISE:
+				row[j].r = r, row[j].g = r >> 8;
+				row[j].b = r >> 16;
+				break;
+			default: {
+				/* Hash the index of the block to its color */
+				uint32_t c = (uint32_t)(i / BLOCK_SIDE)
+					* 0x9E3779B1u
+					^ (uint32_t)(j / BLOCK_SIDE)
+					* 0x85EBCA77u;
+				c ^= c >> 15;
+				c *= 0xC2B2AE3Du;
+				c ^= c >> 13;
+				row[j].r = (c & 0xF8) | (r & 3);
+				row[j].g = (c >> 8 & 0xF8) | (r >> 2 & 3);
+				row[j].b = (c >> 16 & 0xF8) | (r >> 4 & 3);
+			}
+			}
+		}
+	}
+}
+
+/**
+ *    Fill the headers of a @w x @h bmp file.
+ */
+static void make_headers(bmp_file_header_t *p_file_header,
+                         bmp_info_header_t *p_info_header, int w, int h)
+{
+	uint32_t image_size = (uint32_t)(w * sizeof(pixel_t)
+		+ bmp_row_padding(w)) * h;
+
+	memset(p_file_header, 0, sizeof(bmp_file_header_t));
+	memset(p_info_header, 0, sizeof(bmp_info_header_t));
+	p_file_header->signature = BMP_SIGNATURE;
+	p_file_header->offset = sizeof(bmp_file_header_t)
+		+ sizeof(bmp_info_header_t);
+	p_file_header->file_size = p_file_header->offset + image_size;
+	p_info_header->header_size = BMP_INFO_HEADER_SIZE;
+	p_info_header->width = w;
+	p_info_header->height = h;
+	p_info_header->planes = 1;
+	p_info_header->bit_count = BMP_BIT_COUNT;
+	p_info_header->image_size = image_size;
+}
+
+/**
+ *    Get the time of the monotonic clock in nanoseconds.
+ */
+static double now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ *    Run the stage @p_stage @warmup times, then time it @repetitions times,
+ * storing the median and the fastest time in @p_median and @p_min.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int time_stage(const stage_t *p_stage, bench_data_t *p_data,
+                      int warmup, int repetitions, double *p_median,
+                      double *p_min)
+{
+	double *times = malloc(repetitions * sizeof(double));
+
+	if (times == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	for (int k = 0; k < warmup; ++k) {
+		if (p_stage->fn(p_data) != 0) goto exit_failure;
+	}
+	for (int k = 0; k < repetitions; ++k) {
+		double start = now_ns();
+		if (p_stage->fn(p_data) != 0) goto exit_failure;
+		times[k] = now_ns() - start;
+	}
+	qsort(times, repetitions, sizeof(double), compare_doubles);
+	*p_median = repetitions % 2 ? times[repetitions / 2]
+		: (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+	*p_min = times[0];
+	free(times);
+	return 0;
+
+exit_failure:
+	fprintf(stderr, "Stage %s failed\n", p_stage->name);
+	free(times);
+	return 1;
+}
+
+/**
+ *    Initialize the data of the stages for a @w x @h image of @pattern,
+ * writing it to BENCH_FILENAME too.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int initialize_bench_data(bench_data_t *p_data, int w, int h,
+                                 int pattern, int threshold)
+{
+	memset(p_data, 0, sizeof(bench_data_t));
+	if (initialize_compress_workspace(&p_data->workspace) != 0) return 1;
+	p_data->threshold = threshold;
+	make_headers(&p_data->file_header, &p_data->info_header, w, h);
+	if (initialize_bitmap(&p_data->image, w, h) != 0
+	    || initialize_bitmap(&p_data->result, w, h) != 0
+	    || initialize_plane(&p_data->gray, w, h) != 0
+	    || initialize_planar(&p_data->planar, w, h) != 0
+	    || initialize_planar(&p_data->planar_result, w, h) != 0) {
+		return 1;
+	}
+	for (int k = 0; k < FILTER_COUNT; ++k) {
+		if (initialize_plane(&p_data->planes[k], w, h) != 0) return 1;
+	}
+	generate_image(&p_data->image, pattern);
+	if (split_bitmap(&p_data->planar, &p_data->image) != 0) return 1;
+	return write_bmp(BENCH_FILENAME, &p_data->file_header,
+		&p_data->info_header, &p_data->image);
+}
+
+static void clear_bench_data(bench_data_t *p_data)
+{
+	clear_bitmap(&p_data->image);
+	clear_bitmap(&p_data->result);
+	clear_plane(&p_data->gray);
+	clear_planar(&p_data->planar);
+	clear_planar(&p_data->planar_result);
+	for (int k = 0; k < FILTER_COUNT; ++k) clear_plane(&p_data->planes[k]);
+	clear_compress_workspace(&p_data->workspace);
+}
+
+/**
+ *    Run all the stages on a @w x @h image of @pattern, printing a line of
+ * results for each one.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int run_image(const options_t *p_options, int w, int h, int pattern)
+{
+	bench_data_t data;
+	double pixels = (double)w * h;
+	int e = 0;
+
+	if (initialize_bench_data(&data, w, h, pattern,
+	                          p_options->threshold) != 0) {
+		fprintf(stderr, "Can't prepare the %dx%d %s image\n", w, h,
+			pattern_names[pattern]);
+		clear_bench_data(&data);
+		return 1;
+	}
+	for (int s = 0; s < STAGE_COUNT && e == 0; ++s) {
+		double median, min;
+		e = time_stage(&stages[s], &data, p_options->warmup,
+			p_options->repetitions, &median, &min);
+		if (e != 0) break;
+
+		/* The throughput is given for the bytes of the pixels */
+		printf("%s,%s,%d,%d,%d,%s,%d,%.0f,%.0f,%.3f,%.3f\n",
+			stages[s].name, pattern_names[pattern], w, h,
+			threadpool_threads(), kernels_name(),
+			p_options->repetitions, median, min, median / pixels,
+			pixels * sizeof(pixel_t) / median);
+		fflush(stdout);
+	}
+	clear_bench_data(&data);
+	return e;
+}
+
+/**
+ *    Parse a size, either <side> or <width>x<height>, into @size.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int parse_size(const char *arg, int size[2])
+{
+	char end;
+	int n = sscanf(arg, "%dx%d%c", &size[0], &size[1], &end);
+
+	if (n == 1) size[1] = size[0];
+	if ((n != 1 && n != 2) || size[0] <= 0 || size[1] <= 0
+	    || size[0] > UINT16_MAX || size[1] > UINT16_MAX) {
+		fprintf(stderr, "Invalid size %s\n", arg);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ *    Print the usage of the program @name.
+ *    @return an error code;
+ */
+static int usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j <threads>] [-s <size>]... "
+		"[-p solid|gradient|noise|blocks]... [-w <warmup>] "
+		"[-r <repetitions>] [-t <threshold>] [--tile <bytes>]\n",
+		name);
+	return 1;
+}
+
+/**
+ *    Parse the command line options into @p_options:
+ *    -j <count>, --threads <count>   number of threads used by the kernels
+ *    -s <size>, --size <size>   size of the images, <side> or
+ * <width>x<height>, which can be repeated (64, 256, 1024 and 4096 by default)
+ *    -p <pattern>, --pattern <pattern>   pattern of the images, which can be
+ * repeated (all of them by default)
+ *    -w <count>, --warmup <count>   number of runs before the timed ones
+ *    -r <count>, --repetitions <count>   number of timed runs
+ *    -t <threshold>, --threshold <threshold>   threshold of the compression
+ *    --tile <bytes>   width of the tiles of the tiled stages, the "_rows"
+ * stages running the same kernels without tiles
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int parse_options(int argc, char *argv[], options_t *p_options)
+{
+	const int default_sizes[] = {64, 256, 1024, 4096};
+
+	p_options->size_count = 0;
+	p_options->pattern_count = 0;
+	p_options->warmup = DEFAULT_WARMUP;
+	p_options->repetitions = DEFAULT_REPETITIONS;
+	p_options->threshold = DEFAULT_THRESHOLD;
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 == argc) {
+			/* Every option has a value */
+			return usage(argv[0]);
+		}
+		if (strcmp(argv[i], "-j") == 0
+		    || strcmp(argv[i], "--threads") == 0) {
+			if (threadpool_set_threads(atoi(argv[++i])) != 0) {
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-s") == 0
+		           || strcmp(argv[i], "--size") == 0) {
+			int *size = p_options->sizes[p_options->size_count];
+			if (p_options->size_count == MAX_SIZES) {
+				fprintf(stderr, "Too many sizes\n");
+				return 1;
+			}
+			if (parse_size(argv[++i], size) != 0) return 1;
+			++p_options->size_count;
+		} else if (strcmp(argv[i], "-p") == 0
+		           || strcmp(argv[i], "--pattern") == 0) {
+			int k = 0;
+			++i;
+			while (k < PATTERN_COUNT
+			       && strcmp(argv[i], pattern_names[k]) != 0) {
+				++k;
+			}
+			if (k == PATTERN_COUNT) {
+				fprintf(stderr, "Unknown pattern %s\n",
+					argv[i]);
+				return 1;
+			}
+			if (p_options->pattern_count == PATTERN_COUNT) {
+				fprintf(stderr, "Too many patterns\n");
+				return 1;
+			}
+			p_options->patterns[p_options->pattern_count++] = k;
+		} else if (strcmp(argv[i], "-w") == 0
+		           || strcmp(argv[i], "--warmup") == 0) {
+			p_options->warmup = atoi(argv[++i]);
+			if (p_options->warmup < 0) return usage(argv[0]);
+		} else if (strcmp(argv[i], "-r") == 0
+		           || strcmp(argv[i], "--repetitions") == 0) {
+			p_options->repetitions = atoi(argv[++i]);
+			if (p_options->repetitions <= 0) return usage(argv[0]);
+		} else if (strcmp(argv[i], "-t") == 0
+		           || strcmp(argv[i], "--threshold") == 0) {
+			p_options->threshold = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--tile") == 0) {
+			if (threadpool_set_tile_bytes(atoi(argv[++i])) != 0) {
+				return 1;
+			}
+		} else {
+			return usage(argv[0]);
+		}
+	}
+
+	if (p_options->size_count == 0) {
+		for (int k = 0; k < 4; ++k) {
+			p_options->sizes[k][0] = default_sizes[k];
+			p_options->sizes[k][1] = default_sizes[k];
+		}
+		p_options->size_count = 4;
+	}
+	if (p_options->pattern_count == 0) {
+		for (int k = 0; k < PATTERN_COUNT; ++k) {
+			p_options->patterns[k] = k;
+		}
+		p_options->pattern_count = PATTERN_COUNT;
+	}
+	return 0;
+}
+
+/**
+ *    Time every stage of the pipeline on synthetic images and print the
+ * results as CSV, one line per stage and image, so that the runs of two
+ * commits can be compared.
+ */
+int main(int argc, char *argv[])
+{
+	options_t options;
+	int failed = 0;
+
+	if (parse_options(argc, argv, &options) != 0) return 1;
+
+	printf("stage,pattern,width,height,threads,kernels,repetitions,"
+		"median_ns,min_ns,ns_per_pixel,gb_per_s\n");
+	for (int s = 0; s < options.size_count; ++s) {
+		for (int p = 0; p < options.pattern_count; ++p) {
+			if (run_image(&options, options.sizes[s][0],
+			              options.sizes[s][1],
+			              options.patterns[p]) != 0) {
+				failed = 1;
+			}
+		}
+	}
+
+	remove(BENCH_FILENAME);
+	remove(BENCH_COMPRESSED_FILENAME);
+	remove(BENCH_COMPRESSED_V2_FILENAME);
+	remove(BENCH_OUTPUT_FILENAME);
+	return failed;
+}
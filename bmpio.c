@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "bmpio.h"
+
+int map_file(const char file_name[], file_map_t *p_map)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	p_map->data = NULL;
+	p_map->size = 0;
+	p_map->allocated = 0;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open file %s\n", file_name);
+		return 1;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		/* Pipes, devices and empty files can't be mapped */
+		close(fd);
+		return 1;
+	}
+
+	/* Private pages are copied when written, the file never changes */
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+	            0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Can't map file %s\n", file_name);
+		return 1;
+	}
+
+	p_map->data = data;
+	p_map->size = st.st_size;
+	return 0;
+}
+
+int load_file(const char file_name[], file_map_t *p_map)
+{
+	size_t capacity = WRITER_CAPACITY;
+	uint8_t *data;
+	int fd, e = 0;
+
+	if (map_file(file_name, p_map) == 0) return 0;
+
+	/* Not mappable: read everything, doubling the buffer as needed */
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0) return 1;
+	data = malloc(capacity);
+	while (data != NULL) {
+		ssize_t n = read(fd, data + p_map->size,
+		                 capacity - p_map->size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			e = n < 0;
+			break;
+		}
+		p_map->size += n;
+		if (p_map->size == capacity) {
+			uint8_t *tmp = realloc(data, 2 * capacity);
+			if (tmp == NULL) {
+				e = 1;
+				break;
+			}
+			data = tmp;
+			capacity *= 2;
+		}
+	}
+	close(fd);
+	if (data == NULL || e != 0) {
+		fprintf(stderr, "Can't load file %s\n", file_name);
+		free(data);
+		p_map->size = 0;
+		return 1;
+	}
+
+	p_map->data = data;
+	p_map->allocated = 1;
+	return 0;
+}
+
+int unmap_file(file_map_t *p_map)
+{
+	if (p_map == NULL || p_map->data == NULL) return 0;
+	if (p_map->allocated) {
+		free(p_map->data);
+	} else if (munmap(p_map->data, p_map->size) != 0) {
+		fprintf(stderr, "Error while unmapping a file\n");
+		return 1;
+	}
+	p_map->data = NULL;
+	p_map->size = 0;
+	return 0;
+}
+
+int write_all(int fd, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	while (size > 0) {
+		ssize_t e = write(fd, p, size);
+		if (e < 0 && errno == EINTR) continue;
+		if (e <= 0) {
+			fprintf(stderr, "Error while writing to a file\n");
+			return 1;
+		}
+		p += e;
+		size -= e;
+	}
+	return 0;
+}
+
+/**
+ *    Write two blocks with as few writev calls as possible, retrying short
+ * writes.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int writev_all(int fd, const void *first, size_t first_size,
+                      const void *second, size_t second_size)
+{
+	struct iovec iov[2];
+	iov[0].iov_base = (void *)first;
+	iov[0].iov_len = first_size;
+	iov[1].iov_base = (void *)second;
+	iov[1].iov_len = second_size;
+
+	while (iov[0].iov_len + iov[1].iov_len > 0) {
+		ssize_t e = writev(fd, iov, 2);
+		if (e < 0 && errno == EINTR) continue;
+		if (e <= 0) {
+			fprintf(stderr, "Error while writing to a file\n");
+			return 1;
+		}
+		for (int i = 0; i < 2; ++i) {
+			size_t done = (size_t)e < iov[i].iov_len
+				? (size_t)e : iov[i].iov_len;
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + done;
+			iov[i].iov_len -= done;
+			e -= done;
+		}
+	}
+	return 0;
+}
+
+int open_writer(writer_t *p_writer, const char file_name[])
+{
+	p_writer->size = 0;
+	p_writer->capacity = WRITER_CAPACITY;
+	p_writer->data = malloc(WRITER_CAPACITY);
+	if (p_writer->data == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	p_writer->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (p_writer->fd < 0) {
+		fprintf(stderr, "Can't open file %s\n", file_name);
+		free(p_writer->data);
+		p_writer->data = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+int writer_flush(writer_t *p_writer)
+{
+	if (p_writer->size == 0) return 0;
+	if (write_all(p_writer->fd, p_writer->data, p_writer->size) != 0) {
+		return 1;
+	}
+	p_writer->size = 0;
+	return 0;
+}
+
+int writer_put(writer_t *p_writer, const void *data, size_t size)
+{
+	if (size <= p_writer->capacity - p_writer->size) {
+		memcpy(p_writer->data + p_writer->size, data, size);
+		p_writer->size += size;
+		return 0;
+	}
+	if (size < p_writer->capacity / 2) {
+		if (writer_flush(p_writer) != 0) return 1;
+		memcpy(p_writer->data, data, size);
+		p_writer->size = size;
+		return 0;
+	}
+
+	/* Big block: send it right after the pending bytes, without a copy */
+	if (writev_all(p_writer->fd, p_writer->data, p_writer->size,
+	               data, size) != 0) {
+		return 1;
+	}
+	p_writer->size = 0;
+	return 0;
+}
+
+int writer_put_zeros(writer_t *p_writer, size_t size)
+{
+	while (size > 0) {
+		size_t chunk = p_writer->capacity - p_writer->size;
+		if (chunk == 0) {
+			if (writer_flush(p_writer) != 0) return 1;
+			continue;
+		}
+		if (chunk > size) chunk = size;
+		memset(p_writer->data + p_writer->size, 0, chunk);
+		p_writer->size += chunk;
+		size -= chunk;
+	}
+	return 0;
+}
+
+int close_writer(writer_t *p_writer)
+{
+	int e = writer_flush(p_writer);
+	if (close(p_writer->fd) != 0) {
+		fprintf(stderr, "Error while closing a file\n");
+		e = 1;
+	}
+	free(p_writer->data);
+	p_writer->data = NULL;
+	return e;
+}
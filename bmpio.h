@@ -0,0 +1,121 @@
+#ifndef BMPIO_H
+#define BMPIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*   Size of the output buffer used by the writers   */
+#define WRITER_CAPACITY (1 << 20)
+
+/*   Structures declarations   */
+/**
+ *    The whole content of a file, mapped in memory or, when @allocated is set,
+ * read into an allocated buffer.
+ */
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	int allocated;
+} file_map_t;
+
+/**
+ *    Buffered output to a file descriptor. Small writes are gathered in @data
+ * and flushed with a single write call once @capacity bytes are pending.
+ */
+typedef struct {
+	int fd;
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+} writer_t;
+
+/*   Functions declarations   */
+/**
+ *    Map the whole file located at @file_name in memory. The mapping is
+ * private: the pages written are copied, so the file is never modified. It
+ * stays valid after the file is closed, until unmap_file is called.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int map_file(const char file_name[], file_map_t *p_map);
+
+/**
+ *    Load the whole file located at @file_name in memory: regular files are
+ * mapped like in map_file, while the others (pipes, devices) are read into an
+ * allocated buffer.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int load_file(const char file_name[], file_map_t *p_map);
+
+/**
+ *    Release a mapping created by map_file or load_file and set its members
+ * to 0.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int unmap_file(file_map_t *p_map);
+
+/**
+ *    Create (or truncate) the file located at @file_name and prepare
+ * @p_writer for writing to it, using a buffer of WRITER_CAPACITY bytes.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int open_writer(writer_t *p_writer, const char file_name[]);
+
+/**
+ *    Write all the pending bytes of @p_writer to its file.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int writer_flush(writer_t *p_writer);
+
+/**
+ *    Append @size bytes from @data to @p_writer. Blocks larger than half of the
+ * buffer are not copied: they are written together with the pending bytes by
+ * a single writev call.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int writer_put(writer_t *p_writer, const void *data, size_t size);
+
+/**
+ *    Append @size zero bytes to @p_writer.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int writer_put_zeros(writer_t *p_writer, size_t size);
+
+/**
+ *    Flush @p_writer, close its file and free its buffer. The writer is closed
+ * even if the flush fails.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int close_writer(writer_t *p_writer);
+
+/**
+ *    Write @size bytes from @data to the file descriptor @fd, retrying short
+ * writes.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int write_all(int fd, const void *data, size_t size);
+
+/*   Inline functions   */
+/**
+ *    Make room for @size bytes (at most the capacity) at the end of the buffer
+ * of @p_writer, flushing it if necessary. The caller fills the returned space
+ * and then calls writer_commit.
+ *    @return the address of the free space or NULL if the flush failed;
+ */
+static inline uint8_t *writer_reserve(writer_t *p_writer, size_t size)
+{
+	if (p_writer->capacity - p_writer->size < size
+	    && writer_flush(p_writer) != 0) {
+		return NULL;
+	}
+	return p_writer->data + p_writer->size;
+}
+
+/**
+ *    Mark @size bytes from the space returned by writer_reserve as pending.
+ */
+static inline void writer_commit(writer_t *p_writer, size_t size)
+{
+	p_writer->size += size;
+}
+
+#endif
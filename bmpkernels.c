@@ -0,0 +1,1822 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmpkernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/*   Fractional bits of the reciprocals dividing the sums of the box blur   */
+#define BOX_RECIPROCAL_SHIFT 40
+
+/*   Scalar kernels, used for the tails of the rows and as fallback   */
+static void grayscale_row_scalar(pixel_t *dst, const pixel_t *src, int width)
+{
+	for (int j = 0; j < width; ++j) {
+		int tmp = (src[j].r + src[j].g + src[j].b) / 3;
+		dst[j].r = tmp;
+		dst[j].g = tmp;
+		dst[j].b = tmp;
+	}
+}
+
+static void luma_row_scalar(uint8_t *dst, const pixel_t *src, int width)
+{
+	for (int j = 0; j < width; ++j) {
+		dst[j] = (src[j].r + src[j].g + src[j].b) / 3;
+	}
+}
+
+static void expand_luma_row_scalar(pixel_t *dst, const uint8_t *src,
+                                   int width)
+{
+	for (int j = 0; j < width; ++j) {
+		dst[j].r = src[j];
+		dst[j].g = src[j];
+		dst[j].b = src[j];
+	}
+}
+
+static void deinterleave_range_scalar(uint8_t *channels[3],
+                                      const pixel_t *src, int from, int to)
+{
+	for (int j = from; j < to; ++j) {
+		channels[0][j] = src[j].b;
+		channels[1][j] = src[j].g;
+		channels[2][j] = src[j].r;
+	}
+}
+
+static void deinterleave_row_scalar(uint8_t *channels[3], const pixel_t *src,
+                                    int width)
+{
+	deinterleave_range_scalar(channels, src, 0, width);
+}
+
+static void interleave_range_scalar(pixel_t *dst, const uint8_t *channels[3],
+                                    int from, int to)
+{
+	for (int j = from; j < to; ++j) {
+		dst[j].b = channels[0][j];
+		dst[j].g = channels[1][j];
+		dst[j].r = channels[2][j];
+	}
+}
+
+static void interleave_row_scalar(pixel_t *dst, const uint8_t *channels[3],
+                                  int width)
+{
+	interleave_range_scalar(dst, channels, 0, width);
+}
+
+static void luma_planar_range_scalar(uint8_t *dst, const uint8_t *channels[3],
+                                     int from, int to)
+{
+	for (int j = from; j < to; ++j) {
+		dst[j] = (channels[0][j] + channels[1][j] + channels[2][j]) / 3;
+	}
+}
+
+static void luma_planar_row_scalar(uint8_t *dst, const uint8_t *channels[3],
+                                   int width)
+{
+	luma_planar_range_scalar(dst, channels, 0, width);
+}
+
+/**
+ *    Check if the pixels @a and @b have exactly the same color.
+ */
+static inline int same_pixel(const pixel_t *a, const pixel_t *b)
+{
+	return a->r == b->r && a->g == b->g && a->b == b->b;
+}
+
+/**
+ *    Set in @bits the boundary pixels of the row @rows[1] that are among the
+ * columns [@from, @to).
+ */
+static void boundary_range(uint64_t *bits, const pixel_t *rows[3], int width,
+                           int from, int to)
+{
+	const pixel_t *row = rows[1];
+	int edge = rows[0] == NULL || rows[2] == NULL;
+
+	for (int j = from; j < to; ++j) {
+		if (edge || j == 0 || j == width - 1
+		    || !same_pixel(&row[j], &rows[0][j])
+		    || !same_pixel(&row[j], &rows[2][j])
+		    || !same_pixel(&row[j], &row[j - 1])
+		    || !same_pixel(&row[j], &row[j + 1])) {
+			bits[j >> 6] |= 1ULL << (j & 63);
+		}
+	}
+}
+
+static void boundary_row_scalar(uint64_t *bits, const pixel_t *rows[3],
+                                int width)
+{
+	memset(bits, 0, (width + 63) / 64 * sizeof(uint64_t));
+	boundary_range(bits, rows, width, 0, width);
+}
+
+/**
+ *    Clamp @value to [0, MAX_PIXEL_VALUE] without branches.
+ */
+static inline uint8_t clamp_pixel(int value)
+{
+	value = value < 0 ? 0 : value;
+	return value > MAX_PIXEL_VALUE ? MAX_PIXEL_VALUE : value;
+}
+
+/**
+ *    Filter the pixel @j of a row, checking which neighbors exist. Used for
+ * the first and the last pixel of every row.
+ */
+static void filter_border(uint8_t *dst, const uint8_t *rows[3], int width,
+                          int j, const filter_kernel_t *p_kernel)
+{
+	int bpp = p_kernel->bpp;
+
+	for (int c = 0; c < bpp; ++c) {
+		int sum = 0;
+		for (int t = 0; t < p_kernel->taps; ++t) {
+			const uint8_t *row = rows[p_kernel->row[t]];
+			int q = j + p_kernel->offset[t] / bpp;
+			if (row != NULL && q >= 0 && q < width) {
+				sum += row[q * bpp + c] * p_kernel->weight[t];
+			}
+		}
+		dst[j * bpp + c] = clamp_pixel(sum);
+	}
+}
+
+/**
+ *    Gather the taps of @p_kernel whose rows exist, as byte pointers relative
+ * to the current position.
+ *    @return the number of taps;
+ */
+static int active_taps(const uint8_t *src[9], int weight[9],
+                       const uint8_t *rows[3],
+                       const filter_kernel_t *p_kernel)
+{
+	int n = 0;
+	for (int t = 0; t < p_kernel->taps; ++t) {
+		const uint8_t *row = rows[p_kernel->row[t]];
+		if (row == NULL) continue;
+		src[n] = row + p_kernel->offset[t];
+		weight[n] = p_kernel->weight[t];
+		++n;
+	}
+	return n;
+}
+
+/**
+ *    Filter the bytes [@begin, @end) of a row, which have both horizontal
+ * neighbors, without any bounds check.
+ */
+static void filter_interior_scalar(uint8_t *dst, const uint8_t *src[9],
+                                   const int weight[9], int taps,
+                                   int begin, int end)
+{
+	for (int k = begin; k < end; ++k) {
+		int sum = 0;
+		for (int t = 0; t < taps; ++t) {
+			sum += src[t][k] * weight[t];
+		}
+		dst[k] = clamp_pixel(sum);
+	}
+}
+
+/**
+ *    Get the bytes [@p_begin, @p_end) of the pixels [@from, @to) of a row of
+ * @width pixels that have both horizontal neighbors.
+ */
+static inline void interior_range(int width, int from, int to, int bpp,
+                                  int *p_begin, int *p_end)
+{
+	*p_begin = (from > 1 ? from : 1) * bpp;
+	*p_end = (to < width - 1 ? to : width - 1) * bpp;
+}
+
+/**
+ *    Filter the first and the last pixel of a row of @width pixels when they
+ * are among the pixels [@from, @to).
+ */
+static void filter_borders(uint8_t *dst, const uint8_t *rows[3], int width,
+                           int from, int to, const filter_kernel_t *p_kernel)
+{
+	if (from == 0) filter_border(dst, rows, width, 0, p_kernel);
+	if (to == width && width > 1) {
+		filter_border(dst, rows, width, width - 1, p_kernel);
+	}
+}
+
+static void filter_row_scalar(uint8_t *dst, const uint8_t *rows[3],
+                              int width, int from, int to,
+                              const filter_kernel_t *p_kernel)
+{
+	const uint8_t *src[9];
+	int weight[9];
+	int taps = active_taps(src, weight, rows, p_kernel);
+	int begin, end;
+
+	interior_range(width, from, to, p_kernel->bpp, &begin, &end);
+	filter_borders(dst, rows, width, from, to, p_kernel);
+	filter_interior_scalar(dst, src, weight, taps, begin, end);
+}
+
+/*   Kernels of SPECIALIZE_SIZE and their helpers, inlined in every case   */
+#define SPECIALIZED static inline __attribute__((always_inline))
+
+/**
+ *    Call @fn with its arguments followed by @size, which is a constant for
+ * the common sizes of the kernels so that the loops over their taps are
+ * unrolled.
+ */
+#define SPECIALIZE_SIZE(size, fn, ...) \
+	do { \
+		switch (size) { \
+		case 3: fn(__VA_ARGS__, 3); break; \
+		case 5: fn(__VA_ARGS__, 5); break; \
+		case 7: fn(__VA_ARGS__, 7); break; \
+		default: fn(__VA_ARGS__, size); break; \
+		} \
+	} while (0)
+
+/**
+ *    Divide @sum like @p_kernel says, rounding to the nearest, and clamp it.
+ */
+static inline uint8_t scale_pixel(int32_t sum,
+                                  const convolution_kernel_t *p_kernel)
+{
+	int32_t x = sum + p_kernel->half;
+	int32_t q;
+
+	if (p_kernel->shift >= 0) return clamp_pixel(x >> p_kernel->shift);
+	q = x / p_kernel->divisor;
+	if (q * p_kernel->divisor > x) --q;
+	return clamp_pixel(q);
+}
+
+/**
+ *    Get the shift dividing by @divisor, or -1 if it isn't a power of two.
+ */
+static inline int divisor_shift(int divisor)
+{
+	return (divisor & (divisor - 1)) == 0 ? __builtin_ctz(divisor) : -1;
+}
+
+/**
+ *    Check if the sums of @p_kernel can be divided by the SIMD kernels.
+ */
+static inline int simd_scale(const convolution_kernel_t *p_kernel)
+{
+	return p_kernel->shift >= 0 || p_kernel->small;
+}
+
+/**
+ *    Get the range [@p_from, @p_to) of the bytes of a row of @width pixels
+ * whose taps are all inside the row.
+ */
+static void interior_bytes(int width, const convolution_kernel_t *p_kernel,
+                           int *p_from, int *p_to)
+{
+	int length = width * p_kernel->bpp;
+	int edge = p_kernel->size / 2 * p_kernel->bpp;
+
+	*p_from = 2 * edge < length ? edge : length;
+	*p_to = 2 * edge < length ? length - edge : length;
+}
+
+/**
+ *    Get the sum of the taps of the byte @k of the row @src of @length
+ * bytes, with @n @weights, that are inside the row.
+ */
+static inline int32_t border_sum(const uint8_t *src, int length, int k,
+                                 const int *weights, int n, int bpp)
+{
+	int32_t sum = 0;
+
+	for (int t = 0; t < n; ++t) {
+		int q = k + (t - n / 2) * bpp;
+		if (q >= 0 && q < length) sum += src[q] * weights[t];
+	}
+	return sum;
+}
+
+/**
+ *    Get the sum of the @n taps of the byte @k of a row, without any bounds
+ * check. @p points to the first tap of the byte 0.
+ */
+static inline int32_t interior_sum(const uint8_t *p, int k, const int *weights,
+                                   int bpp, int n)
+{
+	int32_t sum = 0;
+
+	for (int t = 0; t < n; ++t) sum += p[k + t * bpp] * weights[t];
+	return sum;
+}
+
+/**
+ *    Convolve horizontally the bytes of the row @src of @width pixels that
+ * have taps outside of it, and get the range [@p_from, @p_to) of the other
+ * ones.
+ */
+static void horizontal_edges(int32_t *dst, const uint8_t *src, int width,
+                             const int *weights,
+                             const convolution_kernel_t *p_kernel,
+                             int accumulate, int *p_from, int *p_to)
+{
+	int bpp = p_kernel->bpp, n = p_kernel->size;
+	int length = width * bpp;
+
+	/* The bytes before the interior and the ones after it */
+	interior_bytes(width, p_kernel, p_from, p_to);
+	int edges[2][2] = {{0, *p_from}, {*p_to, length}};
+	for (int e = 0; e < 2; ++e) {
+		for (int k = edges[e][0]; k < edges[e][1]; ++k) {
+			int32_t sum = border_sum(src, length, k, weights, n,
+			                         bpp);
+			dst[k] = accumulate ? dst[k] + sum : sum;
+		}
+	}
+}
+
+SPECIALIZED void horizontal_range_scalar(int32_t *dst, const uint8_t *src,
+                                         int from, int to, const int *weights,
+                                         int bpp, int accumulate, int n)
+{
+	const uint8_t *p = src - n / 2 * bpp;
+
+	for (int k = from; k < to; ++k) {
+		int32_t sum = interior_sum(p, k, weights, bpp, n);
+		dst[k] = accumulate ? dst[k] + sum : sum;
+	}
+}
+
+static void horizontal_row_scalar(int32_t *dst, const uint8_t *src,
+                                  int width, const int *weights,
+                                  const convolution_kernel_t *p_kernel,
+                                  int accumulate)
+{
+	int from, to;
+
+	horizontal_edges(dst, src, width, weights, p_kernel, accumulate,
+	                 &from, &to);
+	SPECIALIZE_SIZE(p_kernel->size, horizontal_range_scalar, dst, src,
+	                from, to, weights, p_kernel->bpp, accumulate);
+}
+
+static void scale_range_scalar(uint8_t *dst, const int32_t *sums, int from,
+                               int to, const convolution_kernel_t *p_kernel)
+{
+	for (int k = from; k < to; ++k) {
+		dst[k] = scale_pixel(sums[k], p_kernel);
+	}
+}
+
+static void scale_row_scalar(uint8_t *dst, const int32_t *sums, int width,
+                             const convolution_kernel_t *p_kernel)
+{
+	scale_range_scalar(dst, sums, 0, width * p_kernel->bpp, p_kernel);
+}
+
+/**
+ *    Convolve the bytes of the row @src with the horizontal factor of
+ * @p_kernel, like horizontal_edges.
+ */
+static void separable_edges(int16_t *dst, const uint8_t *src, int width,
+                            const convolution_kernel_t *p_kernel,
+                            int *p_from, int *p_to)
+{
+	int bpp = p_kernel->bpp, n = p_kernel->size;
+	int length = width * bpp;
+
+	/* The bytes before the interior and the ones after it */
+	interior_bytes(width, p_kernel, p_from, p_to);
+	int edges[2][2] = {{0, *p_from}, {*p_to, length}};
+	for (int e = 0; e < 2; ++e) {
+		for (int k = edges[e][0]; k < edges[e][1]; ++k) {
+			dst[k] = border_sum(src, length, k,
+			                    p_kernel->horizontal, n, bpp);
+		}
+	}
+}
+
+SPECIALIZED void separable_range_scalar(int16_t *dst, const uint8_t *src,
+                                        int from, int to, const int *weights,
+                                        int bpp, int n)
+{
+	const uint8_t *p = src - n / 2 * bpp;
+
+	for (int k = from; k < to; ++k) {
+		dst[k] = interior_sum(p, k, weights, bpp, n);
+	}
+}
+
+static void separable_row_scalar(int16_t *dst, const uint8_t *src,
+                                 int width,
+                                 const convolution_kernel_t *p_kernel)
+{
+	int from, to;
+
+	separable_edges(dst, src, width, p_kernel, &from, &to);
+	SPECIALIZE_SIZE(p_kernel->size, separable_range_scalar, dst, src,
+	                from, to, p_kernel->horizontal, p_kernel->bpp);
+}
+
+SPECIALIZED void vertical_range_scalar(uint8_t *dst, const int16_t *rows[],
+                                       const int *weights, int from, int to,
+                                       const convolution_kernel_t *p_kernel,
+                                       int n)
+{
+	for (int k = from; k < to; ++k) {
+		int32_t sum = 0;
+		for (int t = 0; t < n; ++t) sum += rows[t][k] * weights[t];
+		dst[k] = scale_pixel(sum, p_kernel);
+	}
+}
+
+static void vertical_row_scalar(uint8_t *dst, const int16_t *rows[],
+                                const int *weights, int count, int width,
+                                const convolution_kernel_t *p_kernel)
+{
+	SPECIALIZE_SIZE(count, vertical_range_scalar, dst, rows, weights, 0,
+	                width * p_kernel->bpp, p_kernel);
+}
+
+/**
+ *    Get the reciprocal of @count that box_divide multiplies by.
+ */
+static inline uint64_t box_reciprocal(int count)
+{
+	return ((uint64_t)1 << BOX_RECIPROCAL_SHIFT) / count + 1;
+}
+
+/**
+ *    Divide @sum by @count, rounding to the nearest, with the @reciprocal of
+ * @count. It is exact since @sum + @count / 2 < 256 * @count and 256 *
+ * @count * @count < 1 << BOX_RECIPROCAL_SHIFT.
+ */
+static inline uint8_t box_divide(uint32_t sum, int count, uint64_t reciprocal)
+{
+	return (sum + count / 2) * reciprocal >> BOX_RECIPROCAL_SHIFT;
+}
+
+/**
+ *    Store in @dst the average of the pixel @j of the row @src, whose window
+ * is clipped by an edge of the row, then slide the window one pixel right.
+ */
+SPECIALIZED void box_edge_pixel(uint8_t *dst, const uint8_t *src,
+                                uint32_t *sums, int j, int width, int radius,
+                                int bpp)
+{
+	int lo = j - radius, hi = j + radius;
+	int count = (hi < width ? hi : width - 1) - (lo > 0 ? lo : 0) + 1;
+	uint64_t reciprocal = box_reciprocal(count);
+
+	for (int c = 0; c < bpp; ++c) {
+		if (hi < width) sums[c] += src[hi * bpp + c];
+		dst[j * bpp + c] = box_divide(sums[c], count, reciprocal);
+		if (lo >= 0) sums[c] -= src[lo * bpp + c];
+	}
+}
+
+/**
+ *    Blur the row @src like box_row_horizontal, keeping the sums of the
+ * window of every channel: the pixels whose window is clipped by an edge are
+ * [0, @from) and [@to, @width).
+ */
+SPECIALIZED void box_range_scalar(uint8_t *dst, const uint8_t *src,
+                                  int width, int radius, int bpp)
+{
+	uint32_t sums[sizeof(pixel_t)] = {0};
+	int count = 2 * radius + 1;
+	uint64_t reciprocal = box_reciprocal(count);
+	int from = radius < width ? radius : width;
+	int to = width - radius > from ? width - radius : from;
+	int offset = radius * bpp;
+
+	for (int x = 0; x < from; ++x) {
+		for (int c = 0; c < bpp; ++c) sums[c] += src[x * bpp + c];
+	}
+	for (int j = 0; j < from; ++j) {
+		box_edge_pixel(dst, src, sums, j, width, radius, bpp);
+	}
+	for (int k = from * bpp; k < to * bpp; k += bpp) {
+		for (int c = 0; c < bpp; ++c) {
+			sums[c] += src[k + offset + c];
+			dst[k + c] = box_divide(sums[c], count, reciprocal);
+			sums[c] -= src[k - offset + c];
+		}
+	}
+	for (int j = to; j < width; ++j) {
+		box_edge_pixel(dst, src, sums, j, width, radius, bpp);
+	}
+}
+
+static void box_vertical_range_scalar(uint8_t *dst, int32_t *sums,
+                                      const uint8_t *add, const uint8_t *sub,
+                                      int from, int to, int count)
+{
+	for (int k = from; k < to; ++k) {
+		if (dst != NULL) dst[k] = (sums[k] + count / 2) / count;
+		sums[k] += add[k] - sub[k];
+	}
+}
+
+static void box_vertical_row_scalar(uint8_t *dst, int32_t *sums,
+                                    const uint8_t *add, const uint8_t *sub,
+                                    int length, int count)
+{
+	box_vertical_range_scalar(dst, sums, add, sub, 0, length, count);
+}
+
+#ifdef KERNELS_X86
+/*
+ *    The SIMD filter kernels work on the bytes of the rows, since the
+ * channels are independent, and keep the sums in 16-bit lanes. packus clamps
+ * them to [0, MAX_PIXEL_VALUE] for free.
+ */
+static void filter_row_sse2(uint8_t *dst, const uint8_t *rows[3],
+                            int width, int from, int to,
+                            const filter_kernel_t *p_kernel)
+{
+	const uint8_t *src[9];
+	int weight[9];
+	__m128i wv[9];
+	const __m128i zero = _mm_setzero_si128();
+	int taps = active_taps(src, weight, rows, p_kernel);
+	int k, end;
+
+	if (!p_kernel->narrow) {
+		filter_row_scalar(dst, rows, width, from, to, p_kernel);
+		return;
+	}
+	for (int t = 0; t < taps; ++t) wv[t] = _mm_set1_epi16(weight[t]);
+
+	interior_range(width, from, to, p_kernel->bpp, &k, &end);
+	filter_borders(dst, rows, width, from, to, p_kernel);
+	for (; k + 16 <= end; k += 16) {
+		__m128i lo = zero, hi = zero;
+		for (int t = 0; t < taps; ++t) {
+			__m128i v = _mm_loadu_si128(
+				(const __m128i *)(src[t] + k));
+			lo = _mm_add_epi16(lo, _mm_mullo_epi16(
+				_mm_unpacklo_epi8(v, zero), wv[t]));
+			hi = _mm_add_epi16(hi, _mm_mullo_epi16(
+				_mm_unpackhi_epi8(v, zero), wv[t]));
+		}
+		_mm_storeu_si128((__m128i *)(dst + k),
+		                 _mm_packus_epi16(lo, hi));
+	}
+	filter_interior_scalar(dst, src, weight, taps, k, end);
+}
+
+__attribute__((target("avx2")))
+static void filter_row_avx2(uint8_t *dst, const uint8_t *rows[3],
+                            int width, int from, int to,
+                            const filter_kernel_t *p_kernel)
+{
+	const uint8_t *src[9];
+	int weight[9];
+	__m256i wv[9];
+	int taps = active_taps(src, weight, rows, p_kernel);
+	int k, end;
+
+	if (!p_kernel->narrow) {
+		filter_row_scalar(dst, rows, width, from, to, p_kernel);
+		return;
+	}
+	for (int t = 0; t < taps; ++t) wv[t] = _mm256_set1_epi16(weight[t]);
+
+	interior_range(width, from, to, p_kernel->bpp, &k, &end);
+	filter_borders(dst, rows, width, from, to, p_kernel);
+	for (; k + 32 <= end; k += 32) {
+		__m256i lo = _mm256_setzero_si256(), hi = lo;
+		for (int t = 0; t < taps; ++t) {
+			const __m128i *p = (const __m128i *)(src[t] + k);
+			lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(
+				_mm256_cvtepu8_epi16(_mm_loadu_si128(p)),
+				wv[t]));
+			hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(
+				_mm256_cvtepu8_epi16(_mm_loadu_si128(p + 1)),
+				wv[t]));
+		}
+		/* packus interleaves the lanes, put them back in order */
+		_mm256_storeu_si256((__m256i *)(dst + k),
+			_mm256_permute4x64_epi64(
+				_mm256_packus_epi16(lo, hi), 0xD8));
+	}
+	filter_interior_scalar(dst, src, weight, taps, k, end);
+}
+
+/*
+ *    The SIMD grayscale kernels work on groups of 8 pixels (24 bytes), loaded
+ * as the bytes [0, 16) and [8, 24) of the group so that nothing past the group
+ * is read. The shuffles below move every channel in its own 16-bit lane and
+ * then replicate the gray values in triplets. x / 3 is computed as
+ * (x * 0xAAAB) >> 17, which is exact for every x <= 3 * MAX_PIXEL_VALUE.
+ */
+#define X 0x80
+#define GRAY_LO(c) c, X, 3 + c, X, 6 + c, X, 9 + c, X, 12 + c, X, \
+	X, X, X, X, X, X
+#define GRAY_HI(c) X, X, X, X, X, X, X, X, X, X, \
+	7 + c, X, 10 + c, X, 13 + c, X
+#define TRIPLETS(k) k / 3, (k + 1) / 3, (k + 2) / 3, (k + 3) / 3, \
+	(k + 4) / 3, (k + 5) / 3, (k + 6) / 3, (k + 7) / 3, (k + 8) / 3, \
+	(k + 9) / 3, (k + 10) / 3, (k + 11) / 3, (k + 12) / 3, \
+	(k + 13) / 3, (k + 14) / 3, (k + 15) / 3
+
+static const int8_t gray_masks[9][16] __attribute__((aligned(16))) = {
+	{GRAY_LO(0)}, {GRAY_LO(1)}, {GRAY_LO(2)},
+	{GRAY_HI(0)}, {GRAY_HI(1)}, {GRAY_HI(2)},
+	{TRIPLETS(0)}, {TRIPLETS(16)}, {TRIPLETS(32)}
+};
+
+#undef GRAY_LO
+#undef GRAY_HI
+#undef TRIPLETS
+#undef X
+
+/**
+ *    Compute the gray values of 8 pixels from their channels widened to
+ * 16 bits.
+ *    @return the gray values in 16-bit lanes;
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i gray_lanes_sse41(__m128i b, __m128i g, __m128i r)
+{
+	const __m128i third = _mm_set1_epi16((short)0xAAAB);
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(b, g), r);
+	return _mm_srli_epi16(_mm_mulhi_epu16(sum, third), 1);
+}
+
+/**
+ *    Compute the gray values of the 8 pixels at @in.
+ *    @return the gray values in the low 8 bytes;
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i gray8_sse41(const uint8_t *in, const __m128i *m)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)in);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(in + 8));
+	__m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, m[0]),
+	                         _mm_shuffle_epi8(hi, m[3]));
+	__m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, m[1]),
+	                         _mm_shuffle_epi8(hi, m[4]));
+	__m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, m[2]),
+	                         _mm_shuffle_epi8(hi, m[5]));
+	__m128i gray = gray_lanes_sse41(b, g, r);
+	return _mm_packus_epi16(gray, gray);
+}
+
+__attribute__((target("sse4.1")))
+static void grayscale_row_sse41(pixel_t *dst, const pixel_t *src, int width)
+{
+	const __m128i *m = (const __m128i *)gray_masks;
+	const uint8_t *in = (const uint8_t *)src;
+	uint8_t *out = (uint8_t *)dst;
+	int j;
+
+	for (j = 0; j + 8 <= width; j += 8, in += 24, out += 24) {
+		__m128i gray = gray8_sse41(in, m);
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(gray, m[6]));
+		_mm_storel_epi64((__m128i *)(out + 16),
+		                 _mm_shuffle_epi8(gray, m[7]));
+	}
+	grayscale_row_scalar(dst + j, src + j, width - j);
+}
+
+__attribute__((target("sse4.1")))
+static void luma_row_sse41(uint8_t *dst, const pixel_t *src, int width)
+{
+	const __m128i *m = (const __m128i *)gray_masks;
+	const uint8_t *in = (const uint8_t *)src;
+	int j;
+
+	for (j = 0; j + 8 <= width; j += 8, in += 24) {
+		_mm_storel_epi64((__m128i *)(dst + j), gray8_sse41(in, m));
+	}
+	luma_row_scalar(dst + j, src + j, width - j);
+}
+
+__attribute__((target("sse4.1")))
+static void expand_luma_row_sse41(pixel_t *dst, const uint8_t *src,
+                                  int width)
+{
+	const __m128i *m = (const __m128i *)gray_masks;
+	uint8_t *out = (uint8_t *)dst;
+	int j;
+
+	for (j = 0; j + 16 <= width; j += 16, out += 48) {
+		__m128i gray = _mm_loadu_si128((const __m128i *)(src + j));
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(gray, m[6]));
+		_mm_storeu_si128((__m128i *)(out + 16),
+		                 _mm_shuffle_epi8(gray, m[7]));
+		_mm_storeu_si128((__m128i *)(out + 32),
+		                 _mm_shuffle_epi8(gray, m[8]));
+	}
+	expand_luma_row_scalar(dst + j, src + j, width - j);
+}
+
+/*
+ *    The SIMD planar kernels convert 16 pixels (48 bytes) at once. GATHER
+ * builds the masks picking the bytes of channel c of these pixels out of
+ * their 16-byte vector v, SCATTER the ones placing the 16 bytes of channel c
+ * in the output vector v.
+ */
+#define X 0x80
+#define PICK(c, v, k) ((3 * (k) + (c)) / 16 == (v) ? (3 * (k) + (c)) % 16 : X)
+#define GATHER(c, v) PICK(c, v, 0), PICK(c, v, 1), PICK(c, v, 2), \
+	PICK(c, v, 3), PICK(c, v, 4), PICK(c, v, 5), PICK(c, v, 6), \
+	PICK(c, v, 7), PICK(c, v, 8), PICK(c, v, 9), PICK(c, v, 10), \
+	PICK(c, v, 11), PICK(c, v, 12), PICK(c, v, 13), PICK(c, v, 14), \
+	PICK(c, v, 15)
+#define PLACE(v, c, k) ((16 * (v) + (k)) % 3 == (c) ? (16 * (v) + (k)) / 3 : X)
+#define SCATTER(v, c) PLACE(v, c, 0), PLACE(v, c, 1), PLACE(v, c, 2), \
+	PLACE(v, c, 3), PLACE(v, c, 4), PLACE(v, c, 5), PLACE(v, c, 6), \
+	PLACE(v, c, 7), PLACE(v, c, 8), PLACE(v, c, 9), PLACE(v, c, 10), \
+	PLACE(v, c, 11), PLACE(v, c, 12), PLACE(v, c, 13), PLACE(v, c, 14), \
+	PLACE(v, c, 15)
+
+static const int8_t planar_masks[18][16] __attribute__((aligned(16))) = {
+	{GATHER(0, 0)}, {GATHER(0, 1)}, {GATHER(0, 2)},
+	{GATHER(1, 0)}, {GATHER(1, 1)}, {GATHER(1, 2)},
+	{GATHER(2, 0)}, {GATHER(2, 1)}, {GATHER(2, 2)},
+	{SCATTER(0, 0)}, {SCATTER(0, 1)}, {SCATTER(0, 2)},
+	{SCATTER(1, 0)}, {SCATTER(1, 1)}, {SCATTER(1, 2)},
+	{SCATTER(2, 0)}, {SCATTER(2, 1)}, {SCATTER(2, 2)}
+};
+
+#undef PICK
+#undef GATHER
+#undef PLACE
+#undef SCATTER
+#undef X
+
+__attribute__((target("sse4.1")))
+static void deinterleave_row_sse41(uint8_t *channels[3], const pixel_t *src,
+                                   int width)
+{
+	const __m128i *m = (const __m128i *)planar_masks;
+	const uint8_t *in = (const uint8_t *)src;
+	int j;
+
+	for (j = 0; j + 16 <= width; j += 16, in += 48) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)in);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(in + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(in + 32));
+		for (int c = 0; c < 3; ++c) {
+			const __m128i *mc = m + 3 * c;
+			__m128i x = _mm_or_si128(_mm_shuffle_epi8(v0, mc[0]),
+				_mm_or_si128(_mm_shuffle_epi8(v1, mc[1]),
+				             _mm_shuffle_epi8(v2, mc[2])));
+			_mm_storeu_si128((__m128i *)(channels[c] + j), x);
+		}
+	}
+	deinterleave_range_scalar(channels, src, j, width);
+}
+
+__attribute__((target("sse4.1")))
+static void interleave_row_sse41(pixel_t *dst, const uint8_t *channels[3],
+                                 int width)
+{
+	const __m128i *m = (const __m128i *)planar_masks + 9;
+	uint8_t *out = (uint8_t *)dst;
+	int j;
+
+	for (j = 0; j + 16 <= width; j += 16, out += 48) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(channels[0] + j));
+		__m128i g = _mm_loadu_si128((const __m128i *)(channels[1] + j));
+		__m128i r = _mm_loadu_si128((const __m128i *)(channels[2] + j));
+		for (int v = 0; v < 3; ++v) {
+			const __m128i *mv = m + 3 * v;
+			__m128i x = _mm_or_si128(_mm_shuffle_epi8(b, mv[0]),
+				_mm_or_si128(_mm_shuffle_epi8(g, mv[1]),
+				             _mm_shuffle_epi8(r, mv[2])));
+			_mm_storeu_si128((__m128i *)(out + 16 * v), x);
+		}
+	}
+	interleave_range_scalar(dst, channels, j, width);
+}
+
+__attribute__((target("sse4.1")))
+static void luma_planar_row_sse41(uint8_t *dst, const uint8_t *channels[3],
+                                  int width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int j;
+
+	for (j = 0; j + 16 <= width; j += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(channels[0] + j));
+		__m128i g = _mm_loadu_si128((const __m128i *)(channels[1] + j));
+		__m128i r = _mm_loadu_si128((const __m128i *)(channels[2] + j));
+		__m128i lo = gray_lanes_sse41(_mm_cvtepu8_epi16(b),
+			_mm_cvtepu8_epi16(g), _mm_cvtepu8_epi16(r));
+		__m128i hi = gray_lanes_sse41(_mm_unpackhi_epi8(b, zero),
+			_mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(r, zero));
+		_mm_storeu_si128((__m128i *)(dst + j),
+		                 _mm_packus_epi16(lo, hi));
+	}
+	luma_planar_range_scalar(dst, channels, j, width);
+}
+
+/*
+ *    The SIMD boundary kernel compares 16 pixels (48 bytes) at once with the
+ * rows above and below and with the row shifted by one pixel both ways. Then
+ * the 3 bytes of every pixel are merged into the first one and the shuffles
+ * below gather these first bytes, so movemask gives one bit per pixel.
+ */
+#define X 0x80
+static const int8_t boundary_masks[3][16] __attribute__((aligned(16))) = {
+	{0, 3, 6, 9, 12, 15, X, X, X, X, X, X, X, X, X, X},
+	{X, X, X, X, X, X, 2, 5, 8, 11, 14, X, X, X, X, X},
+	{X, X, X, X, X, X, X, X, X, X, X, 1, 4, 7, 10, 13}
+};
+#undef X
+
+__attribute__((target("sse4.1")))
+static void boundary_row_sse41(uint64_t *bits, const pixel_t *rows[3],
+                               int width)
+{
+	const __m128i *m = (const __m128i *)boundary_masks;
+	const __m128i ones = _mm_set1_epi8(-1);
+	int j = 16;
+
+	memset(bits, 0, (width + 63) / 64 * sizeof(uint64_t));
+	if (rows[0] == NULL || rows[2] == NULL) {
+		boundary_range(bits, rows, width, 0, width);
+		return;
+	}
+
+	/* Blocks start on 16 pixels, with a pixel on each side of them */
+	boundary_range(bits, rows, width, 0, width < 16 ? width : 16);
+	for (; j + 17 <= width; j += 16) {
+		const uint8_t *up = (const uint8_t *)(rows[0] + j);
+		const uint8_t *in = (const uint8_t *)(rows[1] + j);
+		const uint8_t *down = (const uint8_t *)(rows[2] + j);
+		__m128i n[3];
+		for (int v = 0; v < 3; ++v) {
+			__m128i x = _mm_loadu_si128(
+				(const __m128i *)(in + 16 * v));
+			__m128i eq = _mm_and_si128(
+				_mm_cmpeq_epi8(x, _mm_loadu_si128(
+					(const __m128i *)(up + 16 * v))),
+				_mm_cmpeq_epi8(x, _mm_loadu_si128(
+					(const __m128i *)(down + 16 * v))));
+			eq = _mm_and_si128(eq, _mm_cmpeq_epi8(x,
+				_mm_loadu_si128(
+					(const __m128i *)(in + 16 * v - 3))));
+			eq = _mm_and_si128(eq, _mm_cmpeq_epi8(x,
+				_mm_loadu_si128(
+					(const __m128i *)(in + 16 * v + 3))));
+			n[v] = _mm_xor_si128(eq, ones);
+		}
+		__m128i s0 = _mm_or_si128(n[0], _mm_or_si128(
+			_mm_alignr_epi8(n[1], n[0], 1),
+			_mm_alignr_epi8(n[1], n[0], 2)));
+		__m128i s1 = _mm_or_si128(n[1], _mm_or_si128(
+			_mm_alignr_epi8(n[2], n[1], 1),
+			_mm_alignr_epi8(n[2], n[1], 2)));
+		__m128i s2 = _mm_or_si128(n[2], _mm_or_si128(
+			_mm_srli_si128(n[2], 1), _mm_srli_si128(n[2], 2)));
+		__m128i flags = _mm_or_si128(_mm_shuffle_epi8(s0, m[0]),
+			_mm_or_si128(_mm_shuffle_epi8(s1, m[1]),
+			             _mm_shuffle_epi8(s2, m[2])));
+		uint16_t mask = _mm_movemask_epi8(flags);
+		memcpy((uint8_t *)bits + j / 8, &mask, sizeof(mask));
+	}
+	boundary_range(bits, rows, width, j, width);
+}
+
+/**
+ *    Load the 16 bytes at @lo into the low lane and the ones at @hi into the
+ * high lane of a 256-bit register.
+ */
+__attribute__((target("avx2")))
+static inline __m256i load_lanes(const uint8_t *lo, const uint8_t *hi)
+{
+	__m256i v = _mm256_castsi128_si256(
+		_mm_loadu_si128((const __m128i *)lo));
+	return _mm256_inserti128_si256(v,
+		_mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+/**
+ *    Compute the gray values of 16 pixels from their channels widened to
+ * 16 bits.
+ *    @return the gray values in 16-bit lanes;
+ */
+__attribute__((target("avx2")))
+static inline __m256i gray_lanes_avx2(__m256i b, __m256i g, __m256i r)
+{
+	const __m256i third = _mm256_set1_epi16((short)0xAAAB);
+	__m256i sum = _mm256_add_epi16(_mm256_add_epi16(b, g), r);
+	return _mm256_srli_epi16(_mm256_mulhi_epu16(sum, third), 1);
+}
+
+/**
+ *    Compute the gray values of the 16 pixels at @in, 8 in each lane.
+ *    @return the gray values in the low 8 bytes of every lane;
+ */
+__attribute__((target("avx2")))
+static inline __m256i gray16_avx2(const uint8_t *in, const __m256i *mask)
+{
+	__m256i lo = load_lanes(in, in + 24);
+	__m256i hi = load_lanes(in + 8, in + 32);
+	__m256i b = _mm256_or_si256(_mm256_shuffle_epi8(lo, mask[0]),
+	                            _mm256_shuffle_epi8(hi, mask[3]));
+	__m256i g = _mm256_or_si256(_mm256_shuffle_epi8(lo, mask[1]),
+	                            _mm256_shuffle_epi8(hi, mask[4]));
+	__m256i r = _mm256_or_si256(_mm256_shuffle_epi8(lo, mask[2]),
+	                            _mm256_shuffle_epi8(hi, mask[5]));
+	__m256i gray = gray_lanes_avx2(b, g, r);
+	return _mm256_packus_epi16(gray, gray);
+}
+
+/**
+ *    Copy the grayscale masks in both lanes of 256-bit registers.
+ */
+__attribute__((target("avx2")))
+static inline void load_gray_masks_avx2(__m256i mask[9])
+{
+	const __m128i *m = (const __m128i *)gray_masks;
+	for (int k = 0; k < 9; ++k) {
+		mask[k] = _mm256_broadcastsi128_si256(_mm_load_si128(m + k));
+	}
+}
+
+__attribute__((target("avx2")))
+static void grayscale_row_avx2(pixel_t *dst, const pixel_t *src, int width)
+{
+	const uint8_t *in = (const uint8_t *)src;
+	uint8_t *out = (uint8_t *)dst;
+	__m256i mask[9];
+	int j;
+
+	load_gray_masks_avx2(mask);
+
+	/* Each lane handles its own group of 8 pixels */
+	for (j = 0; j + 16 <= width; j += 16, in += 48, out += 48) {
+		__m256i gray = gray16_avx2(in, mask);
+		__m256i out0 = _mm256_shuffle_epi8(gray, mask[6]);
+		__m256i out1 = _mm256_shuffle_epi8(gray, mask[7]);
+		_mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(out0));
+		_mm_storel_epi64((__m128i *)(out + 16),
+		                 _mm256_castsi256_si128(out1));
+		_mm_storeu_si128((__m128i *)(out + 24),
+		                 _mm256_extracti128_si256(out0, 1));
+		_mm_storel_epi64((__m128i *)(out + 40),
+		                 _mm256_extracti128_si256(out1, 1));
+	}
+	grayscale_row_sse41(dst + j, src + j, width - j);
+}
+
+__attribute__((target("avx2")))
+static void luma_row_avx2(uint8_t *dst, const pixel_t *src, int width)
+{
+	const uint8_t *in = (const uint8_t *)src;
+	__m256i mask[9];
+	int j;
+
+	load_gray_masks_avx2(mask);
+	for (j = 0; j + 16 <= width; j += 16, in += 48) {
+		__m256i gray = gray16_avx2(in, mask);
+		_mm_storel_epi64((__m128i *)(dst + j),
+		                 _mm256_castsi256_si128(gray));
+		_mm_storel_epi64((__m128i *)(dst + j + 8),
+		                 _mm256_extracti128_si256(gray, 1));
+	}
+	luma_row_sse41(dst + j, src + j, width - j);
+}
+
+/**
+ *    Load the 16 bytes at @p widened to 16 bits.
+ */
+__attribute__((target("avx2")))
+static inline __m256i load_widened(const uint8_t *p)
+{
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+__attribute__((target("avx2")))
+static void luma_planar_row_avx2(uint8_t *dst, const uint8_t *channels[3],
+                                 int width)
+{
+	int j;
+
+	for (j = 0; j + 32 <= width; j += 32) {
+		__m256i lo = gray_lanes_avx2(load_widened(channels[0] + j),
+			load_widened(channels[1] + j),
+			load_widened(channels[2] + j));
+		__m256i hi = gray_lanes_avx2(load_widened(channels[0] + j + 16),
+			load_widened(channels[1] + j + 16),
+			load_widened(channels[2] + j + 16));
+
+		/* packus interleaves the lanes of lo and hi */
+		_mm256_storeu_si256((__m256i *)(dst + j),
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi),
+			                         0xD8));
+	}
+	const uint8_t *tail[3] = {
+		channels[0] + j, channels[1] + j, channels[2] + j};
+	luma_planar_row_sse41(dst + j, tail, width - j);
+}
+
+/*
+ *    The SIMD convolution kernels keep the horizontal sums of the separable
+ * kernels in 16-bit lanes and add up their rows two at a time with madd,
+ * into 32-bit lanes. The other kernels add up their horizontal sums in
+ * 32-bit lanes. The divided sums are clamped by packs and packus.
+ */
+
+/*   Constants of the division of the sums, see scale_pixel   */
+typedef struct {
+	__m128i half, divisor, divisor1, shift;
+	__m128 reciprocal;
+	int use_shift;
+} scale_sse41_t;
+
+static void load_scale_sse41(scale_sse41_t *p_scale, int divisor)
+{
+	int shift = divisor_shift(divisor);
+
+	p_scale->half = _mm_set1_epi32(divisor / 2);
+	p_scale->divisor = _mm_set1_epi32(divisor);
+	p_scale->divisor1 = _mm_set1_epi32(divisor - 1);
+	p_scale->shift = _mm_cvtsi32_si128(shift);
+	p_scale->reciprocal = _mm_set1_ps(1.0f / divisor);
+	p_scale->use_shift = shift >= 0;
+}
+
+/**
+ *    Divide the sums @x, rounding to the nearest. The product by the
+ * reciprocal of the divisor is off by at most one when the sums are small,
+ * which the sign of the remainder fixes.
+ */
+__attribute__((target("sse4.1")))
+SPECIALIZED __m128i scale_sse41(__m128i x, const scale_sse41_t *p_scale)
+{
+	x = _mm_add_epi32(x, p_scale->half);
+	if (p_scale->use_shift) return _mm_sra_epi32(x, p_scale->shift);
+
+	__m128i q = _mm_cvttps_epi32(
+		_mm_mul_ps(_mm_cvtepi32_ps(x), p_scale->reciprocal));
+	__m128i r = _mm_sub_epi32(x, _mm_mullo_epi32(q, p_scale->divisor));
+	q = _mm_add_epi32(q, _mm_cmplt_epi32(r, _mm_setzero_si128()));
+	return _mm_sub_epi32(q, _mm_cmpgt_epi32(r, p_scale->divisor1));
+}
+
+/**
+ *    Get the weights @weights[@t] and @weights[@t + 1], or 0 past the @n
+ * weights, as the pair of 16-bit lanes madd multiplies two rows by.
+ */
+static inline int weight_pair(const int *weights, int t, int n)
+{
+	uint32_t second = t + 1 < n ? (uint16_t)weights[t + 1] : 0;
+	return (int)((uint16_t)weights[t] | second << 16);
+}
+
+__attribute__((target("sse4.1")))
+SPECIALIZED void horizontal_range_sse41(int32_t *dst, const uint8_t *src,
+                                        int from, int to, const int *weights,
+                                        int bpp, int accumulate, int n)
+{
+	const uint8_t *p = src - n / 2 * bpp;
+	__m128i wv[CONVOLUTION_MAX_SIZE];
+	int k = from;
+
+	for (int t = 0; t < n; ++t) wv[t] = _mm_set1_epi32(weights[t]);
+	for (; k + 8 <= to; k += 8) {
+		__m128i lo = _mm_setzero_si128(), hi = lo;
+		if (accumulate) {
+			lo = _mm_loadu_si128((const __m128i *)(dst + k));
+			hi = _mm_loadu_si128((const __m128i *)(dst + k + 4));
+		}
+		for (int t = 0; t < n; ++t) {
+			__m128i v = _mm_loadl_epi64(
+				(const __m128i *)(p + k + t * bpp));
+			lo = _mm_add_epi32(lo, _mm_mullo_epi32(
+				_mm_cvtepu8_epi32(v), wv[t]));
+			hi = _mm_add_epi32(hi, _mm_mullo_epi32(
+				_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)),
+				wv[t]));
+		}
+		_mm_storeu_si128((__m128i *)(dst + k), lo);
+		_mm_storeu_si128((__m128i *)(dst + k + 4), hi);
+	}
+	horizontal_range_scalar(dst, src, k, to, weights, bpp, accumulate, n);
+}
+
+__attribute__((target("sse4.1")))
+static void horizontal_row_sse41(int32_t *dst, const uint8_t *src,
+                                 int width, const int *weights,
+                                 const convolution_kernel_t *p_kernel,
+                                 int accumulate)
+{
+	int from, to;
+
+	horizontal_edges(dst, src, width, weights, p_kernel, accumulate,
+	                 &from, &to);
+	SPECIALIZE_SIZE(p_kernel->size, horizontal_range_sse41, dst, src,
+	                from, to, weights, p_kernel->bpp, accumulate);
+}
+
+__attribute__((target("sse4.1")))
+static void scale_row_sse41(uint8_t *dst, const int32_t *sums, int width,
+                            const convolution_kernel_t *p_kernel)
+{
+	scale_sse41_t scale;
+	int length = width * p_kernel->bpp;
+	int k = 0;
+
+	load_scale_sse41(&scale, p_kernel->divisor);
+	for (; k + 16 <= length && simd_scale(p_kernel); k += 16) {
+		__m128i s[4];
+		for (int v = 0; v < 4; ++v) {
+			s[v] = scale_sse41(_mm_loadu_si128(
+				(const __m128i *)(sums + k + 4 * v)), &scale);
+		}
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_packus_epi16(
+			_mm_packs_epi32(s[0], s[1]),
+			_mm_packs_epi32(s[2], s[3])));
+	}
+	scale_range_scalar(dst, sums, k, length, p_kernel);
+}
+
+__attribute__((target("sse4.1")))
+SPECIALIZED void separable_range_sse41(int16_t *dst, const uint8_t *src,
+                                       int from, int to, const int *weights,
+                                       int bpp, int n)
+{
+	const uint8_t *p = src - n / 2 * bpp;
+	__m128i wv[CONVOLUTION_MAX_SIZE];
+	int k = from;
+
+	for (int t = 0; t < n; ++t) wv[t] = _mm_set1_epi16(weights[t]);
+	for (; k + 8 <= to; k += 8) {
+		__m128i sum = _mm_setzero_si128();
+		for (int t = 0; t < n; ++t) {
+			sum = _mm_add_epi16(sum, _mm_mullo_epi16(
+				_mm_cvtepu8_epi16(_mm_loadl_epi64(
+					(const __m128i *)(p + k + t * bpp))),
+				wv[t]));
+		}
+		_mm_storeu_si128((__m128i *)(dst + k), sum);
+	}
+	separable_range_scalar(dst, src, k, to, weights, bpp, n);
+}
+
+__attribute__((target("sse4.1")))
+static void separable_row_sse41(int16_t *dst, const uint8_t *src, int width,
+                                const convolution_kernel_t *p_kernel)
+{
+	int from, to;
+
+	separable_edges(dst, src, width, p_kernel, &from, &to);
+	SPECIALIZE_SIZE(p_kernel->size, separable_range_sse41, dst, src,
+	                from, to, p_kernel->horizontal, p_kernel->bpp);
+}
+
+/**
+ *    Add up the @n rows of horizontal sums at the bytes [@k, @k + 8) times
+ * their weights, paired in @wp, and divide them.
+ *    @return the results in 16-bit lanes;
+ */
+__attribute__((target("sse4.1")))
+SPECIALIZED __m128i vertical8_sse41(const int16_t *rows[], const __m128i *wp,
+                                    int k, const scale_sse41_t *p_scale, int n)
+{
+	__m128i lo = _mm_setzero_si128(), hi = lo;
+
+	for (int t = 0; t < n; t += 2) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(rows[t] + k));
+		__m128i b = t + 1 < n ? _mm_loadu_si128(
+			(const __m128i *)(rows[t + 1] + k))
+			: _mm_setzero_si128();
+		lo = _mm_add_epi32(lo,
+			_mm_madd_epi16(_mm_unpacklo_epi16(a, b), wp[t / 2]));
+		hi = _mm_add_epi32(hi,
+			_mm_madd_epi16(_mm_unpackhi_epi16(a, b), wp[t / 2]));
+	}
+	return _mm_packs_epi32(scale_sse41(lo, p_scale),
+	                       scale_sse41(hi, p_scale));
+}
+
+__attribute__((target("sse4.1")))
+SPECIALIZED void vertical_range_sse41(uint8_t *dst, const int16_t *rows[],
+                                      const int *weights, int length,
+                                      const convolution_kernel_t *p_kernel,
+                                      int n)
+{
+	__m128i wp[(CONVOLUTION_MAX_SIZE + 1) / 2];
+	scale_sse41_t scale;
+	int k = 0;
+
+	for (int t = 0; t < n; t += 2) {
+		wp[t / 2] = _mm_set1_epi32(weight_pair(weights, t, n));
+	}
+	load_scale_sse41(&scale, p_kernel->divisor);
+	for (; k + 16 <= length && simd_scale(p_kernel); k += 16) {
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_packus_epi16(
+			vertical8_sse41(rows, wp, k, &scale, n),
+			vertical8_sse41(rows, wp, k + 8, &scale, n)));
+	}
+	vertical_range_scalar(dst, rows, weights, k, length, p_kernel, n);
+}
+
+__attribute__((target("sse4.1")))
+static void vertical_row_sse41(uint8_t *dst, const int16_t *rows[],
+                               const int *weights, int count, int width,
+                               const convolution_kernel_t *p_kernel)
+{
+	SPECIALIZE_SIZE(count, vertical_range_sse41, dst, rows, weights,
+	                width * p_kernel->bpp, p_kernel);
+}
+
+/**
+ *    Divide the column sums of the box blur and add the row @add minus the
+ * row @sub to them, 16 bytes at a time. The sums are below 1 << 22, so the
+ * float reciprocal of scale_sse41 is exact.
+ */
+__attribute__((target("sse4.1")))
+static void box_vertical_row_sse41(uint8_t *dst, int32_t *sums,
+                                   const uint8_t *add, const uint8_t *sub,
+                                   int length, int count)
+{
+	scale_sse41_t scale;
+	int k = 0;
+
+	load_scale_sse41(&scale, count);
+	for (; k + 16 <= length; k += 16) {
+		__m128i s[4];
+		for (int v = 0; v < 4; ++v) {
+			__m128i *p = (__m128i *)(sums + k + 4 * v);
+			__m128i a = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(
+				*(const int32_t *)(add + k + 4 * v)));
+			__m128i b = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(
+				*(const int32_t *)(sub + k + 4 * v)));
+			s[v] = _mm_loadu_si128(p);
+			_mm_storeu_si128(p, _mm_add_epi32(s[v],
+			                                  _mm_sub_epi32(a, b)));
+		}
+		if (dst == NULL) continue;
+		for (int v = 0; v < 4; ++v) s[v] = scale_sse41(s[v], &scale);
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_packus_epi16(
+			_mm_packs_epi32(s[0], s[1]),
+			_mm_packs_epi32(s[2], s[3])));
+	}
+	box_vertical_range_scalar(dst, sums, add, sub, k, length, count);
+}
+
+/*   Constants of the division of the sums, like scale_sse41_t   */
+typedef struct {
+	__m256i half, divisor, divisor1;
+	__m128i shift;
+	__m256 reciprocal;
+	int use_shift;
+} scale_avx2_t;
+
+__attribute__((target("avx2")))
+static void load_scale_avx2(scale_avx2_t *p_scale, int divisor)
+{
+	int shift = divisor_shift(divisor);
+
+	p_scale->half = _mm256_set1_epi32(divisor / 2);
+	p_scale->divisor = _mm256_set1_epi32(divisor);
+	p_scale->divisor1 = _mm256_set1_epi32(divisor - 1);
+	p_scale->shift = _mm_cvtsi32_si128(shift);
+	p_scale->reciprocal = _mm256_set1_ps(1.0f / divisor);
+	p_scale->use_shift = shift >= 0;
+}
+
+/**
+ *    Divide the sums @x like scale_sse41.
+ */
+__attribute__((target("avx2")))
+SPECIALIZED __m256i scale_avx2(__m256i x, const scale_avx2_t *p_scale)
+{
+	x = _mm256_add_epi32(x, p_scale->half);
+	if (p_scale->use_shift) return _mm256_sra_epi32(x, p_scale->shift);
+
+	__m256i q = _mm256_cvttps_epi32(
+		_mm256_mul_ps(_mm256_cvtepi32_ps(x), p_scale->reciprocal));
+	__m256i r = _mm256_sub_epi32(x,
+		_mm256_mullo_epi32(q, p_scale->divisor));
+	q = _mm256_add_epi32(q,
+		_mm256_cmpgt_epi32(_mm256_setzero_si256(), r));
+	return _mm256_sub_epi32(q, _mm256_cmpgt_epi32(r, p_scale->divisor1));
+}
+
+__attribute__((target("avx2")))
+SPECIALIZED void horizontal_range_avx2(int32_t *dst, const uint8_t *src,
+                                       int from, int to, const int *weights,
+                                       int bpp, int accumulate, int n)
+{
+	const uint8_t *p = src - n / 2 * bpp;
+	__m256i wv[CONVOLUTION_MAX_SIZE];
+	int k = from;
+
+	for (int t = 0; t < n; ++t) wv[t] = _mm256_set1_epi32(weights[t]);
+	for (; k + 16 <= to; k += 16) {
+		__m256i lo = _mm256_setzero_si256(), hi = lo;
+		if (accumulate) {
+			lo = _mm256_loadu_si256((const __m256i *)(dst + k));
+			hi = _mm256_loadu_si256((const __m256i *)(dst + k + 8));
+		}
+		for (int t = 0; t < n; ++t) {
+			const uint8_t *q = p + k + t * bpp;
+			lo = _mm256_add_epi32(lo, _mm256_mullo_epi32(
+				_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					(const __m128i *)q)), wv[t]));
+			hi = _mm256_add_epi32(hi, _mm256_mullo_epi32(
+				_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					(const __m128i *)(q + 8))), wv[t]));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + k), lo);
+		_mm256_storeu_si256((__m256i *)(dst + k + 8), hi);
+	}
+	horizontal_range_scalar(dst, src, k, to, weights, bpp, accumulate, n);
+}
+
+__attribute__((target("avx2")))
+static void horizontal_row_avx2(int32_t *dst, const uint8_t *src,
+                                int width, const int *weights,
+                                const convolution_kernel_t *p_kernel,
+                                int accumulate)
+{
+	int from, to;
+
+	horizontal_edges(dst, src, width, weights, p_kernel, accumulate,
+	                 &from, &to);
+	SPECIALIZE_SIZE(p_kernel->size, horizontal_range_avx2, dst, src,
+	                from, to, weights, p_kernel->bpp, accumulate);
+}
+
+__attribute__((target("avx2")))
+static void scale_row_avx2(uint8_t *dst, const int32_t *sums, int width,
+                           const convolution_kernel_t *p_kernel)
+{
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	scale_avx2_t scale;
+	int length = width * p_kernel->bpp;
+	int k = 0;
+
+	load_scale_avx2(&scale, p_kernel->divisor);
+	for (; k + 32 <= length && simd_scale(p_kernel); k += 32) {
+		__m256i s[4];
+		for (int v = 0; v < 4; ++v) {
+			s[v] = scale_avx2(_mm256_loadu_si256(
+				(const __m256i *)(sums + k + 8 * v)), &scale);
+		}
+		/* The packs interleave the dwords of the four vectors */
+		__m256i bytes = _mm256_packus_epi16(
+			_mm256_packs_epi32(s[0], s[1]),
+			_mm256_packs_epi32(s[2], s[3]));
+		_mm256_storeu_si256((__m256i *)(dst + k),
+			_mm256_permutevar8x32_epi32(bytes, order));
+	}
+	scale_range_scalar(dst, sums, k, length, p_kernel);
+}
+
+__attribute__((target("avx2")))
+SPECIALIZED void separable_range_avx2(int16_t *dst, const uint8_t *src,
+                                      int from, int to, const int *weights,
+                                      int bpp, int n)
+{
+	const uint8_t *p = src - n / 2 * bpp;
+	__m256i wv[CONVOLUTION_MAX_SIZE];
+	int k = from;
+
+	for (int t = 0; t < n; ++t) wv[t] = _mm256_set1_epi16(weights[t]);
+	for (; k + 16 <= to; k += 16) {
+		__m256i sum = _mm256_setzero_si256();
+		for (int t = 0; t < n; ++t) {
+			sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(
+				_mm256_cvtepu8_epi16(_mm_loadu_si128(
+					(const __m128i *)(p + k + t * bpp))),
+				wv[t]));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + k), sum);
+	}
+	separable_range_scalar(dst, src, k, to, weights, bpp, n);
+}
+
+__attribute__((target("avx2")))
+static void separable_row_avx2(int16_t *dst, const uint8_t *src, int width,
+                               const convolution_kernel_t *p_kernel)
+{
+	int from, to;
+
+	separable_edges(dst, src, width, p_kernel, &from, &to);
+	SPECIALIZE_SIZE(p_kernel->size, separable_range_avx2, dst, src,
+	                from, to, p_kernel->horizontal, p_kernel->bpp);
+}
+
+/**
+ *    Add up the rows at the bytes [@k, @k + 16) like vertical8_sse41. The
+ * unpacks split every lane in two, which packs puts back in order.
+ *    @return the results in 16-bit lanes;
+ */
+__attribute__((target("avx2")))
+SPECIALIZED __m256i vertical16_avx2(const int16_t *rows[], const __m256i *wp,
+                                    int k, const scale_avx2_t *p_scale, int n)
+{
+	__m256i lo = _mm256_setzero_si256(), hi = lo;
+
+	for (int t = 0; t < n; t += 2) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(rows[t] + k));
+		__m256i b = t + 1 < n ? _mm256_loadu_si256(
+			(const __m256i *)(rows[t + 1] + k))
+			: _mm256_setzero_si256();
+		lo = _mm256_add_epi32(lo, _mm256_madd_epi16(
+			_mm256_unpacklo_epi16(a, b), wp[t / 2]));
+		hi = _mm256_add_epi32(hi, _mm256_madd_epi16(
+			_mm256_unpackhi_epi16(a, b), wp[t / 2]));
+	}
+	return _mm256_packs_epi32(scale_avx2(lo, p_scale),
+	                          scale_avx2(hi, p_scale));
+}
+
+__attribute__((target("avx2")))
+SPECIALIZED void vertical_range_avx2(uint8_t *dst, const int16_t *rows[],
+                                     const int *weights, int length,
+                                     const convolution_kernel_t *p_kernel,
+                                     int n)
+{
+	__m256i wp[(CONVOLUTION_MAX_SIZE + 1) / 2];
+	scale_avx2_t scale;
+	int k = 0;
+
+	for (int t = 0; t < n; t += 2) {
+		wp[t / 2] = _mm256_set1_epi32(weight_pair(weights, t, n));
+	}
+	load_scale_avx2(&scale, p_kernel->divisor);
+	for (; k + 32 <= length && simd_scale(p_kernel); k += 32) {
+		/* packus interleaves the lanes, put them back in order */
+		_mm256_storeu_si256((__m256i *)(dst + k),
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(
+				vertical16_avx2(rows, wp, k, &scale, n),
+				vertical16_avx2(rows, wp, k + 16, &scale, n)),
+				0xD8));
+	}
+	vertical_range_scalar(dst, rows, weights, k, length, p_kernel, n);
+}
+
+__attribute__((target("avx2")))
+static void vertical_row_avx2(uint8_t *dst, const int16_t *rows[],
+                              const int *weights, int count, int width,
+                              const convolution_kernel_t *p_kernel)
+{
+	SPECIALIZE_SIZE(count, vertical_range_avx2, dst, rows, weights,
+	                width * p_kernel->bpp, p_kernel);
+}
+/**
+ *    Divide and update the column sums of the box blur like
+ * box_vertical_row_sse41, 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static void box_vertical_row_avx2(uint8_t *dst, int32_t *sums,
+                                  const uint8_t *add, const uint8_t *sub,
+                                  int length, int count)
+{
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	scale_avx2_t scale;
+	int k = 0;
+
+	load_scale_avx2(&scale, count);
+	for (; k + 32 <= length; k += 32) {
+		__m256i s[4];
+		for (int v = 0; v < 4; ++v) {
+			__m256i *p = (__m256i *)(sums + k + 8 * v);
+			__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+				(const __m128i *)(add + k + 8 * v)));
+			__m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+				(const __m128i *)(sub + k + 8 * v)));
+			s[v] = _mm256_loadu_si256(p);
+			_mm256_storeu_si256(p, _mm256_add_epi32(s[v],
+				_mm256_sub_epi32(a, b)));
+		}
+		if (dst == NULL) continue;
+		for (int v = 0; v < 4; ++v) s[v] = scale_avx2(s[v], &scale);
+		__m256i bytes = _mm256_packus_epi16(
+			_mm256_packs_epi32(s[0], s[1]),
+			_mm256_packs_epi32(s[2], s[3]));
+		_mm256_storeu_si256((__m256i *)(dst + k),
+			_mm256_permutevar8x32_epi32(bytes, order));
+	}
+	box_vertical_range_scalar(dst, sums, add, sub, k, length, count);
+}
+#endif
+
+/*   Kernels selected at startup   */
+static const char *selected_name = KERNELS_SCALAR;
+static void (*selected_grayscale_row)(pixel_t *, const pixel_t *, int)
+	= grayscale_row_scalar;
+static void (*selected_luma_row)(uint8_t *, const pixel_t *, int)
+	= luma_row_scalar;
+static void (*selected_expand_luma_row)(pixel_t *, const uint8_t *, int)
+	= expand_luma_row_scalar;
+static void (*selected_deinterleave_row)(uint8_t *[3], const pixel_t *, int)
+	= deinterleave_row_scalar;
+static void (*selected_interleave_row)(pixel_t *, const uint8_t *[3], int)
+	= interleave_row_scalar;
+static void (*selected_luma_planar_row)(uint8_t *, const uint8_t *[3], int)
+	= luma_planar_row_scalar;
+static void (*selected_filter_row)(uint8_t *, const uint8_t *[3], int, int,
+                                   int, const filter_kernel_t *)
+	= filter_row_scalar;
+static void (*selected_boundary_row)(uint64_t *, const pixel_t *[3], int)
+	= boundary_row_scalar;
+static void (*selected_horizontal_row)(int32_t *, const uint8_t *, int,
+                                       const int *,
+                                       const convolution_kernel_t *, int)
+	= horizontal_row_scalar;
+static void (*selected_scale_row)(uint8_t *, const int32_t *, int,
+                                  const convolution_kernel_t *)
+	= scale_row_scalar;
+static void (*selected_separable_row)(int16_t *, const uint8_t *, int,
+                                      const convolution_kernel_t *)
+	= separable_row_scalar;
+static void (*selected_vertical_row)(uint8_t *, const int16_t *[],
+                                     const int *, int, int,
+                                     const convolution_kernel_t *)
+	= vertical_row_scalar;
+static void (*selected_box_vertical_row)(uint8_t *, int32_t *,
+                                         const uint8_t *, const uint8_t *,
+                                         int, int)
+	= box_vertical_row_scalar;
+
+__attribute__((constructor))
+static void select_kernels(void)
+{
+#ifdef KERNELS_X86
+	const char *cap = getenv(KERNELS_ENV);
+	int allow_avx2 = 1, allow_sse41 = 1;
+
+	if (cap != NULL && strcmp(cap, KERNELS_SCALAR) == 0) {
+		allow_avx2 = allow_sse41 = 0;
+	} else if (cap != NULL && strcmp(cap, KERNELS_SSE41) == 0) {
+		allow_avx2 = 0;
+	}
+
+	__builtin_cpu_init();
+	if (allow_avx2 && __builtin_cpu_supports("avx2")) {
+		selected_name = KERNELS_AVX2;
+		selected_grayscale_row = grayscale_row_avx2;
+		selected_luma_row = luma_row_avx2;
+		selected_expand_luma_row = expand_luma_row_sse41;
+		selected_deinterleave_row = deinterleave_row_sse41;
+		selected_interleave_row = interleave_row_sse41;
+		selected_luma_planar_row = luma_planar_row_avx2;
+		selected_filter_row = filter_row_avx2;
+		selected_boundary_row = boundary_row_sse41;
+		selected_horizontal_row = horizontal_row_avx2;
+		selected_scale_row = scale_row_avx2;
+		selected_separable_row = separable_row_avx2;
+		selected_vertical_row = vertical_row_avx2;
+		selected_box_vertical_row = box_vertical_row_avx2;
+	} else if (allow_sse41 && __builtin_cpu_supports("sse4.1")) {
+		selected_name = KERNELS_SSE41;
+		selected_grayscale_row = grayscale_row_sse41;
+		selected_luma_row = luma_row_sse41;
+		selected_expand_luma_row = expand_luma_row_sse41;
+		selected_deinterleave_row = deinterleave_row_sse41;
+		selected_interleave_row = interleave_row_sse41;
+		selected_luma_planar_row = luma_planar_row_sse41;
+		selected_filter_row = filter_row_sse2;
+		selected_boundary_row = boundary_row_sse41;
+		selected_horizontal_row = horizontal_row_sse41;
+		selected_scale_row = scale_row_sse41;
+		selected_separable_row = separable_row_sse41;
+		selected_vertical_row = vertical_row_sse41;
+		selected_box_vertical_row = box_vertical_row_sse41;
+	}
+#endif
+}
+
+const char *kernels_name(void)
+{
+	return selected_name;
+}
+
+void grayscale_row(pixel_t *dst, const pixel_t *src, int width)
+{
+	selected_grayscale_row(dst, src, width);
+}
+
+void luma_row(uint8_t *dst, const pixel_t *src, int width)
+{
+	selected_luma_row(dst, src, width);
+}
+
+void expand_luma_row(pixel_t *dst, const uint8_t *src, int width)
+{
+	selected_expand_luma_row(dst, src, width);
+}
+
+void deinterleave_row(uint8_t *channels[3], const pixel_t *src, int width)
+{
+	selected_deinterleave_row(channels, src, width);
+}
+
+void interleave_row(pixel_t *dst, const uint8_t *channels[3], int width)
+{
+	selected_interleave_row(dst, channels, width);
+}
+
+void luma_planar_row(uint8_t *dst, const uint8_t *channels[3], int width)
+{
+	selected_luma_planar_row(dst, channels, width);
+}
+
+void prepare_filter(filter_kernel_t *p_kernel, int filter[3][3], int bpp)
+{
+	int total = 0;
+
+	p_kernel->bpp = bpp;
+	p_kernel->taps = 0;
+	for (int p = 0; p < 3; ++p) {
+		for (int q = 0; q < 3; ++q) {
+			int t = p_kernel->taps;
+			if (filter[p][q] == 0) continue;
+			p_kernel->row[t] = p;
+			p_kernel->offset[t] = (q - 1) * bpp;
+			p_kernel->weight[t] = filter[p][q];
+			total += abs(filter[p][q]);
+			++p_kernel->taps;
+		}
+	}
+
+	/* Every partial sum is bounded by total * MAX_PIXEL_VALUE */
+	p_kernel->narrow = total <= INT16_MAX / MAX_PIXEL_VALUE;
+}
+
+void filter_row(uint8_t *dst, const uint8_t *rows[3], int width,
+                const filter_kernel_t *p_kernel)
+{
+	selected_filter_row(dst, rows, width, 0, width, p_kernel);
+}
+
+void filter_row_range(uint8_t *dst, const uint8_t *rows[3], int width,
+                      int from, int to, const filter_kernel_t *p_kernel)
+{
+	selected_filter_row(dst, rows, width, from, to, p_kernel);
+}
+
+/**
+ *    Get the greatest common divisor of @a and @b, which are not negative.
+ */
+static int gcd(int a, int b)
+{
+	while (b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ *    Look for integer factors of the weights of @p_kernel: the first row
+ * with a non zero weight, divided by the gcd of its weights, and the column
+ * of the ratios of every row to it. The kernel is only separable when the
+ * horizontal sums and the vertical weights fit in 16 bits.
+ */
+static void find_factors(convolution_kernel_t *p_kernel)
+{
+	const int *weights = p_kernel->weights;
+	int n = p_kernel->size;
+	int pivot = 0, first = 0, g = 0, total = 0;
+
+	p_kernel->separable = 0;
+	while (pivot < n && !p_kernel->used[pivot]) ++pivot;
+	if (pivot == n) return;
+	for (int q = 0; q < n; ++q) g = gcd(g, abs(weights[pivot * n + q]));
+	for (int q = 0; q < n; ++q) {
+		p_kernel->horizontal[q] = weights[pivot * n + q] / g;
+		total += abs(p_kernel->horizontal[q]);
+	}
+	if (total > INT16_MAX / MAX_PIXEL_VALUE) return;
+	while (p_kernel->horizontal[first] == 0) ++first;
+
+	for (int p = 0; p < n; ++p) {
+		int c = weights[p * n + first] / p_kernel->horizontal[first];
+		if (abs(c) > INT16_MAX) return;
+		for (int q = 0; q < n; ++q) {
+			if (weights[p * n + q]
+			    != (int64_t)c * p_kernel->horizontal[q]) return;
+		}
+		p_kernel->vertical[p] = c;
+	}
+	p_kernel->separable = 1;
+}
+
+int prepare_convolution(convolution_kernel_t *p_kernel,
+                        const convolution_t *p_convolution, int bpp)
+{
+	int n = p_convolution->size, d = p_convolution->divisor;
+	int64_t total = 0;
+
+	if (n < 1 || n % 2 == 0 || n > CONVOLUTION_MAX_SIZE || d <= 0
+	    || p_convolution->weights == NULL) {
+		return 1;
+	}
+	for (int p = 0; p < n; ++p) {
+		p_kernel->used[p] = 0;
+		for (int q = 0; q < n; ++q) {
+			int w = p_convolution->weights[p * n + q];
+			p_kernel->weights[p * n + q] = w;
+			p_kernel->used[p] |= w != 0;
+			total += llabs(w);
+		}
+	}
+
+	/* Every partial sum is bounded by total * MAX_PIXEL_VALUE */
+	if (total * MAX_PIXEL_VALUE + d > INT32_MAX) return 1;
+
+	p_kernel->bpp = bpp;
+	p_kernel->size = n;
+	p_kernel->divisor = d;
+	p_kernel->half = d / 2;
+	p_kernel->shift = divisor_shift(d);
+	p_kernel->small = total * MAX_PIXEL_VALUE + d < 1 << 22;
+	find_factors(p_kernel);
+	return 0;
+}
+
+void convolve_row_horizontal(int32_t *dst, const uint8_t *src, int width,
+                             const int *weights,
+                             const convolution_kernel_t *p_kernel,
+                             int accumulate)
+{
+	selected_horizontal_row(dst, src, width, weights, p_kernel,
+	                        accumulate);
+}
+
+void convolve_row_scale(uint8_t *dst, const int32_t *sums, int width,
+                        const convolution_kernel_t *p_kernel)
+{
+	selected_scale_row(dst, sums, width, p_kernel);
+}
+
+void convolve_row_separable(int16_t *dst, const uint8_t *src, int width,
+                            const convolution_kernel_t *p_kernel)
+{
+	selected_separable_row(dst, src, width, p_kernel);
+}
+
+void convolve_row_vertical(uint8_t *dst, const int16_t *rows[],
+                           const int *weights, int count, int width,
+                           const convolution_kernel_t *p_kernel)
+{
+	selected_vertical_row(dst, rows, weights, count, width, p_kernel);
+}
+
+void box_row_horizontal(uint8_t *dst, const uint8_t *src, int width, int bpp,
+                        int radius)
+{
+	switch (bpp) {
+	case 1: box_range_scalar(dst, src, width, radius, 1); break;
+	case 3: box_range_scalar(dst, src, width, radius, 3); break;
+	default: box_range_scalar(dst, src, width, radius, bpp); break;
+	}
+}
+
+void box_row_vertical(uint8_t *dst, int32_t *sums, const uint8_t *add,
+                      const uint8_t *sub, int length, int count)
+{
+	selected_box_vertical_row(dst, sums, add, sub, length, count);
+}
+
+void boundary_row(uint64_t *bits, const pixel_t *rows[3], int width)
+{
+	selected_boundary_row(bits, rows, width);
+}
+
+void fill_pixels(pixel_t *dst, pixel_t color, int count)
+{
+	uint8_t *out = (uint8_t *)dst;
+	int j = 0;
+
+	/*
+	 * 16 pixels are 48 bytes, a whole number of vectors: the copies of the
+	 * pattern compile to plain vector stores on every target
+	 */
+	if (count >= 16) {
+		uint8_t pattern[16 * sizeof(pixel_t)];
+		for (int k = 0; k < 16; ++k) {
+			memcpy(pattern + k * sizeof(pixel_t), &color,
+			       sizeof(pixel_t));
+		}
+		for (; j + 16 <= count; j += 16, out += sizeof(pattern)) {
+			memcpy(out, pattern, sizeof(pattern));
+		}
+	}
+	for (; j < count; ++j, out += sizeof(pixel_t)) {
+		memcpy(out, &color, sizeof(pixel_t));
+	}
+}
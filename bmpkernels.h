@@ -0,0 +1,194 @@
+#ifndef BMPKERNELS_H
+#define BMPKERNELS_H
+
+#include "bmplib.h"
+
+/*   Names of the instruction sets the kernels can be compiled for   */
+#define KERNELS_SCALAR "scalar"
+#define KERNELS_SSE41 "sse4.1"
+#define KERNELS_AVX2 "avx2"
+
+/*   Environment variable capping the instruction set used by the kernels   */
+#define KERNELS_ENV "PC3_SIMD"
+
+/*   Structures declarations   */
+/**
+ *    A 3x3 filter prepared for the row kernels: only the taps with a non zero
+ * weight are kept. @bpp is the number of bytes of a pixel, so the channels are
+ * filtered independently, and @narrow tells whether the sums can't overflow
+ * 16 bits, which allows the SIMD kernels.
+ */
+typedef struct {
+	int bpp;
+	int narrow;
+	int taps;
+	int row[9];
+	int offset[9];
+	int weight[9];
+} filter_kernel_t;
+
+/**
+ *    A convolution prepared for the row kernels, for pixels of @bpp bytes.
+ * A @separable kernel is the product of the column @vertical by the row
+ * @horizontal, whose sums fit in 16 bits, and is applied in two passes. The
+ * other kernels keep their @weights row by row, @used telling which rows have
+ * a non zero weight, and add up their horizontal passes in 32 bits. The sums
+ * are then divided by @divisor after adding @half: with a shift when it is
+ * the power of two 1 << @shift (@shift is -1 otherwise), else by the SIMD
+ * kernels only when the sums are @small enough for a float reciprocal.
+ */
+typedef struct {
+	int bpp;
+	int size;
+	int separable;
+	int divisor;
+	int shift;
+	int half;
+	int small;
+	int horizontal[CONVOLUTION_MAX_SIZE];
+	int vertical[CONVOLUTION_MAX_SIZE];
+	int used[CONVOLUTION_MAX_SIZE];
+	int weights[CONVOLUTION_MAX_SIZE * CONVOLUTION_MAX_SIZE];
+} convolution_kernel_t;
+
+/*   Functions declarations   */
+/**
+ *    Get the name of the instruction set chosen at startup for the kernels.
+ * The best one supported by the CPU is used, unless KERNELS_ENV names a lower
+ * one.
+ *    @return one of KERNELS_SCALAR, KERNELS_SSE41 or KERNELS_AVX2;
+ */
+const char *kernels_name(void);
+
+/**
+ *    Store in @dst the grayscale version of the @width pixels of @src: every
+ * channel gets the truncated average of the three channels of the pixel.
+ */
+void grayscale_row(pixel_t *dst, const pixel_t *src, int width);
+
+/**
+ *    Store in @dst the gray values of the @width pixels of @src, one byte per
+ * pixel, computed like in grayscale_row.
+ */
+void luma_row(uint8_t *dst, const pixel_t *src, int width);
+
+/**
+ *    Expand the @width gray values of @src into pixels with three equal
+ * channels, stored in @dst.
+ */
+void expand_luma_row(pixel_t *dst, const uint8_t *src, int width);
+
+/**
+ *    Split the @width pixels of @src into their channels: @channels[0],
+ * @channels[1] and @channels[2] receive the b, g and r bytes.
+ */
+void deinterleave_row(uint8_t *channels[3], const pixel_t *src, int width);
+
+/**
+ *    Merge the @width bytes of the b, g and r @channels into the pixels of
+ * @dst, the inverse of deinterleave_row.
+ */
+void interleave_row(pixel_t *dst, const uint8_t *channels[3], int width);
+
+/**
+ *    Store in @dst the gray values of the @width pixels split in the b, g and
+ * r @channels, computed like in grayscale_row.
+ */
+void luma_planar_row(uint8_t *dst, const uint8_t *channels[3], int width);
+
+/**
+ *    Prepare @filter for the row kernels, for pixels of @bpp bytes.
+ */
+void prepare_filter(filter_kernel_t *p_kernel, int filter[3][3], int bpp);
+
+/**
+ *    Apply @p_kernel to the row @rows[1] of @width pixels, storing the result
+ * in @dst. @rows[0] and @rows[2] are the rows above and below it, or NULL at
+ * the top and bottom edges. Pixels outside the image count as 0 and the
+ * results are clamped to [0, MAX_PIXEL_VALUE].
+ */
+void filter_row(uint8_t *dst, const uint8_t *rows[3], int width,
+                const filter_kernel_t *p_kernel);
+
+/**
+ *    Apply @p_kernel to the pixels [@from, @to) of the row @rows[1] of
+ * @width pixels, like filter_row. Only these pixels of @dst are written, and
+ * the source rows are read one pixel around them.
+ */
+void filter_row_range(uint8_t *dst, const uint8_t *rows[3], int width,
+                      int from, int to, const filter_kernel_t *p_kernel);
+
+/**
+ *    Prepare @p_convolution for the row kernels, for pixels of @bpp bytes,
+ * looking for the factors of a separable kernel.
+ *    @return 0 if successful or an error code if the size, the divisor or
+ * the range of the sums is not supported;
+ */
+int prepare_convolution(convolution_kernel_t *p_kernel,
+                        const convolution_t *p_convolution, int bpp);
+
+/**
+ *    Convolve every channel of the row @src of @width pixels with the
+ * @p_kernel->size @weights, the pixels outside the row counting as 0. The
+ * sums are stored in @dst or, when @accumulate is not 0, added to it.
+ */
+void convolve_row_horizontal(int32_t *dst, const uint8_t *src, int width,
+                             const int *weights,
+                             const convolution_kernel_t *p_kernel,
+                             int accumulate);
+
+/**
+ *    Divide the sums of a row of @width pixels like @p_kernel says, clamp
+ * them to [0, MAX_PIXEL_VALUE] and store them in @dst.
+ */
+void convolve_row_scale(uint8_t *dst, const int32_t *sums, int width,
+                        const convolution_kernel_t *p_kernel);
+
+/**
+ *    Convolve the row @src of @width pixels with the horizontal factor of
+ * the separable @p_kernel, like convolve_row_horizontal.
+ */
+void convolve_row_separable(int16_t *dst, const uint8_t *src, int width,
+                            const convolution_kernel_t *p_kernel);
+
+/**
+ *    Add up the @count rows of horizontal sums @rows[t] times @weights[t],
+ * then divide and store the results like convolve_row_scale.
+ */
+void convolve_row_vertical(uint8_t *dst, const int16_t *rows[],
+                           const int *weights, int count, int width,
+                           const convolution_kernel_t *p_kernel);
+
+/**
+ *    Store in @dst the row @src of @width pixels of @bpp bytes, blurred by a
+ * horizontal box of 2 * @radius + 1 pixels: every channel is averaged over
+ * the pixels of the box inside the row, rounding to the nearest. The sums of
+ * the box slide along the row, so a pixel costs the same whatever @radius.
+ */
+void box_row_horizontal(uint8_t *dst, const uint8_t *src, int width, int bpp,
+                        int radius);
+
+/**
+ *    Store in @dst, unless it is NULL, the @length column @sums of a box
+ * divided by @count, rounding to the nearest, then add the row @add and
+ * subtract the row @sub to slide the box one row down. @count must be at most
+ * 2 * BLUR_MAX_RADIUS + 1.
+ */
+void box_row_vertical(uint8_t *dst, int32_t *sums, const uint8_t *add,
+                      const uint8_t *sub, int length, int count);
+
+/**
+ *    Set the @count pixels at @dst to @color.
+ */
+void fill_pixels(pixel_t *dst, pixel_t color, int count);
+
+/**
+ *    Store in @bits, one bit per pixel, the boundary of the row @rows[1] of
+ * @width pixels: the pixels on the edges of the image and the ones whose color
+ * differs from one of their 4 neighbors. @rows[0] and @rows[2] are the rows
+ * above and below it, or NULL at the top and bottom edges. The (@width + 63)
+ * / 64 words of @bits are overwritten.
+ */
+void boundary_row(uint64_t *bits, const pixel_t *rows[3], int width);
+
+#endif
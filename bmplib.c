@@ -1,8 +1,44 @@
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bmplib.h"
+#include "bmpio.h"
+#include "bmpkernels.h"
+#include "rans.h"
 #include "stack.h"
+#include "threadpool.h"
+
+/**
+ *    Get the distance between two rows of @row_size bytes, padded so that
+ * each row starts aligned.
+ */
+static inline int row_stride(int row_size)
+{
+	return (row_size + BITMAP_ROW_ALIGNMENT - 1)
+		/ BITMAP_ROW_ALIGNMENT * BITMAP_ROW_ALIGNMENT;
+}
+
+/**
+ *    Allocate an aligned buffer for @h rows of @row_size bytes, storing the
+ * padded row size in @p_stride.
+ *    @return the buffer or NULL if the allocation failed;
+ */
+static void *allocate_rows(int row_size, int h, int *p_stride)
+{
+	void *buffer;
+	int stride = row_stride(row_size);
+
+	/* Allocate the whole pixel array at once */
+	if (posix_memalign(&buffer, BITMAP_ROW_ALIGNMENT,
+	                   (size_t)stride * h) != 0) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	*p_stride = stride;
+	return buffer;
+}
 
 int initialize_bitmap(bitmap_t *p_bitmap, int w, int h)
 {
@@ -11,71 +47,263 @@ int initialize_bitmap(bitmap_t *p_bitmap, int w, int h)
 		return 1;
 	}
 
+	p_bitmap->buffer = allocate_rows(w * sizeof(pixel_t), h,
+	                                 &p_bitmap->stride);
+	p_bitmap->data = p_bitmap->buffer;
+	if (p_bitmap->buffer == NULL) return 1;
 	p_bitmap->width = w;
 	p_bitmap->height = h;
+	p_bitmap->mapped_size = 0;
+	p_bitmap->capacity = (size_t)p_bitmap->stride * h;
+	p_bitmap->compression = 0;
 
-	/* Allocate the pixel matrix, catching the allocation errors */
-	p_bitmap->pixels = malloc(h * sizeof(pixel_t *));
-	if (p_bitmap->pixels == NULL) {
-		fprintf(stderr, "Not enough memory\n");
+	return 0;
+}
+
+int reserve_bitmap(bitmap_t *p_bitmap, int w, int h)
+{
+	if (w <= 0 || h <= 0) {
+		fprintf(stderr, "Invalid height or width for bitmap\n");
 		return 1;
 	}
-	for (int i = 0; i < h; ++i) {
-		p_bitmap->pixels[i] = malloc(w * sizeof(pixel_t));
-		if (p_bitmap->pixels[i] == NULL) {
-			fprintf(stderr, "Not enough memory\n");
-			for (int j = 0; j < i; ++j) free(p_bitmap->pixels[j]);
-			free(p_bitmap->pixels);
-			p_bitmap->pixels = NULL;
+
+	/* Keep the buffer if the new rows fit in it */
+	int stride = row_stride(w * sizeof(pixel_t));
+	if (p_bitmap->buffer != NULL && p_bitmap->mapped_size == 0
+	    && (size_t)stride * h <= p_bitmap->capacity) {
+		p_bitmap->stride = stride;
+		p_bitmap->data = p_bitmap->buffer;
+		p_bitmap->width = w;
+		p_bitmap->height = h;
+		p_bitmap->compression = 0;
+		return 0;
+	}
+	clear_bitmap(p_bitmap);
+	return initialize_bitmap(p_bitmap, w, h);
+}
+
+int initialize_plane(plane_t *p_plane, int w, int h)
+{
+	if (w <= 0 || h <= 0) {
+		fprintf(stderr, "Invalid height or width for plane\n");
+		return 1;
+	}
+
+	p_plane->buffer = allocate_rows(w, h, &p_plane->stride);
+	p_plane->data = p_plane->buffer;
+	if (p_plane->buffer == NULL) return 1;
+	p_plane->width = w;
+	p_plane->height = h;
+	p_plane->capacity = (size_t)p_plane->stride * h;
+
+	return 0;
+}
+
+int reserve_plane(plane_t *p_plane, int w, int h)
+{
+	if (w <= 0 || h <= 0) {
+		fprintf(stderr, "Invalid height or width for plane\n");
+		return 1;
+	}
+
+	/* Keep the buffer if the new rows fit in it */
+	int stride = row_stride(w);
+	if (p_plane->buffer != NULL
+	    && (size_t)stride * h <= p_plane->capacity) {
+		p_plane->stride = stride;
+		p_plane->data = p_plane->buffer;
+		p_plane->width = w;
+		p_plane->height = h;
+		return 0;
+	}
+	clear_plane(p_plane);
+	return initialize_plane(p_plane, w, h);
+}
+
+int clear_plane(plane_t *p_plane)
+{
+	if (p_plane == NULL) return 0;
+	if (p_plane->buffer == NULL) return 0;
+	free(p_plane->buffer);
+	p_plane->buffer = NULL;
+	p_plane->data = NULL;
+	return 0;
+}
+
+int initialize_planar(planar_t *p_planar, int w, int h)
+{
+	for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+		if (initialize_plane(&p_planar->channels[c], w, h) != 0) {
+			while (c-- > 0) clear_plane(&p_planar->channels[c]);
 			return 1;
 		}
 	}
+	p_planar->width = w;
+	p_planar->height = h;
+
+	return 0;
+}
+
+int reserve_planar(planar_t *p_planar, int w, int h)
+{
+	for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+		if (reserve_plane(&p_planar->channels[c], w, h) != 0) return 1;
+	}
+	p_planar->width = w;
+	p_planar->height = h;
+
+	return 0;
+}
 
+int clear_planar(planar_t *p_planar)
+{
+	if (p_planar == NULL) return 0;
+	for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+		clear_plane(&p_planar->channels[c]);
+	}
 	return 0;
 }
 
+pixel_t **bitmap_row_pointers(const bitmap_t *p_bitmap)
+{
+	pixel_t **rows = malloc(p_bitmap->height * sizeof(pixel_t *));
+	if (rows == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	for (int i = 0; i < p_bitmap->height; ++i) {
+		rows[i] = bitmap_row(p_bitmap, i);
+	}
+	return rows;
+}
+
 int clear_bitmap(bitmap_t *p_bitmap)
 {
 	if (p_bitmap == NULL) return 0;
-	if (p_bitmap->pixels == NULL) return 0;
-	for (int i = 0; i < p_bitmap->height; ++i) free(p_bitmap->pixels[i]);
-	free(p_bitmap->pixels);
-	p_bitmap->pixels = NULL;
+	if (p_bitmap->buffer == NULL) return 0;
+	if (p_bitmap->mapped_size != 0) {
+		file_map_t map = {p_bitmap->buffer, p_bitmap->mapped_size, 0};
+		unmap_file(&map);
+	} else {
+		free(p_bitmap->buffer);
+	}
+	p_bitmap->buffer = NULL;
+	p_bitmap->data = NULL;
 	return 0;
 }
 
-int read_bmp(const char file_name[],
-             bmp_file_header_t *p_file_header,
-             bmp_info_header_t *p_info_header,
-             bitmap_t *p_bitmap)
+/*   Arguments of planar_band: exactly one of the destinations is set   */
+typedef struct {
+	bitmap_t *p_new_bitmap;
+	planar_t *p_new_planar;
+	const bitmap_t *p_bitmap;
+	const planar_t *p_planar;
+} planar_job_t;
+
+/**
+ *    Split or merge the channels of the rows [@begin, @end).
+ */
+static void planar_band(void *arg, int begin, int end)
 {
-	FILE *p_file;
-	int w, h, padding, e;
+	const planar_job_t *job = arg;
 
-	p_file = fopen(file_name, "rb");
-	if (p_file == NULL) {
-		fprintf(stderr, "Can't open file %s\n", file_name);
+	for (int i = begin; i < end; ++i) {
+		if (job->p_new_planar != NULL) {
+			uint8_t *channels[PLANAR_CHANNELS];
+			for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+				channels[c] = plane_row(
+					&job->p_new_planar->channels[c], i);
+			}
+			deinterleave_row(channels, bitmap_row(job->p_bitmap, i),
+			                 job->p_bitmap->width);
+		} else {
+			const uint8_t *channels[PLANAR_CHANNELS];
+			for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+				channels[c] = plane_row(
+					&job->p_planar->channels[c], i);
+			}
+			interleave_row(bitmap_row(job->p_new_bitmap, i),
+			               channels, job->p_planar->width);
+		}
+	}
+}
+
+int split_bitmap(planar_t *p_planar, const bitmap_t *p_bitmap)
+{
+	if (p_planar == NULL || p_bitmap == NULL
+	    || p_planar->width != p_bitmap->width
+	    || p_planar->height != p_bitmap->height) {
+		fprintf(stderr, "Invalid arguments");
 		return 1;
 	}
 
+	planar_job_t job = {NULL, p_planar, p_bitmap, NULL};
+	parallel_rows(p_bitmap->height,
+	              band_rows(2 * p_bitmap->width * sizeof(pixel_t)),
+	              planar_band, &job);
+
+	return 0;
+}
+
+int merge_planar(bitmap_t *p_bitmap, const planar_t *p_planar)
+{
+	if (p_bitmap == NULL || p_planar == NULL
+	    || p_bitmap->width != p_planar->width
+	    || p_bitmap->height != p_planar->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+
+	p_bitmap->compression = 0;
+	planar_job_t job = {p_bitmap, NULL, NULL, p_planar};
+	parallel_rows(p_planar->height,
+	              band_rows(2 * p_planar->width * sizeof(pixel_t)),
+	              planar_band, &job);
+
+	return 0;
+}
+
+/**
+ *    Read the File Header and the Info Header of the bmp file @p_file.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int read_bmp_headers(FILE *p_file,
+                            bmp_file_header_t *p_file_header,
+                            bmp_info_header_t *p_info_header)
+{
 	/* Read File Header */
-	e = fread(p_file_header, sizeof(bmp_file_header_t), 1, p_file);
-	if (e != 1) {
+	if (fread(p_file_header, sizeof(bmp_file_header_t), 1, p_file) != 1) {
 		fprintf(stderr, "Error while reading the File Header\n");
-		fclose(p_file);
 		return 1;
 	}
 	if (p_file_header->signature != BMP_SIGNATURE) {
 		fprintf(stderr, "Invalid BMP signature: %X\n",
 			p_file_header->signature);
-		fclose(p_file);
 		return 1;
 	}
 
 	/* Read Info Header */
-	e = fread(p_info_header, sizeof(bmp_info_header_t), 1, p_file);
-	if (e != 1) {
+	if (fread(p_info_header, sizeof(bmp_info_header_t), 1, p_file) != 1) {
 		fprintf(stderr, "Error while reading the Info Header\n");
+		return 1;
+	}
+	return 0;
+}
+
+int read_bmp(const char file_name[],
+             bmp_file_header_t *p_file_header,
+             bmp_info_header_t *p_info_header,
+             bitmap_t *p_bitmap)
+{
+	FILE *p_file;
+	int w, h, padding, e;
+
+	p_file = fopen(file_name, "rb");
+	if (p_file == NULL) {
+		fprintf(stderr, "Can't open file %s\n", file_name);
+		return 1;
+	}
+	if (read_bmp_headers(p_file, p_file_header, p_info_header) != 0) {
 		fclose(p_file);
 		return 1;
 	}
@@ -83,7 +311,7 @@ int read_bmp(const char file_name[],
 	/* Read the pixel array */
 	w = p_info_header->width;
 	h = p_info_header->height;
-	padding = (w * sizeof(pixel_t)) - (w * sizeof(pixel_t) / 4) * 4;
+	padding = bmp_row_padding(w);
 	e = initialize_bitmap(p_bitmap, w, h);
 	if (e != 0) {
 		fprintf(stderr, "Error while initializing the bitmap");
@@ -98,7 +326,8 @@ int read_bmp(const char file_name[],
 		return 1;
 	}
 	for (int i = h - 1; i >= 0; --i) {
-		e = fread(p_bitmap->pixels[i], sizeof(pixel_t), w, p_file);
+		e = fread(bitmap_row(p_bitmap, i), sizeof(pixel_t), w,
+			p_file);
 		if (e != w) {
 			fprintf(stderr, "Error while reading line %d\n", i);
 			fclose(p_file);
@@ -117,70 +346,314 @@ int read_bmp(const char file_name[],
 	return 0;
 }
 
+int read_bmp_mapped(const char file_name[],
+                    bmp_file_header_t *p_file_header,
+                    bmp_info_header_t *p_info_header,
+                    bitmap_t *p_bitmap)
+{
+	file_map_t map;
+	size_t row_size;
+	int w, h;
+
+	if (map_file(file_name, &map) != 0) {
+		return read_bmp(file_name, p_file_header, p_info_header,
+		                p_bitmap);
+	}
+
+	/* Read the headers */
+	if (map.size < sizeof(bmp_file_header_t) + sizeof(bmp_info_header_t)) {
+		fprintf(stderr, "Error while reading the headers\n");
+		unmap_file(&map);
+		return 1;
+	}
+	memcpy(p_file_header, map.data, sizeof(bmp_file_header_t));
+	memcpy(p_info_header, map.data + sizeof(bmp_file_header_t),
+	       sizeof(bmp_info_header_t));
+	if (p_file_header->signature != BMP_SIGNATURE) {
+		fprintf(stderr, "Invalid BMP signature: %X\n",
+			p_file_header->signature);
+		unmap_file(&map);
+		return 1;
+	}
+
+	/* Check that the whole pixel array is inside the file */
+	w = p_info_header->width;
+	h = p_info_header->height;
+	if (w <= 0 || h <= 0 || w > (INT_MAX - 3) / (int)sizeof(pixel_t)) {
+		fprintf(stderr, "Invalid height or width for bitmap\n");
+		unmap_file(&map);
+		return 1;
+	}
+	row_size = (size_t)w * sizeof(pixel_t) + bmp_row_padding(w);
+	if (p_file_header->offset > map.size
+	    || (map.size - p_file_header->offset) / row_size < (size_t)h) {
+		fprintf(stderr, "Error while reading the pixel array\n");
+		unmap_file(&map);
+		return 1;
+	}
+
+	/* The last row of the file is the first row of the bitmap */
+	p_bitmap->width = w;
+	p_bitmap->height = h;
+	p_bitmap->stride = -(int)row_size;
+	p_bitmap->data = map.data + p_file_header->offset
+		+ (size_t)(h - 1) * row_size;
+	p_bitmap->buffer = map.data;
+	p_bitmap->mapped_size = map.size;
+	p_bitmap->capacity = 0;
+	p_bitmap->compression = 0;
+
+	return 0;
+}
+
+/**
+ *    Write the File Header, the Info Header and the zero bytes up to the offset
+ * of the pixel array.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int write_bmp_headers(writer_t *p_writer,
+                             const bmp_file_header_t *p_file_header,
+                             const bmp_info_header_t *p_info_header)
+{
+	size_t size = sizeof(bmp_file_header_t) + sizeof(bmp_info_header_t);
+
+	if (writer_put(p_writer, p_file_header,
+	               sizeof(bmp_file_header_t)) != 0) {
+		fprintf(stderr, "Error while writing the File Header\n");
+		return 1;
+	}
+	if (writer_put(p_writer, p_info_header,
+	               sizeof(bmp_info_header_t)) != 0) {
+		fprintf(stderr, "Error while writing the Info Header\n");
+		return 1;
+	}
+	if (p_file_header->offset > size
+	    && writer_put_zeros(p_writer, p_file_header->offset - size) != 0) {
+		fprintf(stderr, "Error while writing to offset\n");
+		return 1;
+	}
+	return 0;
+}
+
 int write_bmp(const char file_name[],
               const bmp_file_header_t *p_file_header,
               const bmp_info_header_t *p_info_header,
               const bitmap_t *p_bitmap)
 {
-	FILE *p_file;
-	int w, h, padding, e;
+	writer_t writer;
+	int w, h, padding;
+	size_t row_size;
 
-	p_file = fopen(file_name, "wb");
-	if (p_file == NULL) {
-		fprintf(stderr, "Can't open file %s\n", file_name);
+	w = p_info_header->width;
+	h = p_info_header->height;
+	if (p_bitmap->width != w || p_bitmap->height != h) {
+		fprintf(stderr, "Invalid arguments");
 		return 1;
 	}
+	padding = bmp_row_padding(w);
+	row_size = (size_t)w * sizeof(pixel_t) + padding;
 
-	/* Write File Header */
-	e = fwrite(p_file_header, sizeof(bmp_file_header_t), 1, p_file);
-	if (e != 1) {
-		fprintf(stderr, "Error while writing the File Header\n");
-		fclose(p_file);
+	if (open_writer(&writer, file_name) != 0) return 1;
+	if (write_bmp_headers(&writer, p_file_header, p_info_header) != 0) {
+		close_writer(&writer);
 		return 1;
 	}
 
-	/* Write Info Header */
-	e = fwrite(p_info_header, sizeof(bmp_info_header_t), 1, p_file);
-	if (e != 1) {
-		fprintf(stderr, "Error while writing the Info Header\n");
-		fclose(p_file);
+	/* Write the pixel array */
+	if (p_bitmap->stride == -(int)row_size) {
+		/* The bitmap already has the layout of a bmp pixel array */
+		if (writer_put(&writer, bitmap_row(p_bitmap, h - 1),
+		               row_size * h) != 0) {
+			fprintf(stderr, "Error while writing the pixels\n");
+			close_writer(&writer);
+			return 1;
+		}
+		return close_writer(&writer);
+	}
+	for (int i = h - 1; i >= 0; --i) {
+		if (writer_put(&writer, bitmap_row(p_bitmap, i),
+		               w * sizeof(pixel_t)) != 0
+		    || writer_put_zeros(&writer, padding) != 0) {
+			fprintf(stderr, "Error while writing line %d\n", i);
+			close_writer(&writer);
+			return 1;
+		}
+	}
+
+	return close_writer(&writer);
+}
+
+/**
+ *    Write the @width gray values of @row as a row of a bmp file, expanded
+ * straight into the output buffer to pixels with three equal channels, and
+ * then its padding.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int write_luma_row(writer_t *p_writer, const uint8_t *row, int width)
+{
+	for (int j = 0; j < width; ) {
+		int n = width - j;
+		pixel_t *out;
+		if (n > (int)(p_writer->capacity / sizeof(pixel_t))) {
+			n = p_writer->capacity / sizeof(pixel_t);
+		}
+		out = (pixel_t *)writer_reserve(p_writer, n * sizeof(pixel_t));
+		if (out == NULL) return 1;
+		expand_luma_row(out, row + j, n);
+		writer_commit(p_writer, n * sizeof(pixel_t));
+		j += n;
+	}
+	return writer_put_zeros(p_writer, bmp_row_padding(width));
+}
+
+int write_plane_bmp(const char file_name[],
+                    const bmp_file_header_t *p_file_header,
+                    const bmp_info_header_t *p_info_header,
+                    const plane_t *p_plane)
+{
+	writer_t writer;
+	int w, h;
+
+	w = p_info_header->width;
+	h = p_info_header->height;
+	if (p_plane->width != w || p_plane->height != h) {
+		fprintf(stderr, "Invalid arguments");
 		return 1;
 	}
 
-	/* Write to offset */
-	while (ftell(p_file) < (long)p_file_header->offset) {
-		e = fputc(0, p_file);
-		if (e != 0) {
-			fprintf(stderr, "Error while writing to offset\n");
-			fclose(p_file);
+	if (open_writer(&writer, file_name) != 0) return 1;
+	if (write_bmp_headers(&writer, p_file_header, p_info_header) != 0) {
+		close_writer(&writer);
+		return 1;
+	}
+
+	for (int i = h - 1; i >= 0; --i) {
+		if (write_luma_row(&writer, plane_row(p_plane, i), w) != 0) {
+			fprintf(stderr, "Error while writing line %d\n", i);
+			close_writer(&writer);
 			return 1;
 		}
 	}
 
-	/* Write the pixel array */
+	return close_writer(&writer);
+}
+
+int read_planar_bmp(const char file_name[],
+                    bmp_file_header_t *p_file_header,
+                    bmp_info_header_t *p_info_header,
+                    planar_t *p_planar)
+{
+	bitmap_t view = {0};
+	int e;
+
+	/* The mapped rows are split without being copied first */
+	e = read_bmp_mapped(file_name, p_file_header, p_info_header, &view);
+	if (e == 0) e = reserve_planar(p_planar, view.width, view.height);
+	if (e == 0) e = split_bitmap(p_planar, &view);
+	clear_bitmap(&view);
+	return e;
+}
+
+/**
+ *    Write the row @i of @p_planar as a row of a bmp file, its channels
+ * merged straight into the output buffer, and then its padding.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int write_planar_row(writer_t *p_writer, const planar_t *p_planar,
+                            int i)
+{
+	int width = p_planar->width;
+
+	for (int j = 0; j < width; ) {
+		const uint8_t *channels[PLANAR_CHANNELS];
+		int n = width - j;
+		pixel_t *out;
+		if (n > (int)(p_writer->capacity / sizeof(pixel_t))) {
+			n = p_writer->capacity / sizeof(pixel_t);
+		}
+		out = (pixel_t *)writer_reserve(p_writer, n * sizeof(pixel_t));
+		if (out == NULL) return 1;
+		for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+			channels[c] = plane_row(&p_planar->channels[c], i) + j;
+		}
+		interleave_row(out, channels, n);
+		writer_commit(p_writer, n * sizeof(pixel_t));
+		j += n;
+	}
+	return writer_put_zeros(p_writer, bmp_row_padding(width));
+}
+
+int write_planar_bmp(const char file_name[],
+                     const bmp_file_header_t *p_file_header,
+                     const bmp_info_header_t *p_info_header,
+                     const planar_t *p_planar)
+{
+	writer_t writer;
+	int w, h;
+
 	w = p_info_header->width;
 	h = p_info_header->height;
-	padding = (w * sizeof(pixel_t)) - (w * sizeof(pixel_t) / 4) * 4;
+	if (p_planar->width != w || p_planar->height != h) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+
+	if (open_writer(&writer, file_name) != 0) return 1;
+	if (write_bmp_headers(&writer, p_file_header, p_info_header) != 0) {
+		close_writer(&writer);
+		return 1;
+	}
 
 	for (int i = h - 1; i >= 0; --i) {
-		e = fwrite(p_bitmap->pixels[i], sizeof(pixel_t), w, p_file);
-		if (e != w) {
+		if (write_planar_row(&writer, p_planar, i) != 0) {
 			fprintf(stderr, "Error while writing line %d\n", i);
-			fclose(p_file);
+			close_writer(&writer);
 			return 1;
 		}
-		for (int j = 0; j < padding; ++j) {
-			e = fputc(0, p_file);
-			if (e != 0) {
-				fprintf(stderr, "Error while writing padding");
-				fclose(p_file);
-				return 1;
+	}
+
+	return close_writer(&writer);
+}
+
+/*   Arguments of gray_band: exactly one of the destinations and one of the
+ * sources are set   */
+typedef struct {
+	bitmap_t *p_new_bitmap;
+	plane_t *p_plane;
+	const bitmap_t *p_bitmap;
+	const planar_t *p_planar;
+} gray_job_t;
+
+/**
+ *    Apply the grayscale effect on the rows [@begin, @end).
+ */
+static void gray_band(void *arg, int begin, int end)
+{
+	const gray_job_t *job = arg;
+
+	if (job->p_planar != NULL) {
+		for (int i = begin; i < end; ++i) {
+			const uint8_t *channels[PLANAR_CHANNELS];
+			for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+				channels[c] = plane_row(
+					&job->p_planar->channels[c], i);
 			}
+			luma_planar_row(plane_row(job->p_plane, i), channels,
+			                job->p_planar->width);
 		}
+		return;
 	}
 
-	fclose(p_file);
-	return 0;
+	int w = job->p_bitmap->width;
+	for (int i = begin; i < end; ++i) {
+		if (job->p_plane != NULL) {
+			luma_row(plane_row(job->p_plane, i),
+			         bitmap_row(job->p_bitmap, i), w);
+		} else {
+			grayscale_row(bitmap_row(job->p_new_bitmap, i),
+			              bitmap_row(job->p_bitmap, i), w);
+		}
+	}
 }
 
 int grayscale_bitmap(bitmap_t *p_new_bitmap, const bitmap_t *p_bitmap)
@@ -193,361 +666,2990 @@ int grayscale_bitmap(bitmap_t *p_new_bitmap, const bitmap_t *p_bitmap)
 	}
 
 	/* Apply the effect */
-	for (int i = 0; i < p_bitmap->height; ++i) {
-		for (int j = 0; j < p_bitmap->width; ++j) {
-			int tmp = (p_bitmap->pixels[i][j].r
-				+ p_bitmap->pixels[i][j].g
-				+ p_bitmap->pixels[i][j].b) / 3;
-			p_new_bitmap->pixels[i][j].r = tmp;
-			p_new_bitmap->pixels[i][j].g = tmp;
-			p_new_bitmap->pixels[i][j].b = tmp;
-		}
-	}
+	p_new_bitmap->compression = 0;
+	gray_job_t job = {p_new_bitmap, NULL, p_bitmap, NULL};
+	parallel_rows(p_bitmap->height,
+	              band_rows(2 * p_bitmap->width * sizeof(pixel_t)),
+	              gray_band, &job);
 
 	return 0;
 }
 
-int filter_bitmap(bitmap_t *p_new_bitmap,
-                   const bitmap_t *p_bitmap,
-                   int filter[3][3])
+int grayscale_plane(plane_t *p_plane, const bitmap_t *p_bitmap)
 {
-	if (p_new_bitmap == NULL || p_bitmap == NULL
-	    || p_new_bitmap->width != p_bitmap->width
-	    || p_new_bitmap->height != p_bitmap->height) {
+	if (p_plane == NULL || p_bitmap == NULL
+	    || p_plane->width != p_bitmap->width
+	    || p_plane->height != p_bitmap->height) {
 		fprintf(stderr, "Invalid arguments");
 		return 1;
 	}
 
-	int w = p_bitmap->width;
-	int h = p_bitmap->height;
-
-	/* Apply the filter */
-	for (int i = 0; i < h; ++i) {
-		for (int j = 0; j < w; ++j) {
-			int r = 0, g = 0, b = 0;
-			for (int p = i - 1; p <= i + 1; ++p) {
-				for (int q = j - 1; q <= j + 1; ++q) {
-					if (p >= 0 && p < h
-					    && q >= 0 && q < w) {
-						r += p_bitmap->pixels[p][q].r
-                                                     * filter[p-i+1][q-j+1];
-						g += p_bitmap->pixels[p][q].g
-						     * filter[p-i+1][q-j+1];
-						b += p_bitmap->pixels[p][q].b
-						     * filter[p-i+1][q-j+1];
-					}
-				}
-			}
-			if (r < 0) {
-				p_new_bitmap->pixels[i][j].r = 0;
-			} else if (r > MAX_PIXEL_VALUE) {
-				p_new_bitmap->pixels[i][j].r = MAX_PIXEL_VALUE;
-			} else {
-				p_new_bitmap->pixels[i][j].r = r;
-			}
-			if (g < 0) {
-				p_new_bitmap->pixels[i][j].g = 0;
-			} else if (g > MAX_PIXEL_VALUE) {
-				p_new_bitmap->pixels[i][j].g = MAX_PIXEL_VALUE;
-			} else {
-				p_new_bitmap->pixels[i][j].g = g;
-			}
-			if (b < 0) {
-				p_new_bitmap->pixels[i][j].b = 0;
-			} else if (b > MAX_PIXEL_VALUE) {
-				p_new_bitmap->pixels[i][j].b = MAX_PIXEL_VALUE;
-			} else {
-				p_new_bitmap->pixels[i][j].b = b;
-			}	
-		}
-	}
+	/* Apply the effect */
+	gray_job_t job = {NULL, p_plane, p_bitmap, NULL};
+	parallel_rows(p_bitmap->height,
+	              band_rows(4 * p_bitmap->width), gray_band, &job);
 
 	return 0;
 }
 
+int grayscale_planar(plane_t *p_plane, const planar_t *p_planar)
+{
+	if (p_plane == NULL || p_planar == NULL
+	    || p_plane->width != p_planar->width
+	    || p_plane->height != p_planar->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+
+	/* Apply the effect */
+	gray_job_t job = {NULL, p_plane, NULL, p_planar};
+	parallel_rows(p_planar->height,
+	              band_rows(4 * p_planar->width), gray_band, &job);
+
+	return 0;
+}
+
+/*   Arguments of filter_band   */
+typedef struct {
+	uint8_t **dst;
+	const int *dst_stride;
+	const uint8_t *src;
+	int src_stride;
+	int w, h;
+	int columns;
+	const filter_kernel_t *kernels;
+	int count;
+} filter_job_t;
+
+/**
+ *    Apply the kernels of the job to the rows [@begin, @end), storing the
+ * result of kernel k at @dst[k]. All the kernels are applied on a row before
+ * moving to the next one, so the three source rows are read from the cache.
+ * The rows wider than a tile are done @columns pixels at a time, one tile of
+ * the band after the other. The rows just outside the band are read like any
+ * other row, since the source is not modified.
+ */
+static void filter_band(void *arg, int begin, int end)
+{
+	const filter_job_t *job = arg;
+
+	for (int from = 0; from < job->w; from += job->columns) {
+		int to = job->w - from > job->columns ? from + job->columns
+			: job->w;
+		for (int i = begin; i < end; ++i) {
+			const uint8_t *rows[3];
+			const uint8_t *row = job->src
+				+ (ptrdiff_t)i * job->src_stride;
+			rows[0] = i > 0 ? row - job->src_stride : NULL;
+			rows[1] = row;
+			rows[2] = i + 1 < job->h ? row + job->src_stride
+				: NULL;
+			for (int k = 0; k < job->count; ++k) {
+				filter_row_range(job->dst[k]
+					+ (ptrdiff_t)i * job->dst_stride[k],
+					rows, job->w, from, to,
+					&job->kernels[k]);
+			}
+		}
+	}
+}
+
+/**
+ *    Prepare @count filters for pixels of @bpp bytes.
+ *    @return the kernels, to be freed by the caller, or NULL on error;
+ */
+static filter_kernel_t *prepare_filters(int filters[][3][3], int count,
+                                        int bpp)
+{
+	filter_kernel_t *kernels = malloc(count * sizeof(filter_kernel_t));
+	if (kernels == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	for (int k = 0; k < count; ++k) {
+		prepare_filter(&kernels[k], filters[k], bpp);
+	}
+	return kernels;
+}
+
+/**
+ *    Run filter_band for @count destinations described by their data and
+ * stride, after preparing the filters. The bands split in tiles have at
+ * least TILE_ROWS rows, so that the rows read again around the tiles are few.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int filter_images(uint8_t *dst[], const int dst_stride[],
+                         const uint8_t *src, int src_stride, int w, int h,
+                         int filters[][3][3], int count, int bpp)
+{
+	filter_kernel_t *kernels = prepare_filters(filters, count, bpp);
+	int columns = tile_columns(w, bpp);
+	int band = band_rows((size_t)w * bpp * (count + 1));
+
+	if (kernels == NULL) return 1;
+	if (columns < w && band < TILE_ROWS) band = TILE_ROWS;
+	filter_job_t job = {dst, dst_stride, src, src_stride, w, h, columns,
+	                    kernels, count};
+	parallel_rows(h, band, filter_band, &job);
+	free(kernels);
+	return 0;
+}
+
+int filter_bitmap(bitmap_t *p_new_bitmap,
+                   const bitmap_t *p_bitmap,
+                   int filter[3][3])
+{
+	return filter_bitmap_multi(&p_new_bitmap, p_bitmap,
+	                           (int (*)[3][3])filter, 1);
+}
+
+int filter_plane(plane_t *p_new_plane,
+                 const plane_t *p_plane,
+                 int filter[3][3])
+{
+	return filter_plane_multi(&p_new_plane, p_plane,
+	                          (int (*)[3][3])filter, 1);
+}
+
+int filter_planar(planar_t *p_new_planar,
+                  const planar_t *p_planar,
+                  int filter[3][3])
+{
+	if (p_new_planar == NULL || p_planar == NULL) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+
+	/* The channels are independent planes of one byte per pixel */
+	for (int c = 0; c < PLANAR_CHANNELS; ++c) {
+		if (filter_plane(&p_new_planar->channels[c],
+		                 &p_planar->channels[c], filter) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int filter_bitmap_multi(bitmap_t *p_new_bitmaps[],
+                        const bitmap_t *p_bitmap,
+                        int filters[][3][3],
+                        int count)
+{
+	uint8_t **dst;
+	int *dst_stride;
+	int e;
+
+	if (p_bitmap == NULL || count <= 0) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	for (int k = 0; k < count; ++k) {
+		if (p_new_bitmaps[k] == NULL
+		    || p_new_bitmaps[k]->width != p_bitmap->width
+		    || p_new_bitmaps[k]->height != p_bitmap->height) {
+			fprintf(stderr, "Invalid arguments");
+			return 1;
+		}
+	}
+
+	dst = malloc(count * (sizeof(uint8_t *) + sizeof(int)));
+	if (dst == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	dst_stride = (int *)(dst + count);
+	for (int k = 0; k < count; ++k) {
+		p_new_bitmaps[k]->compression = 0;
+		dst[k] = p_new_bitmaps[k]->data;
+		dst_stride[k] = p_new_bitmaps[k]->stride;
+	}
+	e = filter_images(dst, dst_stride, p_bitmap->data, p_bitmap->stride,
+	                  p_bitmap->width, p_bitmap->height, filters, count,
+	                  sizeof(pixel_t));
+	free(dst);
+
+	return e;
+}
+
+int filter_plane_multi(plane_t *p_new_planes[],
+                       const plane_t *p_plane,
+                       int filters[][3][3],
+                       int count)
+{
+	uint8_t **dst;
+	int *dst_stride;
+	int e;
+
+	if (p_plane == NULL || count <= 0) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	for (int k = 0; k < count; ++k) {
+		if (p_new_planes[k] == NULL
+		    || p_new_planes[k]->width != p_plane->width
+		    || p_new_planes[k]->height != p_plane->height) {
+			fprintf(stderr, "Invalid arguments");
+			return 1;
+		}
+	}
+
+	dst = malloc(count * (sizeof(uint8_t *) + sizeof(int)));
+	if (dst == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	dst_stride = (int *)(dst + count);
+	for (int k = 0; k < count; ++k) {
+		dst[k] = p_new_planes[k]->data;
+		dst_stride[k] = p_new_planes[k]->stride;
+	}
+	e = filter_images(dst, dst_stride, p_plane->data, p_plane->stride,
+	                  p_plane->width, p_plane->height, filters, count, 1);
+	free(dst);
+
+	return e;
+}
+
+/*   Predefined convolutions   */
+#define ROW5(a) a, a, a, a, a
+#define ROW7(a) a, a, a, a, a, a, a
+#define BINOMIAL5(a) a, 4 * a, 6 * a, 4 * a, a
+#define BINOMIAL7(a) a, 6 * a, 15 * a, 20 * a, 15 * a, 6 * a, a
+
+static const int box5[] = {ROW5(1), ROW5(1), ROW5(1), ROW5(1), ROW5(1)};
+static const int box7[] = {
+	ROW7(1), ROW7(1), ROW7(1), ROW7(1), ROW7(1), ROW7(1), ROW7(1)
+};
+static const int binomial5[] = {
+	BINOMIAL5(1), BINOMIAL5(4), BINOMIAL5(6), BINOMIAL5(4), BINOMIAL5(1)
+};
+static const int binomial7[] = {
+	BINOMIAL7(1), BINOMIAL7(6), BINOMIAL7(15), BINOMIAL7(20),
+	BINOMIAL7(15), BINOMIAL7(6), BINOMIAL7(1)
+};
+
+/* Twice the pixel minus its binomial blur, both scaled by the divisor */
+static const int sharpen5[] = {
+	BINOMIAL5(-1), BINOMIAL5(-4), -6, -24, 2 * 256 - 36, -24, -6,
+	BINOMIAL5(-4), BINOMIAL5(-1)
+};
+static const int sharpen7[] = {
+	BINOMIAL7(-1), BINOMIAL7(-6), BINOMIAL7(-15),
+	-20, -120, -300, 2 * 4096 - 400, -300, -120, -20,
+	BINOMIAL7(-15), BINOMIAL7(-6), BINOMIAL7(-1)
+};
+
+/* The pixel times the number of its neighbors minus their sum */
+static const int edge5[] = {
+	ROW5(-1), ROW5(-1), -1, -1, 24, -1, -1, ROW5(-1), ROW5(-1)
+};
+static const int edge7[] = {
+	ROW7(-1), ROW7(-1), ROW7(-1), -1, -1, -1, 48, -1, -1, -1,
+	ROW7(-1), ROW7(-1), ROW7(-1)
+};
+
+#undef ROW5
+#undef ROW7
+#undef BINOMIAL5
+#undef BINOMIAL7
+
+static const struct {
+	const char *name;
+	convolution_t convolution;
+} convolutions[] = {
+	{"blur5", {5, box5, 25}},
+	{"blur7", {7, box7, 49}},
+	{"gaussian5", {5, binomial5, 256}},
+	{"gaussian7", {7, binomial7, 4096}},
+	{"sharpen5", {5, sharpen5, 256}},
+	{"sharpen7", {7, sharpen7, 4096}},
+	{"edge5", {5, edge5, 1}},
+	{"edge7", {7, edge7, 1}}
+};
+
+const convolution_t *find_convolution(const char name[])
+{
+	int count = sizeof(convolutions) / sizeof(convolutions[0]);
+
+	for (int k = 0; k < count; ++k) {
+		if (strcmp(convolutions[k].name, name) == 0) {
+			return &convolutions[k].convolution;
+		}
+	}
+	return NULL;
+}
+
+/*   Arguments of convolve_band   */
+typedef struct {
+	uint8_t *dst;
+	int dst_stride;
+	const uint8_t *src;
+	int src_stride;
+	int w, h;
+	const convolution_kernel_t *p_kernel;
+	int error;
+} convolve_job_t;
+
+/**
+ *    Convolve the row @i of the job with a kernel that isn't separable,
+ * adding up the horizontal convolutions of the rows of its weights in @sums.
+ */
+static void convolve_direct(const convolve_job_t *job, int32_t *sums, int i)
+{
+	const convolution_kernel_t *p_kernel = job->p_kernel;
+	size_t length = (size_t)job->w * p_kernel->bpp;
+	int n = p_kernel->size;
+	int count = 0;
+
+	for (int t = 0; t < n; ++t) {
+		int y = i - n / 2 + t;
+		if (y < 0 || y >= job->h || !p_kernel->used[t]) continue;
+		convolve_row_horizontal(sums,
+			job->src + (ptrdiff_t)y * job->src_stride, job->w,
+			p_kernel->weights + t * n, p_kernel, count++ > 0);
+	}
+	if (count == 0) memset(sums, 0, length * sizeof(int32_t));
+	convolve_row_scale(job->dst + (ptrdiff_t)i * job->dst_stride, sums,
+	                   job->w, p_kernel);
+}
+
+/**
+ *    Convolve the rows [@begin, @end) of the job. A separable kernel keeps
+ * the horizontal sums of the source rows around the current one in a ring,
+ * those of the row y in the slot y % size, so that every source row of the
+ * band is convolved horizontally once.
+ */
+static void convolve_band(void *arg, int begin, int end)
+{
+	convolve_job_t *job = arg;
+	const convolution_kernel_t *p_kernel = job->p_kernel;
+	int n = p_kernel->size, r = n / 2;
+	size_t length = (size_t)job->w * p_kernel->bpp;
+	void *sums = malloc(p_kernel->separable ? n * length * sizeof(int16_t)
+	                    : length * sizeof(int32_t));
+
+	if (sums == NULL) {
+		__atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (int i = begin; i < end; ++i) {
+		const int16_t *rows[CONVOLUTION_MAX_SIZE];
+		int weights[CONVOLUTION_MAX_SIZE];
+		int count = 0;
+
+		if (!p_kernel->separable) {
+			convolve_direct(job, sums, i);
+			continue;
+		}
+
+		/* The first row of the band also needs the rows above it */
+		for (int y = i == begin ? i - r : i + r; y <= i + r; ++y) {
+			if (y < 0 || y >= job->h) continue;
+			convolve_row_separable((int16_t *)sums + y % n * length,
+				job->src + (ptrdiff_t)y * job->src_stride,
+				job->w, p_kernel);
+		}
+		for (int t = 0; t < n; ++t) {
+			int y = i - r + t;
+			if (y < 0 || y >= job->h || p_kernel->vertical[t] == 0) {
+				continue;
+			}
+			rows[count] = (int16_t *)sums + y % n * length;
+			weights[count] = p_kernel->vertical[t];
+			++count;
+		}
+		convolve_row_vertical(job->dst + (ptrdiff_t)i * job->dst_stride,
+		                      rows, weights, count, job->w, p_kernel);
+	}
+	free(sums);
+}
+
+/**
+ *    Apply @p_convolution to an image described by its data and stride. An
+ * undivided 3x3 kernel goes through filter_images, whose kernels keep their
+ * sums in 16 bits. The bands have at least 8 times as many rows as the
+ * kernel, so that the rows convolved by two bands are few.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int convolve_image(uint8_t *dst, int dst_stride, const uint8_t *src,
+                          int src_stride, int w, int h,
+                          const convolution_t *p_convolution, int bpp)
+{
+	convolution_kernel_t kernel;
+	int band;
+
+	if (p_convolution->size == 3 && p_convolution->divisor == 1
+	    && p_convolution->weights != NULL) {
+		int filter[1][3][3];
+		memcpy(filter, p_convolution->weights, sizeof(filter));
+		return filter_images(&dst, &dst_stride, src, src_stride, w, h,
+		                     filter, 1, bpp);
+	}
+	if (prepare_convolution(&kernel, p_convolution, bpp) != 0) {
+		fprintf(stderr, "Unsupported convolution\n");
+		return 1;
+	}
+
+	convolve_job_t job = {dst, dst_stride, src, src_stride, w, h,
+	                      &kernel, 0};
+	band = band_rows((size_t)w * bpp * 2);
+	if (band < 8 * kernel.size) band = 8 * kernel.size;
+	parallel_rows(h, band, convolve_band, &job);
+	if (job.error) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	return 0;
+}
+
+int convolve_bitmap(bitmap_t *p_new_bitmap,
+                    const bitmap_t *p_bitmap,
+                    const convolution_t *p_convolution)
+{
+	if (p_new_bitmap == NULL || p_bitmap == NULL || p_convolution == NULL
+	    || p_new_bitmap->width != p_bitmap->width
+	    || p_new_bitmap->height != p_bitmap->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	p_new_bitmap->compression = 0;
+	return convolve_image(p_new_bitmap->data, p_new_bitmap->stride,
+	                      p_bitmap->data, p_bitmap->stride,
+	                      p_bitmap->width, p_bitmap->height, p_convolution,
+	                      sizeof(pixel_t));
+}
+
+int convolve_plane(plane_t *p_new_plane,
+                   const plane_t *p_plane,
+                   const convolution_t *p_convolution)
+{
+	if (p_new_plane == NULL || p_plane == NULL || p_convolution == NULL
+	    || p_new_plane->width != p_plane->width
+	    || p_new_plane->height != p_plane->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	return convolve_image(p_new_plane->data, p_new_plane->stride,
+	                      p_plane->data, p_plane->stride, p_plane->width,
+	                      p_plane->height, p_convolution, 1);
+}
+
+/*   Arguments of box_rows_band and box_columns_band   */
+typedef struct {
+	uint8_t *dst;
+	int dst_stride;
+	const uint8_t *src;
+	int src_stride;
+	int w, h, bpp, radius;
+	const uint8_t *zero;
+	int error;
+} box_job_t;
+
+/**
+ *    Blur the rows [@begin, @end) of the job horizontally.
+ */
+static void box_rows_band(void *arg, int begin, int end)
+{
+	box_job_t *job = arg;
+
+	for (int i = begin; i < end; ++i) {
+		box_row_horizontal(job->dst + (ptrdiff_t)i * job->dst_stride,
+		                   job->src + (ptrdiff_t)i * job->src_stride,
+		                   job->w, job->bpp, job->radius);
+	}
+}
+
+/**
+ *    Blur the rows [@begin, @end) of the job vertically. The sums of the
+ * columns start with the rows of the box of the first row of the band, then
+ * the box slides one row down at a time, the rows outside the image being
+ * the zero row of the job.
+ */
+static void box_columns_band(void *arg, int begin, int end)
+{
+	box_job_t *job = arg;
+	const uint8_t *src = job->src;
+	ptrdiff_t stride = job->src_stride;
+	int r = job->radius, h = job->h;
+	int length = job->w * job->bpp;
+	int32_t *sums = calloc(length, sizeof(int32_t));
+
+	if (sums == NULL) {
+		__atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (int y = begin > r ? begin - r : 0; y <= begin + r && y < h; ++y) {
+		box_row_vertical(NULL, sums, src + y * stride, job->zero,
+		                 length, 1);
+	}
+	for (int i = begin; i < end; ++i) {
+		int lo = i - r, hi = i + r;
+		int count = (hi < h ? hi : h - 1) - (lo > 0 ? lo : 0) + 1;
+		const uint8_t *add = hi + 1 < h ? src + (hi + 1) * stride
+			: job->zero;
+		const uint8_t *sub = lo >= 0 ? src + lo * stride : job->zero;
+		box_row_vertical(job->dst + (ptrdiff_t)i * job->dst_stride,
+		                 sums, add, sub, length, count);
+	}
+	free(sums);
+}
+
+/**
+ *    Blur an image described by its data and stride with the boxes of the
+ * @count @radii, one after the other. Each box blurs the rows of the current
+ * image into a temporary image, then its columns into @dst, so @dst may be
+ * @src. The vertical bands have at least 8 times as many rows as the box, so
+ * that the rows added up again at their start are few, unless the threads
+ * would run out of bands.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int blur_image(uint8_t *dst, int dst_stride, const uint8_t *src,
+                      int src_stride, int w, int h, int bpp,
+                      const int radii[], int count)
+{
+	size_t length = (size_t)w * bpp;
+	int threads = threadpool_threads();
+	int tmp_stride, error = 0;
+	uint8_t *tmp, *zero;
+
+	if (length == 0 || h == 0) return 0;
+	tmp = allocate_rows(length, h, &tmp_stride);
+	if (tmp == NULL) return 1;
+	zero = calloc(length, 1);
+	if (zero == NULL) {
+		free(tmp);
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+
+	for (int k = 0; k < count && !error; ++k) {
+		int r = radii[k];
+		int band = band_rows(length * 6);
+		box_job_t rows = {tmp, tmp_stride, src, src_stride, w, h, bpp,
+		                  r, zero, 0};
+		box_job_t columns = {dst, dst_stride, tmp, tmp_stride, w, h,
+		                     bpp, r, zero, 0};
+
+		if (band < 8 * (2 * r + 1)) band = 8 * (2 * r + 1);
+		if (band > (h + threads - 1) / threads) {
+			band = (h + threads - 1) / threads;
+		}
+		parallel_rows(h, band_rows(length * 2), box_rows_band, &rows);
+		parallel_rows(h, band, box_columns_band, &columns);
+		error = columns.error;
+		src = dst;
+		src_stride = dst_stride;
+	}
+	free(tmp);
+	free(zero);
+	if (error) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ *    Get the @radii of the GAUSSIAN_BOX_PASSES boxes approximating a
+ * Gaussian of standard deviation @sigma. A box of odd side w has a variance
+ * of (w * w - 1) / 12: the passes use the largest side wl whose variance is at
+ * most the share of a pass, or wl + 2, as many times as it takes to get the
+ * closest total variance.
+ *    @return 0 if successful or an error code if @sigma isn't supported;
+ */
+static int gaussian_radii(double sigma, int radii[GAUSSIAN_BOX_PASSES])
+{
+	double n = GAUSSIAN_BOX_PASSES, variance = 12 * sigma * sigma;
+	double wl = 1, ideal;
+	int m;
+
+	if (!(sigma > 0) || sigma > BLUR_MAX_RADIUS) return 1;
+	while ((wl + 2) * (wl + 2) <= variance / n + 1) wl += 2;
+	ideal = (variance - n * wl * wl - 4 * n * wl - 3 * n) / (-4 * wl - 4);
+	m = ideal < 0 ? 0 : ideal > n ? n : (int)(ideal + 0.5);
+	for (int k = 0; k < GAUSSIAN_BOX_PASSES; ++k) {
+		radii[k] = (k < m ? (int)wl : (int)wl + 2) / 2;
+		if (radii[k] > BLUR_MAX_RADIUS) return 1;
+	}
+	return 0;
+}
+
+int box_blur_bitmap(bitmap_t *p_new_bitmap,
+                    const bitmap_t *p_bitmap,
+                    int radius)
+{
+	if (p_new_bitmap == NULL || p_bitmap == NULL || radius < 0
+	    || radius > BLUR_MAX_RADIUS
+	    || p_new_bitmap->width != p_bitmap->width
+	    || p_new_bitmap->height != p_bitmap->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	p_new_bitmap->compression = 0;
+	return blur_image(p_new_bitmap->data, p_new_bitmap->stride,
+	                  p_bitmap->data, p_bitmap->stride, p_bitmap->width,
+	                  p_bitmap->height, sizeof(pixel_t), &radius, 1);
+}
+
+int box_blur_plane(plane_t *p_new_plane,
+                   const plane_t *p_plane,
+                   int radius)
+{
+	if (p_new_plane == NULL || p_plane == NULL || radius < 0
+	    || radius > BLUR_MAX_RADIUS
+	    || p_new_plane->width != p_plane->width
+	    || p_new_plane->height != p_plane->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	return blur_image(p_new_plane->data, p_new_plane->stride,
+	                  p_plane->data, p_plane->stride, p_plane->width,
+	                  p_plane->height, 1, &radius, 1);
+}
+
+int gaussian_blur_bitmap(bitmap_t *p_new_bitmap,
+                         const bitmap_t *p_bitmap,
+                         double sigma)
+{
+	int radii[GAUSSIAN_BOX_PASSES];
+
+	if (p_new_bitmap == NULL || p_bitmap == NULL
+	    || gaussian_radii(sigma, radii) != 0
+	    || p_new_bitmap->width != p_bitmap->width
+	    || p_new_bitmap->height != p_bitmap->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	p_new_bitmap->compression = 0;
+	return blur_image(p_new_bitmap->data, p_new_bitmap->stride,
+	                  p_bitmap->data, p_bitmap->stride, p_bitmap->width,
+	                  p_bitmap->height, sizeof(pixel_t), radii,
+	                  GAUSSIAN_BOX_PASSES);
+}
+
+int gaussian_blur_plane(plane_t *p_new_plane,
+                        const plane_t *p_plane,
+                        double sigma)
+{
+	int radii[GAUSSIAN_BOX_PASSES];
+
+	if (p_new_plane == NULL || p_plane == NULL
+	    || gaussian_radii(sigma, radii) != 0
+	    || p_new_plane->width != p_plane->width
+	    || p_new_plane->height != p_plane->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	return blur_image(p_new_plane->data, p_new_plane->stride,
+	                  p_plane->data, p_plane->stride, p_plane->width,
+	                  p_plane->height, 1, radii, GAUSSIAN_BOX_PASSES);
+}
+
+/*   State of filter_bmp_stream for the chunk of file rows [@base, ...)   */
+typedef struct {
+	const plane_t *p_gray;
+	plane_t *outputs;
+	const filter_kernel_t *kernels;
+	int count;
+	int base, height;
+} stream_job_t;
+
+/**
+ *    Apply the kernels of the job to the rows [@begin, @end) of the chunk.
+ * The row r of the chunk is the row @base + r of the file, whose gray values
+ * are in the row r + 1 of the window. The rows of a bmp file are stored
+ * bottom-up, so the row above in the image is the next one in the window.
+ */
+static void stream_filter_band(void *arg, int begin, int end)
+{
+	const stream_job_t *job = arg;
+
+	for (int r = begin; r < end; ++r) {
+		int f = job->base + r;
+		const plane_t *p_gray = job->p_gray;
+		const uint8_t *rows[3] = {
+			f + 1 < job->height ? plane_row(p_gray, r + 2) : NULL,
+			plane_row(p_gray, r + 1),
+			f > 0 ? plane_row(p_gray, r) : NULL};
+		for (int k = 0; k < job->count; ++k) {
+			filter_row(plane_row(&job->outputs[k], r), rows,
+			           job->p_gray->width, &job->kernels[k]);
+		}
+	}
+}
+
+/**
+ *    Read the next @count rows of the pixel array of @p_file, of @row_size
+ * bytes with their padding, into the first rows of @p_pixels.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int read_bmp_rows(FILE *p_file, bitmap_t *p_pixels, int count,
+                         size_t row_size)
+{
+	for (int r = 0; r < count; ++r) {
+		if (fread(bitmap_row(p_pixels, r), 1, row_size, p_file)
+		    != row_size) {
+			fprintf(stderr, "Error while reading the pixels\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int filter_bmp_stream(const char file_name[],
+                      const char gray_file_name[],
+                      const char *filter_file_names[],
+                      int filters[][3][3],
+                      int count)
+{
+	bmp_file_header_t file_header;
+	bmp_info_header_t info_header;
+	FILE *p_file;
+	bitmap_t pixels = {0};
+	plane_t gray = {0};
+	plane_t *outputs = NULL;
+	filter_kernel_t *kernels = NULL;
+	writer_t *writers = NULL;
+	stream_job_t job;
+	size_t row_size;
+	int w, h, chunk, opened = 0, loaded = 0, e = 1;
+
+	if (count <= 0) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	p_file = fopen(file_name, "rb");
+	if (p_file == NULL) {
+		fprintf(stderr, "Can't open file %s\n", file_name);
+		return 1;
+	}
+	if (read_bmp_headers(p_file, &file_header, &info_header) != 0) {
+		fclose(p_file);
+		return 1;
+	}
+	w = info_header.width;
+	h = info_header.height;
+	if (w <= 0 || h <= 0) {
+		fprintf(stderr, "Invalid height or width for bitmap\n");
+		fclose(p_file);
+		return 1;
+	}
+	if (fseek(p_file, file_header.offset, SEEK_SET) != 0) {
+		fprintf(stderr, "Error while moving cursor to %d\n",
+			file_header.offset);
+		fclose(p_file);
+		return 1;
+	}
+	row_size = (size_t)w * sizeof(pixel_t) + bmp_row_padding(w);
+
+	/* A chunk gives a band of rows to every thread. The window holds the
+	 * gray values of the chunk and of the rows around it */
+	chunk = band_rows((size_t)w * (sizeof(pixel_t) + 1 + count))
+		* threadpool_threads();
+	if (chunk > h) chunk = h;
+	outputs = calloc(count, sizeof(plane_t));
+	writers = malloc((count + 1) * sizeof(writer_t));
+	kernels = prepare_filters(filters, count, 1);
+	if (outputs == NULL || writers == NULL || kernels == NULL
+	    || initialize_bitmap(&pixels, w, chunk + 1) != 0
+	    || initialize_plane(&gray, w, chunk + 2) != 0) {
+		fprintf(stderr, "Not enough memory\n");
+		goto exit;
+	}
+	for (int k = 0; k < count; ++k) {
+		if (initialize_plane(&outputs[k], w, chunk) != 0) {
+			fprintf(stderr, "Not enough memory\n");
+			goto exit;
+		}
+	}
+
+	/* The outputs have the headers of the input */
+	for (; opened <= count; ++opened) {
+		const char *name = opened == 0 ? gray_file_name
+			: filter_file_names[opened - 1];
+		if (open_writer(&writers[opened], name) != 0) goto exit;
+		if (write_bmp_headers(&writers[opened], &file_header,
+		                      &info_header) != 0) {
+			++opened;
+			goto exit;
+		}
+	}
+
+	job.p_gray = &gray;
+	job.outputs = outputs;
+	job.kernels = kernels;
+	job.count = count;
+	job.height = h;
+	for (int base = 0; base < h; base += chunk) {
+		int n = h - base < chunk ? h - base : chunk;
+		int need = base + n + 1 < h ? base + n + 1 : h;
+
+		/* Read the rows of the chunk and the next one */
+		bitmap_t read = pixels;
+		plane_t window = gray;
+		read.height = need - loaded;
+		window.data = plane_row(&gray, loaded - base + 1);
+		window.height = need - loaded;
+		if (read_bmp_rows(p_file, &read, read.height, row_size) != 0) {
+			goto exit;
+		}
+		gray_job_t gray_job = {NULL, &window, &read, NULL};
+		parallel_rows(read.height, band_rows(4 * (size_t)w), gray_band,
+		              &gray_job);
+		loaded = need;
+
+		/* Filter the chunk and write it in the order of the file */
+		job.base = base;
+		parallel_rows(n, band_rows((size_t)w * (count + 3)),
+		              stream_filter_band, &job);
+		for (int r = 0; r < n; ++r) {
+			int failed = write_luma_row(&writers[0],
+			                            plane_row(&gray, r + 1), w);
+			for (int k = 0; k < count && failed == 0; ++k) {
+				failed = write_luma_row(&writers[k + 1],
+					plane_row(&outputs[k], r), w);
+			}
+			if (failed != 0) {
+				fprintf(stderr, "Error while writing line %d\n",
+					h - 1 - base - r);
+				goto exit;
+			}
+		}
+
+		/* Keep the last row of the chunk and the next one */
+		memcpy(plane_row(&gray, 0), plane_row(&gray, n), w);
+		if (need > base + n) {
+			memcpy(plane_row(&gray, 1), plane_row(&gray, n + 1), w);
+		}
+	}
+	e = 0;
+
+exit:
+	for (int k = 0; k < opened; ++k) {
+		if (close_writer(&writers[k]) != 0) e = 1;
+	}
+	for (int k = 0; outputs != NULL && k < count; ++k) {
+		clear_plane(&outputs[k]);
+	}
+	clear_plane(&gray);
+	clear_bitmap(&pixels);
+	free(kernels);
+	free(writers);
+	free(outputs);
+	fclose(p_file);
+	return e;
+}
+
 int is_similar(pixel_t px1, pixel_t px2, int threshold)
 {
-	int sum = 0;
-	if (px1.r < px2.r) sum += px2.r - px1.r;
-	else sum += px1.r - px2.r;
-	if (px1.g < px2.g) sum += px2.g - px1.g;
-	else sum += px1.g - px2.g;
-	if (px1.b < px2.b) sum += px2.b - px1.b;
-	else sum += px1.b - px2.b;
-	if (sum <= threshold) return 1;
-	else return 0;
+	int sum = 0;
+	if (px1.r < px2.r) sum += px2.r - px1.r;
+	else sum += px1.r - px2.r;
+	if (px1.g < px2.g) sum += px2.g - px1.g;
+	else sum += px1.g - px2.g;
+	if (px1.b < px2.b) sum += px2.b - px1.b;
+	else sum += px1.b - px2.b;
+	if (sum <= threshold) return 1;
+	else return 0;
+}
+
+/**
+ *    Check if @px is similar to the seed color (@r, @g, @b), like is_similar.
+ */
+static inline int similar_to_seed(const pixel_t *px, int r, int g, int b,
+                                  int threshold)
+{
+	return abs(px->r - r) + abs(px->g - g) + abs(px->b - b) <= threshold;
+}
+
+/**
+ *    Get the visited bits of row @i of @p_workspace.
+ */
+static inline uint64_t *visited_row(const compress_workspace_t *p_workspace,
+                                    int i)
+{
+	return p_workspace->visited + (size_t)i * p_workspace->row_words;
+}
+
+/**
+ *    Check if the pixel @j of the visited bits @row is set.
+ */
+static inline int is_visited(const uint64_t *row, int j)
+{
+	return (row[j >> 6] >> (j & 63)) & 1;
+}
+
+/**
+ *    Set the bit of the pixel @j of @row.
+ */
+static inline void set_bit(uint64_t *row, int j)
+{
+	row[j >> 6] |= 1ULL << (j & 63);
+}
+
+/**
+ *    Check if the pixels @a and @b have exactly the same color.
+ */
+static inline int same_color(const pixel_t *a, const pixel_t *b)
+{
+	return a->r == b->r && a->g == b->g && a->b == b->b;
+}
+
+/**
+ *    Set the bits of the pixels between the columns @l and @r of @row.
+ */
+static inline void set_visited(uint64_t *row, int l, int r)
+{
+	int first = l >> 6, last = r >> 6;
+	uint64_t head = ~0ULL << (l & 63);
+	uint64_t tail = ~0ULL >> (63 - (r & 63));
+
+	if (first == last) {
+		row[first] |= head & tail;
+		return;
+	}
+	row[first] |= head;
+	for (int k = first + 1; k < last; ++k) row[k] = ~0ULL;
+	row[last] |= tail;
+}
+
+/**
+ *    Get the boundary bits of row @i of @p_workspace.
+ */
+static inline uint64_t *boundary_row_bits(
+	const compress_workspace_t *p_workspace, int i)
+{
+	return p_workspace->boundary + (size_t)i * p_workspace->row_words;
+}
+
+/**
+ *    Get a new identifier for a compression, never 0 and never given twice,
+ * which ties the boundary of a workspace to the bitmap written with it.
+ */
+static uint64_t next_compression(void)
+{
+	static uint64_t count;
+	return __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ *    Make @p_workspace large enough for a @width x @height bitmap, clear its
+ * visited bits and keep only the edges of the image in its boundary.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int reserve_workspace(compress_workspace_t *p_workspace, int width,
+                             int height)
+{
+	int row_words = (width + 63) / 64;
+	size_t words = (size_t)row_words * height;
+
+	p_workspace->boundary_width = p_workspace->boundary_height = 0;
+	p_workspace->boundary_compression = 0;
+	memset(&p_workspace->stats, 0, sizeof(compress_stats_t));
+	if (words > p_workspace->visited_capacity) {
+		free(p_workspace->visited);
+		free(p_workspace->boundary);
+		p_workspace->visited_capacity = 0;
+		p_workspace->visited = malloc(words * sizeof(uint64_t));
+		p_workspace->boundary = malloc(words * sizeof(uint64_t));
+		if (p_workspace->visited == NULL
+		    || p_workspace->boundary == NULL) {
+			fprintf(stderr, "Error allocating the visited bits\n");
+			return 1;
+		}
+		p_workspace->visited_capacity = words;
+	}
+	memset(p_workspace->visited, 0, words * sizeof(uint64_t));
+	memset(p_workspace->boundary, 0, words * sizeof(uint64_t));
+	p_workspace->row_words = row_words;
+	set_visited(boundary_row_bits(p_workspace, 0), 0, width - 1);
+	set_visited(boundary_row_bits(p_workspace, height - 1), 0, width - 1);
+	for (int i = 1; i + 1 < height; ++i) {
+		set_bit(boundary_row_bits(p_workspace, i), 0);
+		set_bit(boundary_row_bits(p_workspace, i), width - 1);
+	}
+	stack_reset(&p_workspace->stack);
+	return 0;
+}
+
+int initialize_compress_workspace(compress_workspace_t *p_workspace)
+{
+	p_workspace->visited = NULL;
+	p_workspace->boundary = NULL;
+	p_workspace->visited_capacity = 0;
+	p_workspace->boundary_width = p_workspace->boundary_height = 0;
+	p_workspace->boundary_compression = 0;
+	p_workspace->row_words = 0;
+	p_workspace->labels = NULL;
+	p_workspace->labels_capacity = 0;
+	memset(&p_workspace->stats, 0, sizeof(compress_stats_t));
+	p_workspace->tiled = 0;
+	return initialize_stack(&p_workspace->stack);
+}
+
+int clear_compress_workspace(compress_workspace_t *p_workspace)
+{
+	if (p_workspace == NULL) return 0;
+	free(p_workspace->visited);
+	free(p_workspace->boundary);
+	free(p_workspace->labels);
+	p_workspace->visited = NULL;
+	p_workspace->boundary = NULL;
+	p_workspace->boundary_width = p_workspace->boundary_height = 0;
+	p_workspace->boundary_compression = 0;
+	p_workspace->labels = NULL;
+	p_workspace->visited_capacity = 0;
+	p_workspace->labels_capacity = 0;
+	return clear_stack(&p_workspace->stack);
+}
+
+/**
+ *    Push one seed for every run of unvisited pixels similar to the seed color
+ * between the columns @l and @r of row @i, which is next to the row @from
+ * just filled. The visited pixels of row @i already have their final color,
+ * so they are compared with the seed color to find the boundary between both
+ * rows.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static inline int push_runs(compress_workspace_t *p_workspace,
+                            const bitmap_t *p_new_bitmap,
+                            const bitmap_t *p_bitmap, int i, int from,
+                            int l, int r, pixel_t seed, int threshold)
+{
+	const pixel_t *src = bitmap_row(p_bitmap, i);
+	const pixel_t *dst = bitmap_row(p_new_bitmap, i);
+	const uint64_t *row = visited_row(p_workspace, i);
+	uint64_t *boundary = boundary_row_bits(p_workspace, i);
+	uint64_t *boundary_from = boundary_row_bits(p_workspace, from);
+	stack_t *p_stack = &p_workspace->stack;
+	int in_run = 0;
+
+	/* There are at most (r - l) / 2 + 1 runs between l and r */
+	if (stack_reserve(p_stack, (r - l) / 2 + 1) != 0) return 1;
+	for (int j = l; j <= r; ++j) {
+		int candidate = 0;
+		if (is_visited(row, j)) {
+			if (!same_color(&dst[j], &seed)) {
+				set_bit(boundary, j);
+				set_bit(boundary_from, j);
+			}
+		} else {
+			candidate = similar_to_seed(&src[j], seed.r, seed.g,
+			                            seed.b, threshold);
+		}
+		if (candidate && !in_run) stack_push_unchecked(p_stack, j, i);
+		in_run = candidate;
+	}
+	return 0;
+}
+
+/**
+ *    Pop seeds from the stack of @p_workspace until one that wasn't visited in
+ * the meantime is found, storing its row in @p_i and its column in @p_j.
+ *    @return 1 if a seed was found or 0 if the stack got empty;
+ */
+static inline int pop_unvisited(compress_workspace_t *p_workspace,
+                                int *p_i, int *p_j)
+{
+	stack_t *p_stack = &p_workspace->stack;
+
+	while (!stack_is_empty(p_stack)) {
+		point_t point = stack_pop_point(p_stack);
+		if (!is_visited(visited_row(p_workspace, point.y), point.x)) {
+			*p_i = point.y;
+			*p_j = point.x;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ *    Count the pixels of the boundary of @p_workspace in its stats.
+ */
+static void count_boundary_points(compress_workspace_t *p_workspace)
+{
+	size_t words = (size_t)p_workspace->row_words
+		* p_workspace->boundary_height;
+	uint64_t count = 0;
+
+	for (size_t k = 0; k < words; ++k) {
+		count += __builtin_popcountll(p_workspace->boundary[k]);
+	}
+	p_workspace->stats.boundary_points = count;
+}
+
+int fill_bitmap(bitmap_t *p_new_bitmap,
+                const bitmap_t *p_bitmap,
+                compress_workspace_t *p_workspace,
+                int x,
+                int y,
+                int threshold)
+{
+	compress_stats_t *p_stats = &p_workspace->stats;
+	pixel_t pixel;
+	int e = 0;
+
+	int w = p_bitmap->width;
+	int h = p_bitmap->height;
+
+	/*
+	 * Apply an iterative scanline fill: every popped pixel is extended to
+	 * the longest run of unvisited similar pixels on its row, which is
+	 * marked at once, and only one seed per run is pushed for the rows
+	 * above and below. The region is the same as the one of a pixel by
+	 * pixel search, since every pixel is compared with the seed color.
+	 */
+	pixel = bitmap_row(p_bitmap, y)[x];
+	++p_stats->regions;
+	int i = y, j = x;
+	do {
+		uint64_t *row = visited_row(p_workspace, i);
+		const pixel_t *src = bitmap_row(p_bitmap, i);
+		pixel_t *dst = bitmap_row(p_new_bitmap, i);
+		int l = j, r = j;
+		while (l > 0 && !is_visited(row, l - 1) &&
+		       similar_to_seed(&src[l - 1], pixel.r, pixel.g, pixel.b,
+		                       threshold)) {
+			--l;
+		}
+		while (r + 1 < w && !is_visited(row, r + 1) &&
+		       similar_to_seed(&src[r + 1], pixel.r, pixel.g, pixel.b,
+		                       threshold)) {
+			++r;
+		}
+		set_visited(row, l, r);
+		for (int k = l; k <= r; ++k) dst[k] = pixel;
+
+		/* The neighbors already filled are on the boundary if they differ */
+		uint64_t *boundary = boundary_row_bits(p_workspace, i);
+		if (l > 0 && is_visited(row, l - 1)
+		    && !same_color(&dst[l - 1], &pixel)) {
+			set_bit(boundary, l - 1);
+			set_bit(boundary, l);
+		}
+		if (r + 1 < w && is_visited(row, r + 1)
+		    && !same_color(&dst[r + 1], &pixel)) {
+			set_bit(boundary, r);
+			set_bit(boundary, r + 1);
+		}
+		if (i > 0) {
+			e = push_runs(p_workspace, p_new_bitmap, p_bitmap,
+			              i - 1, i, l, r, pixel, threshold);
+		}
+		if (e == 0 && i + 1 < h) {
+			e = push_runs(p_workspace, p_new_bitmap, p_bitmap,
+			              i + 1, i, l, r, pixel, threshold);
+		}
+		size_t depth = stack_size(&p_workspace->stack);
+		p_stats->pixels_visited += (uint64_t)(r - l + 1)
+			* (1 + (i > 0) + (i + 1 < h));
+		if (depth > p_stats->max_stack_depth) {
+			p_stats->max_stack_depth = depth;
+		}
+	} while (e == 0 && pop_unvisited(p_workspace, &i, &j));
+
+	if (e != 0) fprintf(stderr, "Error while filling the bitmap\n");
+	return e;
+}
+
+/**
+ *    Fill the regions of the pixels still unvisited among the rows [@begin,
+ * @end) and the words [@first, @last) of their visited bits, in raster order.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int fill_unvisited(bitmap_t *p_new_bitmap, const bitmap_t *p_bitmap,
+                          compress_workspace_t *p_workspace, int threshold,
+                          int begin, int end, int first, int last)
+{
+	int w = p_bitmap->width;
+
+	for (int i = begin; i < end; ++i) {
+		uint64_t *row = visited_row(p_workspace, i);
+		for (int k = first; k < last; ++k) {
+			uint64_t valid = k * 64 + 64 <= w ? ~0ULL
+				: ~0ULL >> (64 - (w & 63));
+			uint64_t bits;
+			while ((bits = ~row[k] & valid) != 0) {
+				int j = k * 64 + __builtin_ctzll(bits);
+				if (fill_bitmap(p_new_bitmap, p_bitmap,
+				                p_workspace, j, i,
+				                threshold) != 0) {
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+int compress_bitmap(bitmap_t *p_new_bitmap,
+                    const bitmap_t *p_bitmap,
+                    int threshold)
+{
+	compress_workspace_t workspace;
+	int e;
+
+	if (initialize_compress_workspace(&workspace) != 0) return 1;
+	e = compress_bitmap_workspace(p_new_bitmap, p_bitmap, threshold,
+	                              &workspace);
+	clear_compress_workspace(&workspace);
+
+	return e;
 }
 
-int fill_bitmap(bitmap_t *p_new_bitmap,
-                const bitmap_t *p_bitmap,
-                uint8_t **flags,
-                int x,
-                int y,
-                int threshold)
+int compress_bitmap_workspace(bitmap_t *p_new_bitmap,
+                              const bitmap_t *p_bitmap,
+                              int threshold,
+                              compress_workspace_t *p_workspace)
+{
+	if (p_new_bitmap == NULL || p_bitmap == NULL || p_workspace == NULL
+	    || p_new_bitmap->width != p_bitmap->width
+	    || p_new_bitmap->height != p_bitmap->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+
+	int w = p_bitmap->width;
+	int h = p_bitmap->height;
+
+	p_new_bitmap->compression = 0;
+
+	/* The coordinates on the stack are 16 bits wide */
+	if (w > UINT16_MAX + 1 || h > UINT16_MAX + 1) {
+		fprintf(stderr, "Bitmap too large to compress\n");
+		return 1;
+	}
+	if (threadpool_threads() > 1 && h >= 2 * COMPRESS_BAND_MIN_ROWS
+	    && !p_workspace->tiled) {
+		return compress_bitmap_parallel(p_new_bitmap, p_bitmap,
+		                                threshold, p_workspace);
+	}
+	if (reserve_workspace(p_workspace, w, h) != 0) return 1;
+
+	/* Applying the fill algorithm, from every pixel still unvisited */
+	int rows = p_workspace->tiled ? TILE_ROWS : h;
+	int columns = p_workspace->tiled ? tile_columns(w, sizeof(pixel_t)) : w;
+	for (int i = 0; i < h; i += rows) {
+		for (int j = 0; j < w; j += columns) {
+			int end = h - i > rows ? i + rows : h;
+			int last = w - j > columns ? j + columns : w;
+			if (fill_unvisited(p_new_bitmap, p_bitmap, p_workspace,
+			                   threshold, i, end, j / 64,
+			                   (last + 63) / 64) != 0) {
+				return 1;
+			}
+		}
+	}
+	p_workspace->boundary_width = w;
+	p_workspace->boundary_height = h;
+	p_workspace->boundary_compression = p_new_bitmap->compression
+		= next_compression();
+	count_boundary_points(p_workspace);
+
+	return 0;
+}
+
+/*
+ *    Parallel compression. The rows are split in bands and every band is
+ * first filled on its own, in raster order, as if it were the whole image
+ * (phase 1, in parallel). The pixels get the 1-based index of their region in
+ * the band as label. Then the bands are merged from top to bottom (phase 2,
+ * serial) to get exactly the regions of the serial algorithm:
+ *    - when the serial raster order reaches a band, every row above it is
+ * already filled, so a region of the band is exact unless some of its pixels
+ * were claimed by a region that started in an earlier band, or unless it
+ * grows below the band;
+ *    - the pixels claimed during the merge get the label LABEL_SERIAL and
+ * every band counts how many pixels of each of its regions were claimed;
+ *    - a region with no claimed pixels is accepted as is and, if it touches
+ * the bottom of the band with a similar pixel below, it is extended serially
+ * from there. A region whose pixels were all claimed disappears. A region
+ * with only some claimed pixels breaks the band, which is then finished
+ * serially from its seed, in raster order.
+ */
+#define LABEL_SERIAL UINT32_MAX
+
+/*   A band of rows, with the regions found in phase 1   */
+typedef struct {
+	int y0, y1;
+	uint32_t regions;
+	uint32_t capacity;
+	uint32_t *seeds;
+	uint32_t *sizes;
+	uint32_t *claimed;
+	uint64_t *leaks;
+	size_t leak_count;
+	compress_stats_t stats;
+	int error;
+} compress_band_t;
+
+/*   Shared state of a parallel compression   */
+typedef struct {
+	bitmap_t *p_new_bitmap;
+	const bitmap_t *p_bitmap;
+	int threshold;
+	uint32_t *labels;
+	compress_band_t *bands;
+	int band_rows;
+	compress_workspace_t *p_workspace;
+} compress_job_t;
+
+/*   Parameters of label_fill   */
+typedef struct {
+	int top, bottom;
+	int band_end;
+	uint32_t accepted;
+	uint32_t mark;
+	uint32_t *sizes;
+	compress_stats_t *p_stats;
+} label_fill_t;
+
+/**
+ *    Check if the pixel with label @label at row @i is visited for @p_fill:
+ * claimed during the merge, or accepted in the band ending at band_end.
+ */
+static inline int label_visited(const label_fill_t *p_fill, uint32_t label,
+                                int i)
+{
+	return label == LABEL_SERIAL || (i < p_fill->band_end && label != 0
+		&& label <= p_fill->accepted);
+}
+
+/**
+ *    Claim the pixel at row @i, column @j: count it for the band that owned it
+ * in phase 1, label it and color it.
+ */
+static inline void label_claim(const compress_job_t *job,
+                               const label_fill_t *p_fill,
+                               uint32_t *label, pixel_t *dst, int i,
+                               pixel_t color)
+{
+	if (*label != 0) {
+		++job->bands[i / job->band_rows].claimed[*label - 1];
+	}
+	*label = p_fill->mark;
+	*dst = color;
+}
+
+/**
+ *    Push one seed for every run of pixels not visited for @p_fill and
+ * similar to @color between the columns @l and @r of row @i.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int push_label_runs(stack_t *p_stack, const compress_job_t *job,
+                           const label_fill_t *p_fill, int i, int l, int r,
+                           pixel_t color)
+{
+	const pixel_t *src = bitmap_row(job->p_bitmap, i);
+	const uint32_t *label = job->labels
+		+ (size_t)i * job->p_bitmap->width;
+	int in_run = 0;
+
+	if (stack_reserve(p_stack, (r - l) / 2 + 1) != 0) return 1;
+	for (int j = l; j <= r; ++j) {
+		int candidate = !label_visited(p_fill, label[j], i) &&
+			similar_to_seed(&src[j], color.r, color.g, color.b,
+			                job->threshold);
+		if (candidate && !in_run) stack_push_unchecked(p_stack, j, i);
+		in_run = candidate;
+	}
+	return 0;
+}
+
+/**
+ *    Pop the seeds of @p_stack until one is not visited for @p_fill and store
+ * it in (@p_j, @p_i).
+ *    @return 1 if a seed was found or 0 if the stack is empty;
+ */
+static inline int pop_unlabeled(stack_t *p_stack, const compress_job_t *job,
+                                const label_fill_t *p_fill, int *p_i,
+                                int *p_j)
+{
+	while (!stack_is_empty(p_stack)) {
+		point_t point = stack_pop_point(p_stack);
+		if (!label_visited(p_fill, job->labels[(size_t)point.y
+			* job->p_bitmap->width + point.x], point.y)) {
+			*p_i = point.y;
+			*p_j = point.x;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ *    Scanline fill with the pixels not visited for @p_fill, between its top
+ * and bottom rows, starting from the unvisited pixel (@x, @y) with the color
+ * @color. It is the same algorithm as fill_bitmap, on labels instead of flags.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int label_fill(const compress_job_t *job, const label_fill_t *p_fill,
+                      stack_t *p_stack, int x, int y, pixel_t color)
+{
+	int w = job->p_bitmap->width;
+	int i = y, j = x;
+	int e = 0;
+
+	do {
+		uint32_t *label = job->labels + (size_t)i * w;
+		const pixel_t *src = bitmap_row(job->p_bitmap, i);
+		pixel_t *dst = bitmap_row(job->p_new_bitmap, i);
+		int l = j, r = j;
+		while (l > 0 && !label_visited(p_fill, label[l - 1], i) &&
+		       similar_to_seed(&src[l - 1], color.r, color.g, color.b,
+		                       job->threshold)) {
+			--l;
+		}
+		while (r + 1 < w && !label_visited(p_fill, label[r + 1], i) &&
+		       similar_to_seed(&src[r + 1], color.r, color.g, color.b,
+		                       job->threshold)) {
+			++r;
+		}
+		for (int k = l; k <= r; ++k) {
+			label_claim(job, p_fill, &label[k], &dst[k], i, color);
+		}
+		if (p_fill->sizes != NULL) {
+			p_fill->sizes[p_fill->mark - 1] += r - l + 1;
+		}
+
+		if (i > p_fill->top) {
+			e = push_label_runs(p_stack, job, p_fill, i - 1, l, r,
+			                    color);
+		}
+		if (e == 0 && i + 1 < p_fill->bottom) {
+			e = push_label_runs(p_stack, job, p_fill, i + 1, l, r,
+			                    color);
+		}
+		p_fill->p_stats->pixels_visited += (uint64_t)(r - l + 1)
+			* (1 + (i > p_fill->top) + (i + 1 < p_fill->bottom));
+		if (stack_size(p_stack) > p_fill->p_stats->max_stack_depth) {
+			p_fill->p_stats->max_stack_depth = stack_size(p_stack);
+		}
+	} while (e == 0 && pop_unlabeled(p_stack, job, p_fill, &i, &j));
+
+	return e;
+}
+
+static int compare_leaks(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ *    Add a region seeded at (@x, @y) to @p_band.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int add_band_region(compress_band_t *p_band, int w, int x, int y)
+{
+	if (p_band->regions == p_band->capacity) {
+		uint32_t capacity = p_band->capacity ? 2 * p_band->capacity
+			: 1024;
+		uint32_t *seeds = realloc(p_band->seeds,
+		                          capacity * sizeof(uint32_t));
+		if (seeds == NULL) return 1;
+		p_band->seeds = seeds;
+		uint32_t *sizes = realloc(p_band->sizes,
+		                          capacity * sizeof(uint32_t));
+		if (sizes == NULL) return 1;
+		p_band->sizes = sizes;
+		p_band->capacity = capacity;
+	}
+	p_band->seeds[p_band->regions] = (uint32_t)(y - p_band->y0) * w + x;
+	p_band->sizes[p_band->regions] = 0;
+	++p_band->regions;
+	return 0;
+}
+
+/**
+ *    Phase 1 on the band @p_band: fill it on its own, then list the pixels of
+ * its last row that have a pixel similar to their seed color below.
+ */
+static void fill_band(const compress_job_t *job, compress_band_t *p_band)
+{
+	int w = job->p_bitmap->width;
+	int h = job->p_bitmap->height;
+	label_fill_t fill;
+	stack_t stack;
+
+	if (initialize_stack(&stack) != 0) {
+		p_band->error = 1;
+		return;
+	}
+
+	fill.top = p_band->y0;
+	fill.bottom = p_band->y1;
+	fill.band_end = p_band->y1;
+	fill.accepted = LABEL_SERIAL - 1;
+	fill.sizes = NULL;
+	fill.p_stats = &p_band->stats;
+	for (int i = p_band->y0; i < p_band->y1 && !p_band->error; ++i) {
+		const uint32_t *label = job->labels + (size_t)i * w;
+		for (int j = 0; j < w; ++j) {
+			if (label[j] != 0) continue;
+			if (add_band_region(p_band, w, j, i) != 0) {
+				p_band->error = 1;
+				break;
+			}
+			fill.mark = p_band->regions;
+			fill.sizes = p_band->sizes;
+			if (label_fill(job, &fill, &stack, j, i,
+			               bitmap_row(job->p_bitmap, i)[j]) != 0) {
+				p_band->error = 1;
+				break;
+			}
+		}
+	}
+	clear_stack(&stack);
+	if (p_band->error || p_band->y1 >= h) return;
+
+	/* Find the regions that may grow below the band */
+	int i = p_band->y1 - 1;
+	const uint32_t *label = job->labels + (size_t)i * w;
+	const pixel_t *below = bitmap_row(job->p_bitmap, i + 1);
+	p_band->leaks = malloc(w * sizeof(uint64_t));
+	if (p_band->leaks == NULL) {
+		p_band->error = 1;
+		return;
+	}
+	for (int j = 0; j < w; ++j) {
+		uint32_t seed = p_band->seeds[label[j] - 1];
+		int y = p_band->y0 + seed / w;
+		pixel_t color = bitmap_row(job->p_bitmap, y)[seed % w];
+		if (similar_to_seed(&below[j], color.r, color.g, color.b,
+		                    job->threshold)) {
+			p_band->leaks[p_band->leak_count++] =
+				(uint64_t)label[j] << 32 | (uint32_t)j;
+		}
+	}
+	qsort(p_band->leaks, p_band->leak_count, sizeof(uint64_t),
+	      compare_leaks);
+}
+
+/**
+ *    Run fill_band on every band overlapping the rows [@begin, @end). This is
+ * a single band when the pool splits the rows, but all of them when
+ * parallel_rows runs the whole range on the calling thread.
+ */
+static void compress_band(void *arg, int begin, int end)
+{
+	compress_job_t *job = arg;
+
+	for (int k = begin / job->band_rows; k * job->band_rows < end; ++k) {
+		fill_band(job, &job->bands[k]);
+	}
+}
+
+/**
+ *    Phase 2 on the band @k.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int merge_band(compress_job_t *job, int k, stack_t *p_stack)
+{
+	compress_band_t *p_band = &job->bands[k];
+	int w = job->p_bitmap->width;
+	int h = job->p_bitmap->height;
+	size_t next_leak = 0;
+	uint32_t o;
+	label_fill_t fill;
+
+	fill.top = p_band->y0;
+	fill.bottom = h;
+	fill.band_end = p_band->y1;
+	fill.mark = LABEL_SERIAL;
+	fill.sizes = NULL;
+	fill.p_stats = &job->p_workspace->stats;
+
+	/* Accept the regions while they are exact */
+	for (o = 1; o <= p_band->regions; ++o) {
+		if (p_band->claimed[o - 1] == p_band->sizes[o - 1]) continue;
+		if (p_band->claimed[o - 1] != 0) break;
+		++fill.p_stats->regions;
+
+		/* Grow the region below the band, like the serial fill would */
+		uint32_t seed = p_band->seeds[o - 1];
+		pixel_t color = bitmap_row(job->p_bitmap,
+			p_band->y0 + seed / w)[seed % w];
+		fill.accepted = o;
+		while (next_leak < p_band->leak_count
+		       && p_band->leaks[next_leak] >> 32 < o) {
+			++next_leak;
+		}
+		for (; next_leak < p_band->leak_count
+		       && p_band->leaks[next_leak] >> 32 == o; ++next_leak) {
+			int j = (uint32_t)p_band->leaks[next_leak];
+			uint32_t label = job->labels[(size_t)p_band->y1 * w + j];
+			if (label_visited(&fill, label, p_band->y1)) continue;
+			if (label_fill(job, &fill, p_stack, j, p_band->y1,
+			               color) != 0) {
+				return 1;
+			}
+		}
+	}
+	if (o > p_band->regions) return 0;
+
+	/* Finish the band serially, from the seed of the broken region */
+	fill.accepted = o - 1;
+	for (size_t p = p_band->seeds[o - 1];
+	     p < (size_t)(p_band->y1 - p_band->y0) * w; ++p) {
+		int i = p_band->y0 + p / w;
+		int j = p % w;
+		if (label_visited(&fill, job->labels[(size_t)i * w + j], i)) {
+			continue;
+		}
+		++fill.p_stats->regions;
+		if (label_fill(job, &fill, p_stack, j, i,
+		               bitmap_row(job->p_bitmap, i)[j]) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ *    Find the boundary of the rows [@begin, @end) of the compressed bitmap.
+ */
+static void boundary_band(void *arg, int begin, int end)
+{
+	compress_job_t *job = arg;
+	const bitmap_t *p_bitmap = job->p_new_bitmap;
+
+	for (int i = begin; i < end; ++i) {
+		const pixel_t *rows[3] = {
+			i > 0 ? bitmap_row(p_bitmap, i - 1) : NULL,
+			bitmap_row(p_bitmap, i),
+			i + 1 < p_bitmap->height ? bitmap_row(p_bitmap, i + 1)
+				: NULL};
+		boundary_row(boundary_row_bits(job->p_workspace, i), rows,
+		             p_bitmap->width);
+	}
+}
+
+int compress_bitmap_parallel(bitmap_t *p_new_bitmap,
+                             const bitmap_t *p_bitmap,
+                             int threshold,
+                             compress_workspace_t *p_workspace)
+{
+	if (p_new_bitmap == NULL || p_bitmap == NULL || p_workspace == NULL
+	    || p_new_bitmap->width != p_bitmap->width
+	    || p_new_bitmap->height != p_bitmap->height) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+
+	compress_job_t job;
+	int w = p_bitmap->width;
+	int h = p_bitmap->height;
+	int count, e = 0;
+
+	/* Use a couple of bands per thread, so that they can be stolen */
+	job.band_rows = (h + 2 * threadpool_threads() - 1)
+		/ (2 * threadpool_threads());
+	if (job.band_rows < COMPRESS_BAND_MIN_ROWS) {
+		job.band_rows = COMPRESS_BAND_MIN_ROWS;
+	}
+	count = (h + job.band_rows - 1) / job.band_rows;
+
+	p_new_bitmap->compression = 0;
+	job.p_new_bitmap = p_new_bitmap;
+	job.p_bitmap = p_bitmap;
+	job.threshold = threshold;
+	job.p_workspace = p_workspace;
+	if (reserve_workspace(p_workspace, w, h) != 0) return 1;
+	if ((size_t)w * h > p_workspace->labels_capacity) {
+		free(p_workspace->labels);
+		p_workspace->labels_capacity = 0;
+		p_workspace->labels = malloc((size_t)w * h * sizeof(uint32_t));
+		if (p_workspace->labels == NULL) {
+			fprintf(stderr, "Error allocating the labels\n");
+			return 1;
+		}
+		p_workspace->labels_capacity = (size_t)w * h;
+	}
+	job.labels = p_workspace->labels;
+	memset(job.labels, 0, (size_t)w * h * sizeof(uint32_t));
+	job.bands = calloc(count, sizeof(compress_band_t));
+	if (job.bands == NULL) {
+		fprintf(stderr, "Error allocating the bands\n");
+		return 1;
+	}
+	for (int k = 0; k < count; ++k) {
+		job.bands[k].y0 = k * job.band_rows;
+		job.bands[k].y1 = k + 1 < count ? (k + 1) * job.band_rows : h;
+	}
+
+	/* Phase 1: fill the bands in parallel */
+	parallel_rows(h, job.band_rows, compress_band, &job);
+	for (int k = 0; k < count && e == 0; ++k) {
+		compress_band_t *p_band = &job.bands[k];
+		compress_stats_t *p_stats = &p_workspace->stats;
+		p_band->claimed = calloc(p_band->regions + 1, sizeof(uint32_t));
+		if (p_band->error || p_band->claimed == NULL) e = 1;
+		p_stats->pixels_visited += p_band->stats.pixels_visited;
+		if (p_band->stats.max_stack_depth > p_stats->max_stack_depth) {
+			p_stats->max_stack_depth =
+				p_band->stats.max_stack_depth;
+		}
+	}
+
+	/* Phase 2: merge them in order */
+	stack_reset(&p_workspace->stack);
+	for (int k = 0; k < count && e == 0; ++k) {
+		e = merge_band(&job, k, &p_workspace->stack);
+	}
+	if (e != 0) fprintf(stderr, "Error while compressing the bitmap\n");
+
+	/* The regions are only known now, so search their boundary */
+	if (e == 0) {
+		parallel_rows(h, band_rows(w * sizeof(pixel_t)), boundary_band,
+		              &job);
+		p_workspace->boundary_width = w;
+		p_workspace->boundary_height = h;
+		p_workspace->boundary_compression = p_new_bitmap->compression
+			= next_compression();
+		count_boundary_points(p_workspace);
+	}
+
+	/* Clean the temporary data */
+	for (int k = 0; k < count; ++k) {
+		free(job.bands[k].seeds);
+		free(job.bands[k].sizes);
+		free(job.bands[k].claimed);
+		free(job.bands[k].leaks);
+	}
+	free(job.bands);
+
+	return e;
+}
+
+/**
+ *    Check that the @count points at @points are inside a @width x @height
+ * bitmap and sorted in row order, so that they can be decoded without any
+ * further check.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int validate_points(const uint8_t *points, size_t count, int width,
+                           int height)
+{
+	uint32_t previous = 0;
+
+	for (size_t k = 0; k < count; ++k) {
+		compressed_point_t pt;
+		memcpy(&pt, points + k * sizeof(pt), sizeof(pt));
+		uint32_t key = (uint32_t)pt.y << 16 | pt.x;
+		if ((unsigned)pt.x - 1 >= (unsigned)width
+		    || (unsigned)pt.y - 1 >= (unsigned)height
+		    || key <= previous) {
+			fprintf(stderr, "Invalid compressed point %zu: "
+				"(%d, %d)\n", k, pt.x, pt.y);
+			return 1;
+		}
+		previous = key;
+	}
+	return 0;
+}
+
+/**
+ *    Find the first of the @count sorted points at @points that is on the row
+ * @i or after it.
+ *    @return the index of the point or @count if there is none;
+ */
+static size_t find_row(const uint8_t *points, size_t count, int i)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		uint16_t y;
+		memcpy(&y, points + mid * sizeof(compressed_point_t), sizeof(y));
+		if (y - 1 < i) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/**
+ *    Set to black the pixels of @p_bitmap from row @y, column @x up to row @i,
+ * column @j (excluded), which no point covers.
+ */
+static void clear_gap(bitmap_t *p_bitmap, int y, int x, int i, int j)
+{
+	for (; y < i; ++y, x = 0) {
+		memset(bitmap_row(p_bitmap, y) + x, 0,
+		       (size_t)(p_bitmap->width - x) * sizeof(pixel_t));
+	}
+	if (j > x) {
+		memset(bitmap_row(p_bitmap, i) + x, 0,
+		       (size_t)(j - x) * sizeof(pixel_t));
+	}
+}
+
+/**
+ *    Decode the @count validated points at @points into @p_bitmap, whose row 0
+ * is the row @first of the image: every point colors its row up to the next
+ * point of the same row or to the end of the row.
+ */
+static void decode_points(bitmap_t *p_bitmap, const uint8_t *points,
+                          size_t count, int first)
+{
+	int w = p_bitmap->width;
+	int y = 0, x = 0;
+	compressed_point_t pt, next;
+
+	if (count == 0) {
+		clear_gap(p_bitmap, 0, 0, p_bitmap->height, 0);
+		return;
+	}
+	memcpy(&next, points, sizeof(next));
+	for (size_t k = 0; k < count; ++k) {
+		int end = w;
+		pt = next;
+		if (k + 1 < count) {
+			memcpy(&next, points + (k + 1) * sizeof(next),
+			       sizeof(next));
+			if (next.y == pt.y) end = next.x - 1;
+		}
+		pixel_t color = {.b = pt.b, .g = pt.g, .r = pt.r};
+		int i = pt.y - 1 - first;
+		clear_gap(p_bitmap, y, x, i, pt.x - 1);
+		fill_pixels(bitmap_row(p_bitmap, i) + pt.x - 1, color,
+		            end - (pt.x - 1));
+		y = i;
+		x = end;
+	}
+
+	/* The last point always reaches the end of its row */
+	clear_gap(p_bitmap, y + 1, 0, p_bitmap->height, 0);
+}
+
+/*   State of the decoding of a v2 file   */
+typedef struct {
+	bitmap_t *p_bitmap;
+	const uint8_t *blocks;
+	uint64_t *offsets;
+	rans_table_t *p_table;
+	int encoding;
+	int width, height;
+	int block_rows;
+	int first_block;
+	int first, count;
+	int error;
+} decode_job_t;
+
+/*   Memory of a thread decoding COMPRESSED_COMPACT blocks   */
+typedef struct {
+	compressed_run_t *runs;
+	pixel_t *rows[2];
+	uint8_t *raw;
+	size_t raw_capacity;
+} decode_scratch_t;
+
+/**
+ *    Fill @row of @width pixels with the @n valid runs at @runs, stored with
+ * COMPRESSED_RUNS.
+ */
+static void fill_runs_row(pixel_t *row, int width, const uint8_t *runs, int n)
+{
+	compressed_run_t run, next;
+
+	if (n == 0) {
+		memset(row, 0, (size_t)width * sizeof(pixel_t));
+		return;
+	}
+
+	memcpy(&next, runs, sizeof(next));
+	memset(row, 0, (size_t)(next.x - 1) * sizeof(pixel_t));
+	for (int k = 0; k < n; ++k) {
+		int end = width;
+		run = next;
+		if (k + 1 < n) {
+			memcpy(&next, runs + (k + 1) * sizeof(next),
+			       sizeof(next));
+			end = next.x - 1;
+		}
+		pixel_t color = {.b = run.b, .g = run.g, .r = run.r};
+		fill_pixels(row + run.x - 1, color, end - (run.x - 1));
+	}
+}
+
+/**
+ *    Decode the @n runs at @runs, stored with COMPRESSED_RUNS, into @row of
+ * @width pixels. The runs are checked before anything is written.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int decode_runs_row(pixel_t *row, int width, const uint8_t *runs,
+                           int n)
+{
+	compressed_run_t run;
+	int previous = 0;
+
+	for (int k = 0; k < n; ++k) {
+		memcpy(&run, runs + k * sizeof(run), sizeof(run));
+		if (run.x <= previous || run.x > width) return 1;
+		previous = run.x;
+	}
+	fill_runs_row(row, width, runs, n);
+	return 0;
+}
+
+/**
+ *    Read a varint of at most 3 bytes from @p into @p_value, without going
+ * past @limit.
+ *    @return the address after the varint or NULL if it is invalid;
+ */
+static inline const uint8_t *get_varint(const uint8_t *p,
+                                        const uint8_t *limit,
+                                        uint32_t *p_value)
+{
+	uint32_t value = 0;
+
+	for (int shift = 0; shift < 21; shift += 7) {
+		if (p == limit) return NULL;
+		value |= (uint32_t)(*p & 0x7F) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*p_value = value;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/**
+ *    Parse the COMPRESSED_COMPACT row at @p, ending at most at @limit, into
+ * the @p_count runs @runs of a row of @width pixels, which are checked.
+ * @above is the decoded row above, or NULL at the start of a block, and
+ * @p_previous the color of the previous point of the block, updated with the
+ * colors of the row.
+ *    @return the address after the row or NULL if it is invalid;
+ */
+static const uint8_t *parse_compact_row(const uint8_t *p,
+                                        const uint8_t *limit, int width,
+                                        const pixel_t *above,
+                                        pixel_t *p_previous,
+                                        compressed_run_t *runs,
+                                        int *p_count)
+{
+	uint32_t n, v;
+	int j = -1;
+
+	p = get_varint(p, limit, &n);
+	if (p == NULL || n > (uint32_t)width) return NULL;
+	for (uint32_t k = 0; k < n; ++k) {
+		p = get_varint(p, limit, &v);
+		if (p == NULL) return NULL;
+		j += (v >> 2) + 1;
+		if (j >= width) return NULL;
+		switch (v & 3) {
+		case COMPRESSED_NEW_COLOR:
+			if (limit - p < 3) return NULL;
+			p_previous->r = p[0];
+			p_previous->g = p[1];
+			p_previous->b = p[2];
+			p += 3;
+			break;
+		case COMPRESSED_PREVIOUS_COLOR:
+			break;
+		case COMPRESSED_ABOVE_COLOR:
+			if (above != NULL) {
+				*p_previous = above[j];
+			} else {
+				memset(p_previous, 0, sizeof(*p_previous));
+			}
+			break;
+		default:
+			return NULL;
+		}
+		runs[k].x = j + 1;
+		runs[k].r = p_previous->r;
+		runs[k].g = p_previous->g;
+		runs[k].b = p_previous->b;
+	}
+	*p_count = n;
+	return p;
+}
+
+/**
+ *    Decode the rows of the block @k stored with COMPRESSED_RUNS at @p, up to
+ * @limit.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int decode_runs_block(const decode_job_t *job, int k, const uint8_t *p,
+                             const uint8_t *limit)
+{
+	int i = k * job->block_rows;
+	int last = i + job->block_rows < job->height
+		? i + job->block_rows : job->height;
+
+	for (; i < last; ++i) {
+		uint16_t n;
+		if (limit - p < (ptrdiff_t)sizeof(n)) return 1;
+		memcpy(&n, p, sizeof(n));
+		p += sizeof(n);
+		if (n > job->width
+		    || (size_t)(limit - p) < n * sizeof(compressed_run_t)) {
+			return 1;
+		}
+		if (i >= job->first && i < job->first + job->count
+		    && decode_runs_row(bitmap_row(job->p_bitmap,
+		                                  i - job->first),
+		                       job->width, p, n) != 0) {
+			return 1;
+		}
+		p += n * sizeof(compressed_run_t);
+	}
+	return 0;
+}
+
+/**
+ *    Decode the rows of the block @k stored with COMPRESSED_COMPACT at @p, up
+ * to @limit. The rows of the block before the range are decoded in the rows of
+ * @p_scratch, because the next rows can reuse their colors.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int decode_compact_block(const decode_job_t *job, int k,
+                                const uint8_t *p, const uint8_t *limit,
+                                decode_scratch_t *p_scratch)
+{
+	const pixel_t *above = NULL;
+	pixel_t previous = {0, 0, 0};
+	int i = k * job->block_rows;
+	int last = i + job->block_rows;
+	int n;
+
+	if (last > job->first + job->count) last = job->first + job->count;
+	for (; i < last; ++i) {
+		pixel_t *row = i >= job->first
+			? bitmap_row(job->p_bitmap, i - job->first)
+			: p_scratch->rows[i & 1];
+		p = parse_compact_row(p, limit, job->width, above, &previous,
+		                      p_scratch->runs, &n);
+		if (p == NULL) return 1;
+		fill_runs_row(row, job->width, (const uint8_t *)p_scratch->runs,
+		              n);
+		above = row;
+	}
+	return 0;
+}
+
+/**
+ *    Decode the block @k stored with COMPRESSED_COMPACT_RANS at @p, up to
+ * @limit, first into the raw bytes of @p_scratch.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int decode_rans_block(const decode_job_t *job, int k, const uint8_t *p,
+                             const uint8_t *limit,
+                             decode_scratch_t *p_scratch)
+{
+	uint32_t size;
+
+	if (limit - p < (ptrdiff_t)sizeof(size)) return 1;
+	memcpy(&size, p, sizeof(size));
+	p += sizeof(size);
+
+	/* No row of COMPRESSED_COMPACT is longer than 3 + 6 * width bytes */
+	if (size > (uint64_t)job->block_rows * (3 + 6 * (uint64_t)job->width)) {
+		return 1;
+	}
+	if (size > p_scratch->raw_capacity) {
+		uint8_t *raw = realloc(p_scratch->raw, size);
+		if (raw == NULL) return 1;
+		p_scratch->raw = raw;
+		p_scratch->raw_capacity = size;
+	}
+	if (rans_decode(p_scratch->raw, size, p, limit - p,
+	                job->p_table) != 0) {
+		return 1;
+	}
+	return decode_compact_block(job, k, p_scratch->raw,
+	                            p_scratch->raw + size, p_scratch);
+}
+
+/**
+ *    Decode the blocks [@begin, @end), counted from the first block of the
+ * range of rows.
+ */
+static void decode_blocks(void *arg, int begin, int end)
 {
-	stack_t stack;
-	pixel_t pixel;
-	int e;
+	decode_job_t *job = arg;
+	decode_scratch_t scratch = {NULL, {NULL, NULL}, NULL, 0};
+	int e = 0;
 
-	int w = p_bitmap->width;
-	int h = p_bitmap->height;
+	if (job->encoding != COMPRESSED_RUNS) {
+		scratch.runs = malloc((size_t)job->width
+			* sizeof(compressed_run_t));
+		scratch.rows[0] = malloc((size_t)2 * job->width
+			* sizeof(pixel_t));
+		scratch.rows[1] = scratch.rows[0] + job->width;
+		e = scratch.runs == NULL || scratch.rows[0] == NULL;
+	}
 
-	e = initialize_stack(&stack);
-	if (e != 0) {
-		fprintf(stderr, "Error initializing the stack\n");
-		return 1;
-	}
-
-	/* Apply iterative dfs */
-	flags[y][x] = 1;
-	pixel = p_bitmap->pixels[y][x];
-	p_new_bitmap->pixels[y][x] = pixel;
-	stack_push(&stack, x, y);
-	while (!stack_is_empty(&stack)) {
-		int i = stack_query_y(&stack);
-		int j = stack_query_x(&stack);
-		stack_pop(&stack);
-		if (j > 0 && flags[i][j - 1] == 0 &&
-		    is_similar(p_bitmap->pixels[i][j - 1], pixel, threshold)) {
-			flags[i][j - 1] = 1;
-			p_new_bitmap->pixels[i][j - 1] = pixel;
-			stack_push(&stack, j - 1, i);
-		}
-		if (j + 1 < w && flags[i][j + 1] == 0 &&
-		    is_similar(p_bitmap->pixels[i][j + 1], pixel, threshold)) {
-			flags[i][j + 1] = 1;
-			p_new_bitmap->pixels[i][j + 1] = pixel;
-			stack_push(&stack, j + 1, i);
-		}
-		if (i > 0 && flags[i - 1][j] == 0 &&
-		    is_similar(p_bitmap->pixels[i - 1][j], pixel, threshold)) {
-			flags[i - 1][j] = 1;
-			p_new_bitmap->pixels[i - 1][j] = pixel;
-			stack_push(&stack, j, i - 1);
-		}
-		if (i + 1 < h && flags[i + 1][j] == 0 &&
-		    is_similar(p_bitmap->pixels[i + 1][j], pixel, threshold)) {
-			flags[i + 1][j] = 1;
-			p_new_bitmap->pixels[i + 1][j] = pixel;
-			stack_push(&stack, j, i + 1);
+	for (int k = job->first_block + begin;
+	     k < job->first_block + end && e == 0; ++k) {
+		const uint8_t *p = job->blocks + job->offsets[k];
+		const uint8_t *limit = job->blocks + job->offsets[k + 1];
+
+		if (job->encoding == COMPRESSED_RUNS) {
+			e = decode_runs_block(job, k, p, limit);
+		} else if (job->encoding == COMPRESSED_COMPACT) {
+			e = decode_compact_block(job, k, p, limit, &scratch);
+		} else {
+			e = decode_rans_block(job, k, p, limit, &scratch);
 		}
 	}
-	clear_stack(&stack);
+	if (e != 0) __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
 
-	return 0;
+	free(scratch.runs);
+	free(scratch.rows[0]);
+	free(scratch.raw);
 }
 
-int compress_bitmap(bitmap_t *p_new_bitmap,
-                    const bitmap_t *p_bitmap,
-                    int threshold)
+/**
+ *    A compressed file opened for decoding its rows. The data of a v1 file is
+ * the array of its @points sorted points, while a v2 file has its checked
+ * index and model in @job.
+ */
+typedef struct {
+	file_map_t map;
+	const uint8_t *data;
+	size_t points;
+	int version;
+	int width, height;
+	decode_job_t job;
+} compressed_reader_t;
+
+/**
+ *    Check the v1 data of @p_reader, of @size bytes.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int open_points(compressed_reader_t *p_reader, size_t size)
 {
-	if (p_new_bitmap == NULL || p_bitmap == NULL
-	    || p_new_bitmap->width != p_bitmap->width
-	    || p_new_bitmap->height != p_bitmap->height) {
-		fprintf(stderr, "Invalid arguments");
+	p_reader->points = size / sizeof(compressed_point_t);
+	if (p_reader->points == 0) {
+		fprintf(stderr, "Error while reading the compressed data\n");
 		return 1;
 	}
+	return validate_points(p_reader->data, p_reader->points,
+	                       p_reader->width, p_reader->height);
+}
 
-	uint8_t **flags;
-	int w, h;
-
-	/* Initialize the temporary data */
-	w = p_bitmap->width;
-	h = p_bitmap->height;
+/**
+ *    Check the header, the model and the index of the v2 data of @p_reader,
+ * of @size bytes, so that its blocks can be decoded independently.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int open_blocks(compressed_reader_t *p_reader, size_t size)
+{
+	decode_job_t *job = &p_reader->job;
+	const uint8_t *data = p_reader->data;
+	compressed_header_t header;
+	uint16_t freq[RANS_SYMBOLS];
+	uint64_t *offsets;
+	size_t index_start, index_end;
+	int h = p_reader->height;
 
-	flags = malloc(h * sizeof(uint8_t *));
-	if (flags == NULL) {
-		fprintf(stderr, "Error allocating the flags\n");
+	memcpy(&header, data, sizeof(header));
+	if (header.version != COMPRESSED_V2
+	    || header.encoding > COMPRESSED_COMPACT_RANS
+	    || header.block_rows == 0 || header.block_rows > UINT16_MAX + 1
+	    || header.block_count != (h + header.block_rows - 1)
+	                             / header.block_rows) {
+		fprintf(stderr, "Unsupported compressed header\n");
 		return 1;
 	}
-	for (int i = 0; i < h; ++i) {
-		flags[i] = calloc(w, sizeof(uint8_t));
-		if (flags[i] == NULL) {
-			for (int j = 0; j < i; ++j) free(flags[j]);
-			free(flags);
-			fprintf(stderr, "Error allocating the flags\n");
+
+	/* Read the frequencies of the entropy coder */
+	index_start = sizeof(header);
+	if (header.encoding == COMPRESSED_COMPACT_RANS) {
+		index_start += sizeof(freq);
+		if (size < index_start) {
+			fprintf(stderr, "Error reading the frequencies\n");
 			return 1;
 		}
-	}
-
-	/* Applying the fill algorithm */
-	for (int i = 0; i < h; ++i) {
-		for (int j = 0; j < w; ++j) {
-			if (flags[i][j] == 0) {
-				fill_bitmap(p_new_bitmap, p_bitmap, flags,
-				            j, i, threshold);
-			}
+		memcpy(freq, data + sizeof(header), sizeof(freq));
+		job->p_table = malloc(sizeof(rans_table_t));
+		if (job->p_table == NULL) {
+			fprintf(stderr, "Error allocating the model\n");
+			return 1;
+		}
+		if (rans_build_table(job->p_table, freq) != 0) {
+			fprintf(stderr, "Invalid compressed frequencies\n");
+			return 1;
 		}
 	}
 
-	/* Clean the temporary data */
-	for (int i = 0; i < h; ++i) free(flags[i]);
-	free(flags);
+	index_end = index_start
+		+ ((size_t)header.block_count + 1) * sizeof(uint64_t);
+	if (size < index_end) {
+		fprintf(stderr, "Error while reading the index\n");
+		return 1;
+	}
+	job->offsets = offsets
+		= malloc(((size_t)header.block_count + 1) * sizeof(uint64_t));
+	if (offsets == NULL) {
+		fprintf(stderr, "Error allocating the index\n");
+		return 1;
+	}
+	memcpy(offsets, data + index_start,
+	       ((size_t)header.block_count + 1) * sizeof(uint64_t));
+	for (uint32_t k = 0; k < header.block_count; ++k) {
+		if (offsets[k] > offsets[k + 1]) offsets[0] = UINT64_MAX;
+	}
+	if (offsets[0] != 0
+	    || offsets[header.block_count] > size - index_end) {
+		fprintf(stderr, "Invalid compressed index\n");
+		return 1;
+	}
 
+	job->blocks = data + index_end;
+	job->encoding = header.encoding;
+	job->width = p_reader->width;
+	job->height = h;
+	job->block_rows = header.block_rows;
 	return 0;
 }
 
-int read_compressed_bmp(const char file_name[],
-                        bmp_file_header_t *p_file_header,
-                        bmp_info_header_t *p_info_header,
-                        bitmap_t *p_bitmap)
+/**
+ *    Release the data of @p_reader.
+ */
+static void close_compressed(compressed_reader_t *p_reader)
 {
-	FILE *p_file;
+	free(p_reader->job.offsets);
+	free(p_reader->job.p_table);
+	unmap_file(&p_reader->map);
+}
+
+/**
+ *    Open the compressed file located at @file_name, in any version, for
+ * decoding its rows with @p_reader. Its headers are stored in
+ * @p_file_header and @p_info_header.
+ *    @return 0 if successful or an error code otherwise, in which case
+ * @p_reader is already closed;
+ */
+static int open_compressed(const char file_name[],
+                           bmp_file_header_t *p_file_header,
+                           bmp_info_header_t *p_info_header,
+                           compressed_reader_t *p_reader)
+{
+	file_map_t *p_map = &p_reader->map;
+	size_t size;
 	int w, h, e;
-	compressed_point_t p1, p2;
 
-	p_file = fopen(file_name, "rb");
-	if (p_file == NULL) {
-		fprintf(stderr, "Can't open file %s\n", file_name);
-		return 1;
-	}
+	memset(p_reader, 0, sizeof(*p_reader));
+	if (load_file(file_name, p_map) != 0) return 1;
 
-	/* Read File Header */
-	e = fread(p_file_header, sizeof(bmp_file_header_t), 1, p_file);
-	if (e != 1) {
-		fprintf(stderr, "Error while reading the File Header\n");
-		fclose(p_file);
+	/* Read the headers */
+	if (p_map->size < sizeof(bmp_file_header_t)
+	                  + sizeof(bmp_info_header_t)) {
+		fprintf(stderr, "Error while reading the headers\n");
+		close_compressed(p_reader);
 		return 1;
 	}
+	memcpy(p_file_header, p_map->data, sizeof(bmp_file_header_t));
+	memcpy(p_info_header, p_map->data + sizeof(bmp_file_header_t),
+	       sizeof(bmp_info_header_t));
 	if (p_file_header->signature != BMP_SIGNATURE) {
 		fprintf(stderr, "Invalid BMP signature: %X\n",
 			p_file_header->signature);
-		fclose(p_file);
+		close_compressed(p_reader);
 		return 1;
 	}
 
-	/* Read Info Header */
-	e = fread(p_info_header, sizeof(bmp_info_header_t), 1, p_file);
-	if (e != 1) {
-		fprintf(stderr, "Error while reading the Info Header\n");
-		fclose(p_file);
-		return 1;
-	}
-
-	/* Read the compressed data, pixel by pixel */
+	/* Check the size before touching the data */
 	w = p_info_header->width;
 	h = p_info_header->height;
-	e = initialize_bitmap(p_bitmap, w, h);
-	if (e != 0) {
-		fprintf(stderr, "Error while initializing the bitmap");
-		fclose(p_file);
+	if (w <= 0 || h <= 0 || w > UINT16_MAX || h > UINT16_MAX) {
+		fprintf(stderr, "Invalid height or width for bitmap\n");
+		close_compressed(p_reader);
 		return 1;
 	}
-	e = fseek(p_file, p_file_header->offset, SEEK_SET);
-	if (e != 0) {
+	if (p_file_header->offset > p_map->size) {
 		fprintf(stderr, "Error while moving cursor to %d\n",
 			p_file_header->offset);
-		fclose(p_file);
+		close_compressed(p_reader);
 		return 1;
 	}
-	if (fread(&p1, sizeof(compressed_point_t), 1, p_file) != 1) {
-		fprintf(stderr, "Error while reading the compressed data\n");
-		fclose(p_file);
+	p_reader->data = p_map->data + p_file_header->offset;
+	p_reader->width = w;
+	p_reader->height = h;
+	size = p_map->size - p_file_header->offset;
+
+	/* A v1 file starts with a point, which can't match the magic */
+	if (size >= sizeof(compressed_header_t)
+	    && memcmp(p_reader->data, COMPRESSED_MAGIC, 4) == 0) {
+		p_reader->version = COMPRESSED_V2;
+		e = open_blocks(p_reader, size);
+	} else {
+		p_reader->version = COMPRESSED_V1;
+		e = open_points(p_reader, size);
+	}
+	if (e != 0) close_compressed(p_reader);
+	return e;
+}
+
+/**
+ *    Decode the rows of @p_reader starting at row @first into the rows of
+ * @p_bitmap, which has the width of the image and at most as many rows as
+ * there are left. The blocks of a v2 file are decoded in parallel.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int decode_compressed_rows(compressed_reader_t *p_reader,
+                                  bitmap_t *p_bitmap, int first)
+{
+	decode_job_t *job = &p_reader->job;
+	int count = p_bitmap->height;
+
+	if (p_reader->version == COMPRESSED_V1) {
+		const uint8_t *points = p_reader->data;
+		size_t begin = find_row(points, p_reader->points, first);
+		size_t end = find_row(points, p_reader->points, first + count);
+		decode_points(p_bitmap,
+		              points + begin * sizeof(compressed_point_t),
+		              end - begin, first);
+		return 0;
+	}
+
+	job->p_bitmap = p_bitmap;
+	job->first_block = first / job->block_rows;
+	job->first = first;
+	job->count = count;
+	job->error = 0;
+	parallel_rows((first + count - 1) / job->block_rows
+	              - job->first_block + 1, 1, decode_blocks, job);
+	if (job->error) {
+		fprintf(stderr, "Invalid compressed block\n");
 		return 1;
 	}
-	while (fread(&p2, sizeof(compressed_point_t), 1, p_file) == 1) {
-		int i = p1.y - 1;
-		if (p1.y != p2.y) {
-			for (int j = p1.x - 1; j < w; ++j) {
-				p_bitmap->pixels[i][j].r = p1.r;
-				p_bitmap->pixels[i][j].g = p1.g;
-				p_bitmap->pixels[i][j].b = p1.b;
-			}
-			p1 = p2;
-			continue;
-		}
-		for (int j = p1.x - 1; j < p2.x - 1 && j < w; ++j) {
-			p_bitmap->pixels[i][j].r = p1.r;
-			p_bitmap->pixels[i][j].g = p1.g;
-			p_bitmap->pixels[i][j].b = p1.b;
-		}
-		p1 = p2;
+	return 0;
+}
+
+/**
+ *    Read the rows [@first, @first + @count) of the compressed file located
+ * at @file_name, in any version. A negative @count reads the whole image.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int read_compressed(const char file_name[],
+                           bmp_file_header_t *p_file_header,
+                           bmp_info_header_t *p_info_header,
+                           bitmap_t *p_bitmap,
+                           int first,
+                           int count)
+{
+	compressed_reader_t reader;
+	int h;
+
+	if (open_compressed(file_name, p_file_header, p_info_header,
+	                    &reader) != 0) {
+		return 1;
+	}
+	h = reader.height;
+	if (count < 0) {
+		first = 0;
+		count = h;
+	}
+	if (first < 0 || count == 0 || first > h - count) {
+		fprintf(stderr, "Invalid range of rows\n");
+		close_compressed(&reader);
+		return 1;
+	}
+	if (initialize_bitmap(p_bitmap, reader.width, count) != 0) {
+		fprintf(stderr, "Error while initializing the bitmap");
+		close_compressed(&reader);
+		return 1;
 	}
-	for (int j = p1.x - 1; j < w; ++j) {
-		p_bitmap->pixels[p1.y - 1][j].r = p1.r;
-		p_bitmap->pixels[p1.y - 1][j].g = p1.g;
-		p_bitmap->pixels[p1.y - 1][j].b = p1.b;
+	if (decode_compressed_rows(&reader, p_bitmap, first) != 0) {
+		clear_bitmap(p_bitmap);
+		close_compressed(&reader);
+		return 1;
 	}
 
-	fclose(p_file);
+	close_compressed(&reader);
 	return 0;
 }
 
+int read_compressed_bmp(const char file_name[],
+                        bmp_file_header_t *p_file_header,
+                        bmp_info_header_t *p_info_header,
+                        bitmap_t *p_bitmap)
+{
+	return read_compressed(file_name, p_file_header, p_info_header,
+	                       p_bitmap, 0, -1);
+}
 
+int read_compressed_bmp_rows(const char file_name[],
+                             bmp_file_header_t *p_file_header,
+                             bmp_info_header_t *p_info_header,
+                             bitmap_t *p_bitmap,
+                             int first,
+                             int count)
+{
+	if (count <= 0) {
+		fprintf(stderr, "Invalid range of rows\n");
+		return 1;
+	}
+	return read_compressed(file_name, p_file_header, p_info_header,
+	                       p_bitmap, first, count);
+}
 
-int write_compressed_bmp(const char file_name[],
-                         const bmp_file_header_t *p_file_header,
-                         const bmp_info_header_t *p_info_header,
-                         const bitmap_t *p_bitmap)
+int convert_compressed_bmp(const char compressed_file_name[],
+                           const char file_name[])
 {
-	FILE *p_file;
-	int w, h, e;
+	bmp_file_header_t file_header;
+	bmp_info_header_t info_header;
+	compressed_reader_t reader;
+	writer_t writer;
+	bitmap_t chunk;
+	int w, h, padding, chunk_rows, e;
 
-	p_file = fopen(file_name, "wb");
-	if (p_file == NULL) {
-		fprintf(stderr, "Can't open file %s\n", file_name);
-		fclose(p_file);
+	if (open_compressed(compressed_file_name, &file_header, &info_header,
+	                    &reader) != 0) {
 		return 1;
 	}
+	w = reader.width;
+	h = reader.height;
+	padding = bmp_row_padding(w);
 
-	/* Write File Header */
-	e = fwrite(p_file_header, sizeof(bmp_file_header_t), 1, p_file);
-	if (e != 1) {
-		fprintf(stderr, "Error while writing the File Header\n");
-		fclose(p_file);
+	/* The chunks of a v2 file are made of whole blocks, one per thread */
+	if (reader.version == COMPRESSED_V2) {
+		chunk_rows = reader.job.block_rows * threadpool_threads();
+	} else {
+		chunk_rows = band_rows((size_t)w * sizeof(pixel_t));
+	}
+	if (chunk_rows > h) chunk_rows = h;
+	if (initialize_bitmap(&chunk, w, chunk_rows) != 0) {
+		fprintf(stderr, "Error while initializing the bitmap");
+		close_compressed(&reader);
+		return 1;
+	}
+	if (open_writer(&writer, file_name) != 0) {
+		clear_bitmap(&chunk);
+		close_compressed(&reader);
 		return 1;
 	}
+	e = write_bmp_headers(&writer, &file_header, &info_header);
 
-	/* Write Info Header */
-	e = fwrite(p_info_header, sizeof(bmp_info_header_t), 1, p_file);
-	if (e != 1) {
-		fprintf(stderr, "Error while writing the Info Header\n");
-		fclose(p_file);
+	/* The last row of the image is the first row of the file */
+	for (int first = (h - 1) / chunk_rows * chunk_rows;
+	     first >= 0 && e == 0; first -= chunk_rows) {
+		bitmap_t rows = chunk;
+		rows.height = h - first < chunk_rows ? h - first : chunk_rows;
+		e = decode_compressed_rows(&reader, &rows, first);
+		for (int i = rows.height - 1; i >= 0 && e == 0; --i) {
+			if (writer_put(&writer, bitmap_row(&rows, i),
+			               w * sizeof(pixel_t)) != 0
+			    || writer_put_zeros(&writer, padding) != 0) {
+				fprintf(stderr, "Error while writing line %d\n",
+					first + i);
+				e = 1;
+			}
+		}
+	}
+
+	clear_bitmap(&chunk);
+	close_compressed(&reader);
+	if (e != 0) {
+		close_writer(&writer);
 		return 1;
 	}
+	return close_writer(&writer);
+}
 
-	/* Write to offset */
-	while (ftell(p_file) < (long)p_file_header->offset) {
-		e = fputc(0, p_file);
-		if (e != 0) {
-			fprintf(stderr, "Error while writing to offset\n");
-			fclose(p_file);
+/**
+ *    Write the points of the row @i of @p_bitmap whose bits are set in
+ * @boundary.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int write_boundary_row(writer_t *p_writer, const bitmap_t *p_bitmap,
+                              int i, const uint64_t *boundary)
+{
+	const pixel_t *row = bitmap_row(p_bitmap, i);
+	int words = (p_bitmap->width + 63) / 64;
+
+	for (int k = 0; k < words; ++k) {
+		uint64_t bits = boundary[k];
+		size_t size = __builtin_popcountll(bits)
+			* sizeof(compressed_point_t);
+		if (bits == 0) continue;
+
+		uint8_t *out = writer_reserve(p_writer, size);
+		if (out == NULL) {
+			fprintf(stderr, "Error writing\n");
 			return 1;
 		}
+		for (; bits != 0; bits &= bits - 1) {
+			int j = k * 64 + __builtin_ctzll(bits);
+			compressed_point_t pt;
+			pt.y = i + 1;
+			pt.x = j + 1;
+			pt.r = row[j].r;
+			pt.g = row[j].g;
+			pt.b = row[j].b;
+			memcpy(out, &pt, sizeof(pt));
+			out += sizeof(pt);
+		}
+		writer_commit(p_writer, size);
 	}
+	return 0;
+}
 
-	/* Write the compressed data */
-	w = p_info_header->width;
-	h = p_info_header->height;
+/**
+ *    Write the v1 points of @p_bitmap, taken from @boundary when it is not
+ * NULL (with rows of @row_words words) or searched row by row otherwise.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int write_points(writer_t *p_writer, const bitmap_t *p_bitmap,
+                        const uint64_t *boundary, int row_words)
+{
+	int w = p_bitmap->width;
+	int h = p_bitmap->height;
+	uint64_t *bits = NULL;
+	int e = 0;
 
-	for (int i = 0; i < h; ++i) {
-		for (int j = 0; j < w; ++j) {
-			if (i == 0 || i == h - 1 || j == 0 || j == w - 1 ||
-			    (i > 0 && !is_similar(p_bitmap->pixels[i][j],
-			    p_bitmap->pixels[i - 1][j], 0)) ||
-			    (j > 0 && !is_similar(p_bitmap->pixels[i][j],
-			    p_bitmap->pixels[i][j - 1], 0)) ||
-			    (i + 1 < h && !is_similar(p_bitmap->pixels[i][j],
-			    p_bitmap->pixels[i + 1][j], 0)) ||
-			    (j + 1 < w && !is_similar(p_bitmap->pixels[i][j],
-			    p_bitmap->pixels[i][j + 1], 0)))
-			{
-				compressed_point_t pt;
-				pt.y = i + 1;
-				pt.x = j + 1;
-				pt.r = p_bitmap->pixels[i][j].r;
-				pt.g = p_bitmap->pixels[i][j].g;
-				pt.b = p_bitmap->pixels[i][j].b;
-				if (fwrite(&pt, sizeof(pt), 1, p_file) != 1) {
-					fprintf(stderr, "Error writing\n");
-					fclose(p_file);
-					return 1;
-				}
+	if (boundary == NULL) {
+		bits = malloc((w + 63) / 64 * sizeof(uint64_t));
+		if (bits == NULL) {
+			fprintf(stderr, "Error allocating the boundary\n");
+			return 1;
+		}
+	}
+	for (int i = 0; i < h && e == 0; ++i) {
+		if (boundary != NULL) {
+			e = write_boundary_row(p_writer, p_bitmap, i,
+				boundary + (size_t)i * row_words);
+			continue;
+		}
+		const pixel_t *rows[3] = {
+			i > 0 ? bitmap_row(p_bitmap, i - 1) : NULL,
+			bitmap_row(p_bitmap, i),
+			i + 1 < h ? bitmap_row(p_bitmap, i + 1) : NULL};
+		boundary_row(bits, rows, w);
+		e = write_boundary_row(p_writer, p_bitmap, i, bits);
+	}
+	free(bits);
+
+	return e;
+}
+
+/*   State of the encoding of a v2 file   */
+typedef struct {
+	const bitmap_t *p_bitmap;
+	const uint64_t *boundary;
+	int row_words;
+	int block_rows;
+	int encoding;
+	uint64_t *offsets;
+	uint8_t *data;
+	uint64_t *sizes;
+	rans_table_t *p_table;
+	uint64_t *coded_offsets;
+	uint8_t *coded;
+	uint64_t *coded_sizes;
+} encode_job_t;
+
+/**
+ *    Get the largest number of bytes of a row with the @words words of
+ * boundary @bits, stored with @encoding (COMPRESSED_RUNS or
+ * COMPRESSED_COMPACT).
+ */
+static size_t row_bound(const uint64_t *bits, int words, int encoding)
+{
+	size_t n = 0;
+
+	for (int k = 0; k < words; ++k) n += __builtin_popcountll(bits[k]);
+	if (encoding == COMPRESSED_RUNS) {
+		return sizeof(uint16_t) + n * sizeof(compressed_run_t);
+	}
+
+	/* The varints are shorter than 2^21, at most 3 bytes */
+	return 3 + n * 6;
+}
+
+/**
+ *    Store at @out the runs of @row, one for every bit of @bits.
+ *    @return the end of the stored bytes;
+ */
+static uint8_t *encode_runs_row(uint8_t *out, const pixel_t *row,
+                                const uint64_t *bits, int words)
+{
+	uint8_t *count_at = out;
+	uint16_t n = 0;
+
+	out += sizeof(n);
+	for (int k = 0; k < words; ++k) {
+		for (uint64_t b = bits[k]; b != 0; b &= b - 1) {
+			int j = k * 64 + __builtin_ctzll(b);
+			compressed_run_t run;
+			run.x = j + 1;
+			run.r = row[j].r;
+			run.g = row[j].g;
+			run.b = row[j].b;
+			memcpy(out, &run, sizeof(run));
+			out += sizeof(run);
+			++n;
+		}
+	}
+	memcpy(count_at, &n, sizeof(n));
+	return out;
+}
+
+/**
+ *    Store @value at @out as a varint.
+ *    @return the end of the stored bytes;
+ */
+static inline uint8_t *put_varint(uint8_t *out, uint32_t value)
+{
+	while (value >= 0x80) {
+		*out++ = value | 0x80;
+		value >>= 7;
+	}
+	*out++ = value;
+	return out;
+}
+
+/**
+ *    Store at @out the points of @row, one for every bit of @bits, with
+ * COMPRESSED_COMPACT. @above is the row above, or NULL at the start of a
+ * block, and @p_previous the color of the previous point of the block.
+ *    @return the end of the stored bytes;
+ */
+static uint8_t *encode_compact_row(uint8_t *out, const pixel_t *row,
+                                   const pixel_t *above,
+                                   const uint64_t *bits, int words,
+                                   pixel_t *p_previous)
+{
+	const pixel_t black = {0, 0, 0};
+	uint32_t n = 0;
+	int last = -1;
+
+	for (int k = 0; k < words; ++k) n += __builtin_popcountll(bits[k]);
+	out = put_varint(out, n);
+	for (int k = 0; k < words; ++k) {
+		for (uint64_t b = bits[k]; b != 0; b &= b - 1) {
+			int j = k * 64 + __builtin_ctzll(b);
+			uint32_t origin = COMPRESSED_NEW_COLOR;
+			if (same_color(&row[j], p_previous)) {
+				origin = COMPRESSED_PREVIOUS_COLOR;
+			} else if (same_color(&row[j], above != NULL
+			                               ? &above[j] : &black)) {
+				origin = COMPRESSED_ABOVE_COLOR;
 			}
+			out = put_varint(out, (uint32_t)(j - last - 1) << 2
+			                      | origin);
+			if (origin == COMPRESSED_NEW_COLOR) {
+				*out++ = row[j].r;
+				*out++ = row[j].g;
+				*out++ = row[j].b;
+			}
+			*p_previous = row[j];
+			last = j;
 		}
 	}
+	return out;
+}
 
-	fclose(p_file);
+/**
+ *    Encode the blocks [@begin, @end) at their offsets, storing their sizes.
+ */
+static void encode_blocks(void *arg, int begin, int end)
+{
+	encode_job_t *job = arg;
+	int h = job->p_bitmap->height;
+
+	for (int k = begin; k < end; ++k) {
+		uint8_t *out = job->data + job->offsets[k];
+		pixel_t previous = {0, 0, 0};
+		int first = k * job->block_rows;
+		int last = (k + 1) * job->block_rows < h
+			? (k + 1) * job->block_rows : h;
+		for (int i = first; i < last; ++i) {
+			const pixel_t *row = bitmap_row(job->p_bitmap, i);
+			const uint64_t *bits = job->boundary
+				+ (size_t)i * job->row_words;
+			if (job->encoding == COMPRESSED_RUNS) {
+				out = encode_runs_row(out, row, bits,
+				                      job->row_words);
+				continue;
+			}
+			out = encode_compact_row(out, row, i > first
+				? bitmap_row(job->p_bitmap, i - 1) : NULL,
+				bits, job->row_words, &previous);
+		}
+		job->sizes[k] = out - (job->data + job->offsets[k]);
+	}
+}
+
+/**
+ *    Code the encoded blocks [@begin, @end) with the entropy coder, into their
+ * slots of @coded.
+ */
+static void code_blocks(void *arg, int begin, int end)
+{
+	encode_job_t *job = arg;
+
+	for (int k = begin; k < end; ++k) {
+		uint8_t *out = job->coded + job->coded_offsets[k];
+		size_t capacity = job->coded_offsets[k + 1]
+			- job->coded_offsets[k];
+		uint32_t size = job->sizes[k];
+		size_t n = rans_encode(out, capacity,
+		                       job->data + job->offsets[k], size,
+		                       job->p_table);
+
+		/* The code is stored at the end of the slot, move it */
+		memmove(out + sizeof(size), out + capacity - n, n);
+		memcpy(out, &size, sizeof(size));
+		job->coded_sizes[k] = sizeof(size) + n;
+	}
+}
+
+/**
+ *    Build the model of the entropy coder from the encoded blocks of @job,
+ * storing its frequencies in @freq, and code the blocks in the coded members
+ * of @job.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int code_encoded_blocks(encode_job_t *job, int block_count,
+                               uint16_t freq[RANS_SYMBOLS])
+{
+	uint64_t counts[RANS_SYMBOLS] = {0};
+	uint64_t *coded_offsets;
+
+	for (int k = 0; k < block_count; ++k) {
+		const uint8_t *p = job->data + job->offsets[k];
+		for (uint64_t i = 0; i < job->sizes[k]; ++i) ++counts[p[i]];
+	}
+	if (rans_normalize(freq, counts) != 0) return 1;
+
+	job->p_table = malloc(sizeof(rans_table_t));
+	job->coded_offsets = coded_offsets
+		= malloc(((size_t)block_count + 1) * sizeof(uint64_t));
+	job->coded_sizes = malloc((size_t)block_count * sizeof(uint64_t));
+	if (job->p_table == NULL || coded_offsets == NULL
+	    || job->coded_sizes == NULL) {
+		fprintf(stderr, "Error allocating the entropy coder\n");
+		return 1;
+	}
+	rans_build_table(job->p_table, freq);
+	coded_offsets[0] = 0;
+	for (int k = 0; k < block_count; ++k) {
+		coded_offsets[k + 1] = coded_offsets[k] + sizeof(uint32_t)
+			+ rans_bound(job->sizes[k]);
+	}
+	job->coded = malloc(coded_offsets[block_count]);
+	if (job->coded == NULL) {
+		fprintf(stderr, "Error allocating the coded blocks\n");
+		return 1;
+	}
+	parallel_rows(block_count, 1, code_blocks, job);
 	return 0;
 }
 
+/**
+ *    Write the v2 container of @p_bitmap with @encoding, whose boundary is
+ * @boundary (with rows of @row_words words) or is searched first when it is
+ * NULL. The largest size of every block is known from the boundary, so the
+ * blocks are encoded in parallel, in place, and then written one after the
+ * other.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int write_blocks(writer_t *p_writer, const bitmap_t *p_bitmap,
+                        const uint64_t *boundary, int row_words,
+                        int encoding)
+{
+	int w = p_bitmap->width;
+	int h = p_bitmap->height;
+	compressed_header_t header;
+	encode_job_t job = {0};
+	uint16_t freq[RANS_SYMBOLS];
+	uint64_t *bits = NULL, *offsets, *index = NULL;
+	const uint8_t *data;
+	const uint64_t *sizes;
+	int e = 0;
+
+	if (boundary == NULL) {
+		row_words = (w + 63) / 64;
+		bits = malloc((size_t)h * row_words * sizeof(uint64_t));
+		if (bits == NULL) {
+			fprintf(stderr, "Error allocating the boundary\n");
+			return 1;
+		}
+		for (int i = 0; i < h; ++i) {
+			const pixel_t *rows[3] = {
+				i > 0 ? bitmap_row(p_bitmap, i - 1) : NULL,
+				bitmap_row(p_bitmap, i),
+				i + 1 < h ? bitmap_row(p_bitmap, i + 1) : NULL};
+			boundary_row(bits + (size_t)i * row_words, rows, w);
+		}
+		boundary = bits;
+	}
+
+	memcpy(header.magic, COMPRESSED_MAGIC, sizeof(header.magic));
+	header.version = COMPRESSED_V2;
+	header.encoding = encoding;
+	header.block_rows = COMPRESSED_BLOCK_ROWS;
+	header.block_count = (h + COMPRESSED_BLOCK_ROWS - 1)
+		/ COMPRESSED_BLOCK_ROWS;
+
+	/* Give every block its largest size */
+	job.offsets = offsets
+		= malloc(((size_t)header.block_count + 1) * sizeof(uint64_t));
+	job.sizes = malloc((size_t)header.block_count * sizeof(uint64_t));
+	index = malloc(((size_t)header.block_count + 1) * sizeof(uint64_t));
+	if (offsets == NULL || job.sizes == NULL || index == NULL) {
+		fprintf(stderr, "Error allocating the index\n");
+		e = 1;
+		goto exit;
+	}
+	offsets[0] = 0;
+	for (uint32_t k = 0; k < header.block_count; ++k) {
+		offsets[k + 1] = offsets[k];
+		for (int i = k * COMPRESSED_BLOCK_ROWS;
+		     i < (int)(k + 1) * COMPRESSED_BLOCK_ROWS && i < h; ++i) {
+			offsets[k + 1] += row_bound(
+				boundary + (size_t)i * row_words, row_words,
+				encoding == COMPRESSED_RUNS
+				? COMPRESSED_RUNS : COMPRESSED_COMPACT);
+		}
+	}
+
+	job.p_bitmap = p_bitmap;
+	job.boundary = boundary;
+	job.row_words = row_words;
+	job.block_rows = COMPRESSED_BLOCK_ROWS;
+	job.encoding = encoding;
+	job.data = malloc(offsets[header.block_count]);
+	if (job.data == NULL) {
+		fprintf(stderr, "Error allocating the blocks\n");
+		e = 1;
+		goto exit;
+	}
+	parallel_rows(header.block_count, 1, encode_blocks, &job);
+	data = job.data;
+	sizes = job.sizes;
+
+	/* Keep the entropy coded blocks only when they are smaller */
+	if (encoding == COMPRESSED_COMPACT_RANS) {
+		uint64_t encoded_size = 0, coded_size = sizeof(freq);
+		if (code_encoded_blocks(&job, header.block_count, freq) != 0) {
+			e = 1;
+			goto exit;
+		}
+		for (uint32_t k = 0; k < header.block_count; ++k) {
+			encoded_size += job.sizes[k];
+			coded_size += job.coded_sizes[k];
+		}
+		if (coded_size < encoded_size) {
+			data = job.coded;
+			offsets = job.coded_offsets;
+			sizes = job.coded_sizes;
+		} else {
+			header.encoding = COMPRESSED_COMPACT;
+		}
+	}
+
+	index[0] = 0;
+	for (uint32_t k = 0; k < header.block_count; ++k) {
+		index[k + 1] = index[k] + sizes[k];
+	}
+	e = writer_put(p_writer, &header, sizeof(header));
+	if (e == 0 && header.encoding == COMPRESSED_COMPACT_RANS) {
+		e = writer_put(p_writer, freq, sizeof(freq));
+	}
+	if (e == 0) {
+		e = writer_put(p_writer, index, ((size_t)header.block_count + 1)
+		                                * sizeof(uint64_t));
+	}
+	for (uint32_t k = 0; k < header.block_count && e == 0; ++k) {
+		e = writer_put(p_writer, data + offsets[k], sizes[k]);
+	}
+	if (e != 0) fprintf(stderr, "Error writing\n");
+
+exit:
+	free(job.coded);
+	free(job.coded_offsets);
+	free(job.coded_sizes);
+	free(job.p_table);
+	free(job.data);
+	free(job.offsets);
+	free(job.sizes);
+	free(index);
+	free(bits);
+	return e;
+}
+
+/**
+ *    Write the compressed file of @p_bitmap in the format @version, with
+ * @encoding for v2. The points are taken from @p_workspace when it holds the
+ * boundary of @p_bitmap, or searched otherwise.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int write_compressed(const char file_name[],
+                            const bmp_file_header_t *p_file_header,
+                            const bmp_info_header_t *p_info_header,
+                            const bitmap_t *p_bitmap,
+                            const compress_workspace_t *p_workspace,
+                            int version,
+                            int encoding)
+{
+	writer_t writer;
+	const uint64_t *boundary = NULL;
+	int row_words = 0;
+	int w, h, e = 0;
+
+	w = p_info_header->width;
+	h = p_info_header->height;
+	if (p_bitmap->width != w || p_bitmap->height != h
+	    || (version != COMPRESSED_V1 && version != COMPRESSED_V2)
+	    || encoding < COMPRESSED_RUNS
+	    || encoding > COMPRESSED_COMPACT_RANS) {
+		fprintf(stderr, "Invalid arguments");
+		return 1;
+	}
+	if (p_workspace != NULL && p_workspace->boundary_width == w
+	    && p_workspace->boundary_height == h
+	    && p_workspace->boundary_compression == p_bitmap->compression
+	    && p_bitmap->compression != 0) {
+		boundary = p_workspace->boundary;
+		row_words = p_workspace->row_words;
+	}
+
+	if (open_writer(&writer, file_name) != 0) return 1;
+	e = write_bmp_headers(&writer, p_file_header, p_info_header);
+
+	/* Write the compressed data */
+	if (e == 0 && version == COMPRESSED_V2) {
+		e = write_blocks(&writer, p_bitmap, boundary, row_words,
+		                 encoding);
+	} else if (e == 0) {
+		e = write_points(&writer, p_bitmap, boundary, row_words);
+	}
+
+	if (e != 0) {
+		close_writer(&writer);
+		return 1;
+	}
+	return close_writer(&writer);
+}
+
+int write_compressed_bmp(const char file_name[],
+                         const bmp_file_header_t *p_file_header,
+                         const bmp_info_header_t *p_info_header,
+                         const bitmap_t *p_bitmap)
+{
+	return write_compressed(file_name, p_file_header, p_info_header,
+	                        p_bitmap, NULL, COMPRESSED_V1, COMPRESSED_RUNS);
+}
+
+int write_compressed_bmp_boundary(const char file_name[],
+                                  const bmp_file_header_t *p_file_header,
+                                  const bmp_info_header_t *p_info_header,
+                                  const bitmap_t *p_bitmap,
+                                  const compress_workspace_t *p_workspace,
+                                  int version,
+                                  int encoding)
+{
+	return write_compressed(file_name, p_file_header, p_info_header,
+	                        p_bitmap, p_workspace, version, encoding);
+}
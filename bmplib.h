@@ -1,7 +1,48 @@
 #ifndef BMPLIB_H
 #define BMPLIB_H
 
+#include <stddef.h>
+
 #include "bmpheaders.h"
+#include "stack.h"
+
+/*   Alignment (in bytes) of the pixel buffer and of every row of a bitmap   */
+#define BITMAP_ROW_ALIGNMENT 64
+
+/*   Minimum number of rows of the bands of a parallel compression   */
+#define COMPRESS_BAND_MIN_ROWS 16
+
+/*   Largest side of the kernels of convolve_bitmap and convolve_plane   */
+#define CONVOLUTION_MAX_SIZE 15
+
+/*   Largest radius of the boxes of the blurs   */
+#define BLUR_MAX_RADIUS 4095
+
+/*   Number of box blurs approximating a Gaussian blur   */
+#define GAUSSIAN_BOX_PASSES 3
+
+/*   Number of planes of a planar image, one per channel of a pixel   */
+#define PLANAR_CHANNELS 3
+
+/*   Versions of the compressed files   */
+#define COMPRESSED_V1 1
+#define COMPRESSED_V2 2
+
+/*   Magic of the v2 compressed files, at the offset of the data   */
+#define COMPRESSED_MAGIC "PC3C"
+
+/*   Number of rows of the blocks of a v2 compressed file   */
+#define COMPRESSED_BLOCK_ROWS 64
+
+/*   Encodings of the rows of a v2 compressed file   */
+#define COMPRESSED_RUNS 0
+#define COMPRESSED_COMPACT 1
+#define COMPRESSED_COMPACT_RANS 2
+
+/*   Origin of the color of a point with COMPRESSED_COMPACT   */
+#define COMPRESSED_NEW_COLOR 0
+#define COMPRESSED_PREVIOUS_COLOR 1
+#define COMPRESSED_ABOVE_COLOR 2
 
 /*   Structures declarations   */
 #pragma pack(1)
@@ -23,13 +64,178 @@ typedef struct {
 	uint8_t b;
 } compressed_point_t;
 
+/**
+ *    A v1 compressed file is the array of the compressed_point_t of the
+ * boundary, in row order, at the offset of the file header. A v2 compressed
+ * file has instead, at the same offset:
+ *    - a compressed_header_t;
+ *    - the index: block_count + 1 uint64_t offsets of the blocks, relative to
+ * the end of the index, the last one being the end of the data;
+ *    - the blocks of block_rows rows (the last one may be shorter), whose rows
+ * are encoded independently. With COMPRESSED_RUNS, a row is its uint16_t
+ * number of points followed by their compressed_run_t.
+ *    With COMPRESSED_COMPACT, the numbers are varints (7 bits per byte, the
+ * lowest first) and a row is its number of points followed, for every point,
+ * by the varint dx << 2 | origin: dx is the number of columns skipped since
+ * the previous point of the row and origin tells where the color comes from.
+ * COMPRESSED_NEW_COLOR is followed by the r, g, b bytes of the color, while
+ * COMPRESSED_PREVIOUS_COLOR and COMPRESSED_ABOVE_COLOR reuse the color of the
+ * previous point of the block or of the decoded pixel above. Both are black at
+ * the start of a block.
+ *    With COMPRESSED_COMPACT_RANS, the header is followed by the uint16_t
+ * frequencies of the 256 byte values (see rans.h) and every block is its
+ * uint32_t number of COMPRESSED_COMPACT bytes followed by their rANS code.
+ */
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t encoding;
+	uint32_t block_rows;
+	uint32_t block_count;
+} compressed_header_t;
+
+typedef struct {
+	uint16_t x;
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+} compressed_run_t;
+
 #pragma pack()
 
+/**
+ *    The pixels of a bitmap are stored in a single contiguous buffer, row after
+ * row. @stride is the distance in bytes between the start of two consecutive
+ * rows and is padded to BITMAP_ROW_ALIGNMENT. @data points to the first pixel
+ * of row 0, while @buffer is the allocation owned by the bitmap, of
+ * @capacity bytes.
+ *    A bitmap can also be a view of a memory mapped bmp file, in which case
+ * @buffer is the mapping, @mapped_size its length and @stride is negative,
+ * because the rows of a bmp file are stored bottom-up. The pixels of the view
+ * can be written, which only changes the private copy of the mapping.
+ *    @compression identifies the compression that wrote the pixels, 0 when
+ * they were written by anything else.
+ */
 typedef struct {
 	int width, height;
-	pixel_t **pixels;
+	int stride;
+	uint8_t *data;
+	void *buffer;
+	size_t mapped_size;
+	size_t capacity;
+	uint64_t compression;
 } bitmap_t;
 
+/**
+ *    A single channel image, with one byte per pixel, used for the gray values
+ * of a bitmap. It has the same layout as a bitmap_t.
+ */
+typedef struct {
+	int width, height;
+	int stride;
+	uint8_t *data;
+	void *buffer;
+	size_t capacity;
+} plane_t;
+
+/**
+ *    An image stored as one plane per channel: @channels[0], @channels[1] and
+ * @channels[2] hold the b, g and r bytes of the pixels, so that the kernels
+ * working on a channel read contiguous and aligned rows. All the planes have
+ * the @width and @height of the image.
+ */
+typedef struct {
+	int width, height;
+	plane_t channels[PLANAR_CHANNELS];
+} planar_t;
+
+/**
+ *    A square convolution kernel of @size x @size @weights, stored row by row,
+ * @size being odd and at most CONVOLUTION_MAX_SIZE. The result of a pixel is
+ * the sum of the weights times the pixels under them, the pixels outside the
+ * image counting as 0, divided by @divisor and rounded to the nearest (halves
+ * upwards), then clamped to [0, MAX_PIXEL_VALUE]. With a @divisor of 1, a 3x3
+ * kernel gives the same result as filter_bitmap.
+ */
+typedef struct {
+	int size;
+	const int *weights;
+	int divisor;
+} convolution_t;
+
+/**
+ *    Counters of the last compression done with a workspace: the number of
+ * @regions filled, the @pixels_visited by the fills (the pixels of every run
+ * filled and of the rows scanned above and below it), the largest number of
+ * seeds waiting on a stack and the number of pixels of the boundary, which
+ * are the points write_compressed_bmp_boundary stores.
+ */
+typedef struct {
+	uint64_t regions;
+	uint64_t pixels_visited;
+	uint64_t max_stack_depth;
+	uint64_t boundary_points;
+} compress_stats_t;
+
+/**
+ *    The temporary data of compress_bitmap, which can be kept between calls
+ * (and between images) so that the compression doesn't allocate anything once
+ * the workspace is large enough. @visited has one bit per pixel, with rows of
+ * @row_words words, and @stack is shared by all the regions. @labels is only
+ * used by the parallel compression.
+ *    The compression also leaves in @boundary, with the layout of @visited,
+ * the pixels that write_compressed_bmp stores for its result. They are valid
+ * for the @boundary_width x @boundary_height bitmap written by the
+ * compression @boundary_compression, all 0 when there is none.
+ * The counters of the compression are left in @stats.
+ *    When @tiled is set, the compression looks for the seeds of the regions
+ * tile by tile (see tile_columns and TILE_ROWS) instead of in raster order,
+ * so that the small regions of a wide image are filled while their rows are
+ * in the cache. The regions may then differ from the raster order ones, since
+ * their first pixel gives their color, and the compression runs on a single
+ * thread.
+ */
+typedef struct {
+	uint64_t *visited;
+	uint64_t *boundary;
+	size_t visited_capacity;
+	int row_words;
+	int boundary_width, boundary_height;
+	uint64_t boundary_compression;
+	stack_t stack;
+	uint32_t *labels;
+	size_t labels_capacity;
+	compress_stats_t stats;
+	int tiled;
+} compress_workspace_t;
+
+/*   Inline accessors   */
+/**
+ *    Get the address of the first pixel of row @i of @p_bitmap.
+ */
+static inline pixel_t *bitmap_row(const bitmap_t *p_bitmap, int i)
+{
+	return (pixel_t *)(p_bitmap->data + (ptrdiff_t)i * p_bitmap->stride);
+}
+
+/**
+ *    Get the address of the first pixel of row @i of @p_plane.
+ */
+static inline uint8_t *plane_row(const plane_t *p_plane, int i)
+{
+	return p_plane->data + (ptrdiff_t)i * p_plane->stride;
+}
+
+/**
+ *    Get the number of padding bytes at the end of each row of a bmp file
+ * with the given @width. The row size is computed in size_t, so that a
+ * corrupt width can't overflow.
+ */
+static inline int bmp_row_padding(int width)
+{
+	return (4 - (size_t)width * sizeof(pixel_t) % 4) % 4;
+}
+
 /*   Functions declarations   */
 /**
  *    Allocate the memory for the pixel array of a bitmap, assigning the
@@ -41,11 +247,94 @@ int initialize_bitmap(bitmap_t *p_bitmap,
                       int height);
 
 /**
- *    Deallocate the bitmap.
+ *    Make @p_bitmap a @width x @height bitmap, keeping its buffer when the
+ * new rows fit in it and allocating a new one otherwise. @p_bitmap should be
+ * allocated prior to the call of this function or have a NULL buffer. The
+ * pixels are not kept.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int reserve_bitmap(bitmap_t *p_bitmap,
+                   int width,
+                   int height);
+
+/**
+ *    Build an array of pointers to the rows of @p_bitmap, for code that still
+ * uses the pixels[i][j] notation. The array must be freed by the caller, but
+ * not the rows themselves.
+ *    @return the array or NULL if the allocation failed;
+ */
+pixel_t **bitmap_row_pointers(const bitmap_t *p_bitmap);
+
+/**
+ *    Deallocate the bitmap or release its mapping.
  *    @return 0 if successful or an error code otherwise;
  */
 int clear_bitmap(bitmap_t *p_bitmap);
 
+/**
+ *    Allocate the memory for the pixel array of a plane, assigning the width
+ * and height members too.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int initialize_plane(plane_t *p_plane,
+                     int width,
+                     int height);
+
+/**
+ *    Make @p_plane a @width x @height plane, like reserve_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int reserve_plane(plane_t *p_plane,
+                  int width,
+                  int height);
+
+/**
+ *    Deallocate the plane.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int clear_plane(plane_t *p_plane);
+
+/**
+ *    Allocate the planes of a planar image, assigning the width and height
+ * members too.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int initialize_planar(planar_t *p_planar,
+                      int width,
+                      int height);
+
+/**
+ *    Make @p_planar a @width x @height planar image, like reserve_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int reserve_planar(planar_t *p_planar,
+                   int width,
+                   int height);
+
+/**
+ *    Deallocate the planes of the planar image.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int clear_planar(planar_t *p_planar);
+
+/**
+ *    Split the channels of the pixels of @p_bitmap into the planes of
+ * @p_planar. @p_planar should be allocated prior to the call of this function
+ * and should have the same width and height as @p_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int split_bitmap(planar_t *p_planar,
+                 const bitmap_t *p_bitmap);
+
+/**
+ *    Merge the planes of @p_planar into the pixels of @p_bitmap, the inverse
+ * of split_bitmap. @p_bitmap should be allocated prior to the call of this
+ * function and should have the same width and height as @p_planar.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int merge_planar(bitmap_t *p_bitmap,
+                 const planar_t *p_planar);
+
 /**
  *    Apply a grayscale effect to @p_bitmap, storing the result in
  * @p_new_bitmap. @p_new_bitmap should be allocated prior to the call of this
@@ -55,6 +344,25 @@ int clear_bitmap(bitmap_t *p_bitmap);
 int grayscale_bitmap(bitmap_t *p_new_bitmap,
                       const bitmap_t *p_bitmap);
 
+/**
+ *    Store the gray values of @p_bitmap in @p_plane, the same values
+ * grayscale_bitmap would put in each channel. @p_plane should be allocated
+ * prior to the call of this function and should have the same width and
+ * height as @p_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int grayscale_plane(plane_t *p_plane,
+                    const bitmap_t *p_bitmap);
+
+/**
+ *    Store the gray values of @p_planar in @p_plane, like grayscale_plane.
+ * @p_plane should be allocated prior to the call of this function and should
+ * have the same width and height as @p_planar.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int grayscale_planar(plane_t *p_plane,
+                     const planar_t *p_planar);
+
 /**
  *    Apply a filter to @p_bitmap, storing the result in @p_new_bitmap.
  * @p_new_bitmap should be allocated prior to the call of this function and
@@ -65,6 +373,153 @@ int filter_bitmap(bitmap_t *p_new_bitmap,
                   const bitmap_t *p_bitmap,
                   int filter[3][3]);
 
+/**
+ *    Apply a filter to @p_plane, storing the result in @p_new_plane, with the
+ * same semantics as filter_bitmap. @p_new_plane should be allocated prior to
+ * the call of this function and should have the same width and height as
+ * @p_plane.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int filter_plane(plane_t *p_new_plane,
+                 const plane_t *p_plane,
+                 int filter[3][3]);
+
+/**
+ *    Apply a filter to every channel of @p_planar, storing the result in
+ * @p_new_planar, with the same semantics as filter_bitmap. @p_new_planar
+ * should be allocated prior to the call of this function and should have the
+ * same width and height as @p_planar.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int filter_planar(planar_t *p_new_planar,
+                  const planar_t *p_planar,
+                  int filter[3][3]);
+
+/**
+ *    Apply @count filters to @p_bitmap in a single pass, storing the result
+ * of @filters[k] in @p_new_bitmaps[k]. Every new bitmap should be allocated
+ * prior to the call of this function and should have the same width and
+ * height as @p_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int filter_bitmap_multi(bitmap_t *p_new_bitmaps[],
+                        const bitmap_t *p_bitmap,
+                        int filters[][3][3],
+                        int count);
+
+/**
+ *    Apply @count filters to @p_plane in a single pass, like
+ * filter_bitmap_multi.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int filter_plane_multi(plane_t *p_new_planes[],
+                       const plane_t *p_plane,
+                       int filters[][3][3],
+                       int count);
+
+/**
+ *    Apply the grayscale effect and @count filters to the bmp file located at
+ * @file_name without loading it: its rows are read in the order of the file,
+ * converted to gray values and filtered in chunks, and every chunk is written
+ * at once, like write_plane_bmp would, to @gray_file_name and, for the result
+ * of @filters[k] on the gray values, to @filter_file_names[k]. The memory
+ * used only depends on the width of the image.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int filter_bmp_stream(const char file_name[],
+                      const char gray_file_name[],
+                      const char *filter_file_names[],
+                      int filters[][3][3],
+                      int count);
+
+/**
+ *    Get one of the predefined convolutions by its @name: "blur5", "blur7"
+ * (box blurs), "gaussian5", "gaussian7" (binomial blurs), "sharpen5",
+ * "sharpen7" (unsharp masks of the binomial blurs), "edge5" and "edge7"
+ * (Laplacian of the box).
+ *    @return the convolution, or NULL when there is none with this name;
+ */
+const convolution_t *find_convolution(const char name[]);
+
+/**
+ *    Apply @p_convolution to @p_bitmap, every channel on its own, storing
+ * the result in @p_new_bitmap. Separable kernels are applied as a horizontal
+ * then a vertical pass, so their cost grows with the size of the kernel
+ * instead of its area. @p_new_bitmap should be allocated prior to the call of
+ * this function and should have the same width and height as @p_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int convolve_bitmap(bitmap_t *p_new_bitmap,
+                    const bitmap_t *p_bitmap,
+                    const convolution_t *p_convolution);
+
+/**
+ *    Apply @p_convolution to @p_plane, storing the result in @p_new_plane,
+ * like convolve_bitmap. @p_new_plane should be allocated prior to the call
+ * of this function and should have the same width and height as @p_plane.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int convolve_plane(plane_t *p_new_plane,
+                   const plane_t *p_plane,
+                   const convolution_t *p_convolution);
+
+/**
+ *    Blur @p_bitmap with a box of 2 * @radius + 1 pixels by 2 * @radius + 1
+ * pixels, storing the result in @p_new_bitmap, which may be @p_bitmap itself.
+ * Every channel is averaged over the pixels of the box inside the image, row
+ * by row then column by column, rounding to the nearest after each pass. The
+ * sums of the box slide along the rows and the columns, so a pixel costs the
+ * same whatever @radius, which must be at most BLUR_MAX_RADIUS.
+ * @p_new_bitmap should be allocated prior to the call of this function and
+ * should have the same width and height as @p_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int box_blur_bitmap(bitmap_t *p_new_bitmap,
+                    const bitmap_t *p_bitmap,
+                    int radius);
+
+/**
+ *    Blur @p_plane with a box, storing the result in @p_new_plane, like
+ * box_blur_bitmap. @p_new_plane should be allocated prior to the call of
+ * this function and should have the same width and height as @p_plane.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int box_blur_plane(plane_t *p_new_plane,
+                   const plane_t *p_plane,
+                   int radius);
+
+/**
+ *    Approximate a Gaussian blur of standard deviation @sigma of @p_bitmap
+ * with GAUSSIAN_BOX_PASSES box blurs, whose radii are chosen so that their
+ * variances add up to the one of the Gaussian. The result is stored in
+ * @p_new_bitmap like box_blur_bitmap, at the same cost whatever @sigma.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int gaussian_blur_bitmap(bitmap_t *p_new_bitmap,
+                         const bitmap_t *p_bitmap,
+                         double sigma);
+
+/**
+ *    Approximate a Gaussian blur of @p_plane, storing the result in
+ * @p_new_plane, like gaussian_blur_bitmap.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int gaussian_blur_plane(plane_t *p_new_plane,
+                        const plane_t *p_plane,
+                        double sigma);
+
+/**
+ *    Initialize an empty @p_workspace, which grows on its first use.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int initialize_compress_workspace(compress_workspace_t *p_workspace);
+
+/**
+ *    Deallocate the data of @p_workspace.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int clear_compress_workspace(compress_workspace_t *p_workspace);
+
 /**
  *    Reduce the number of colors of @p_bitmap, based on @threshold, and store
  * the result in @p_new_bitmap. @p_new_bitmap should be allocated prior to the
@@ -76,6 +531,27 @@ int compress_bitmap(bitmap_t *p_new_bitmap,
                     const bitmap_t *p_bitmap,
                     int threshold);
 
+/**
+ *    Same as compress_bitmap, using the temporary data of @p_workspace.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int compress_bitmap_workspace(bitmap_t *p_new_bitmap,
+                              const bitmap_t *p_bitmap,
+                              int threshold,
+                              compress_workspace_t *p_workspace);
+
+/**
+ *    Compress @p_bitmap like compress_bitmap, using the threads of the pool:
+ * the bands of rows are filled in parallel and then merged so that the result
+ * is exactly the one of the serial algorithm. compress_bitmap calls it when
+ * the pool has more than one thread.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int compress_bitmap_parallel(bitmap_t *p_new_bitmap,
+                             const bitmap_t *p_bitmap,
+                             int threshold,
+                             compress_workspace_t *p_workspace);
+
 /**
  *    Read a bmp file located at @file_name. @p_bitmap should not be allocated
  * prior to the call of this function. If the reading is unsuccessful, the state
@@ -87,6 +563,19 @@ int read_bmp(const char file_name[],
              bmp_info_header_t *p_info_header,
              bitmap_t *p_bitmap);
 
+/**
+ *    Map a bmp file located at @file_name in memory and make @p_bitmap a view
+ * of its pixel array, without copying it (see bitmap_t). The mapping is
+ * released by clear_bitmap. If the file can't be mapped, it is read with
+ * read_bmp instead.
+ * @p_bitmap should not be allocated prior to the call of this function.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int read_bmp_mapped(const char file_name[],
+                    bmp_file_header_t *p_file_header,
+                    bmp_info_header_t *p_info_header,
+                    bitmap_t *p_bitmap);
+
 /**
  *    Write a bmp file to @file_name.
  *    @return 0 if successful or an error code otherwise;
@@ -96,10 +585,45 @@ int write_bmp(const char file_name[],
              const bmp_info_header_t *p_info_header,
              const bitmap_t *p_bitmap);
 
+/**
+ *    Read a bmp file located at @file_name into the planes of @p_planar: the
+ * file is mapped like in read_bmp_mapped and its rows are split straight into
+ * the planes, without a packed copy of the pixels. @p_planar should be
+ * allocated prior to the call of this function or have NULL buffers, and its
+ * planes are kept when the image fits in them.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int read_planar_bmp(const char file_name[],
+                    bmp_file_header_t *p_file_header,
+                    bmp_info_header_t *p_info_header,
+                    planar_t *p_planar);
+
+/**
+ *    Write @p_planar as a bmp file to @file_name, its planes being merged
+ * straight into the output buffer.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int write_planar_bmp(const char file_name[],
+                     const bmp_file_header_t *p_file_header,
+                     const bmp_info_header_t *p_info_header,
+                     const planar_t *p_planar);
+
+/**
+ *    Write the gray values of @p_plane as a bmp file to @file_name, with
+ * three equal channels for every pixel.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int write_plane_bmp(const char file_name[],
+                    const bmp_file_header_t *p_file_header,
+                    const bmp_info_header_t *p_info_header,
+                    const plane_t *p_plane);
+
 /**
  *    Read a compressed bmp file located at @file. @p_bitmap should not be
  * allocated prior to the call of this function. If the reading is unsuccessful,
  * the state of the arguments is unknown and should be deallocated.
+ *    Both versions of the format are detected, and the blocks of a v2 file
+ * are decoded in parallel.
  *    @return 0 if successful or an error code otherwise;
  */
 int read_compressed_bmp(const char file_name[],
@@ -107,6 +631,30 @@ int read_compressed_bmp(const char file_name[],
              bmp_info_header_t *p_info_header,
              bitmap_t *p_bitmap);
 
+/**
+ *    Same as read_compressed_bmp, decoding only the @count rows starting at
+ * row @first: @p_bitmap gets @count rows, the row 0 being the row @first of
+ * the image. Only the blocks holding these rows are decoded for a v2 file.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int read_compressed_bmp_rows(const char file_name[],
+             bmp_file_header_t *p_file_header,
+             bmp_info_header_t *p_info_header,
+             bitmap_t *p_bitmap,
+             int first,
+             int count);
+
+/**
+ *    Decompress the compressed file located at @compressed_file_name, in any
+ * version, to a bmp file written to @file_name. The image is never held in
+ * memory as a whole: chunks of rows are decoded from the bottom of the image
+ * up and written as soon as they are ready, since the rows of a bmp file are
+ * stored bottom-up.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int convert_compressed_bmp(const char compressed_file_name[],
+                           const char file_name[]);
+
 /**
  *    Write a bmp compressed file to @file_name.
  *    @return 0 if successful or an error code otherwise;
@@ -116,4 +664,24 @@ int write_compressed_bmp(const char file_name[],
              const bmp_info_header_t *p_info_header,
              const bitmap_t *p_bitmap);
 
+/**
+ *    Same as write_compressed_bmp, with the format @version (COMPRESSED_V1 or
+ * COMPRESSED_V2) and, for v2, the rows stored with @encoding. When @p_bitmap
+ * is the result of the last compression done with @p_workspace, the points
+ * are taken from its boundary instead of being searched again. The result is
+ * recognized by the compression field of @p_bitmap, which the functions of
+ * this library writing to a bitmap reset, so the caller must not modify its
+ * pixels in between by other means. @p_workspace can be NULL.
+ * COMPRESSED_COMPACT_RANS falls back to COMPRESSED_COMPACT when the entropy
+ * coding doesn't make the file smaller.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int write_compressed_bmp_boundary(const char file_name[],
+             const bmp_file_header_t *p_file_header,
+             const bmp_info_header_t *p_info_header,
+             const bitmap_t *p_bitmap,
+             const compress_workspace_t *p_workspace,
+             int version,
+             int encoding);
+
 #endif 
@@ -0,0 +1,219 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmplib.h"
+#include "threadpool.h"
+
+/*   Threads of the pool while checking the parallel compression   */
+#define CHECK_THREADS 4
+
+/*   Times each busy pool case is repeated, to overlap the callers   */
+#define CHECK_REPETITIONS 8
+
+/*   Side of the blocks of the test images   */
+#define BLOCK_SIDE 24
+
+#define IMAGE_COUNT 4
+
+/*   Sizes of the test images and thresholds of their compression   */
+static const int images[IMAGE_COUNT][3] = {
+	{64, 400, 30}, {300, 257, 30}, {1000, 97, 10}, {33, 1000, 60}};
+
+/*   Structures declarations   */
+/**
+ *    An image with its serial compression @expected, checked against the
+ * parallel compression stored in @result by a caller with its own
+ * @workspace. @failed counts the mismatches and the errors.
+ */
+typedef struct {
+	bitmap_t image;
+	bitmap_t expected;
+	bitmap_t result;
+	compress_workspace_t workspace;
+	int threshold;
+	int failed;
+} check_t;
+
+/*   Test images   */
+static uint32_t next_random(uint32_t *p_state)
+{
+	uint32_t x = *p_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *p_state = x;
+}
+
+/**
+ *    Fill @p_bitmap with flat blocks with a little noise, so that the regions
+ * cross the bands of the parallel compression and merge there.
+ */
+static void generate_image(bitmap_t *p_bitmap, uint32_t seed)
+{
+	uint32_t state = seed;
+
+	for (int i = 0; i < p_bitmap->height; ++i) {
+		pixel_t *row = bitmap_row(p_bitmap, i);
+		for (int j = 0; j < p_bitmap->width; ++j) {
+			uint32_t r = next_random(&state);
+			uint32_t c = (uint32_t)(i / BLOCK_SIDE) * 0x9E3779B1u
+				^ (uint32_t)(j / BLOCK_SIDE) * 0x85EBCA77u;
+			c ^= c >> 15;
+			c *= 0xC2B2AE3Du;
+			c ^= c >> 13;
+			row[j].r = (c & 0xF0) | (r & 15);
+			row[j].g = (c >> 8 & 0xF0) | (r >> 4 & 15);
+			row[j].b = (c >> 16 & 0xF0) | (r >> 8 & 15);
+		}
+	}
+}
+
+/*   Checks   */
+/**
+ *    Compress the image of @p_check in parallel and compare the result with
+ * the serial one, counting a mismatch in @p_check->failed.
+ */
+static void check_parallel(check_t *p_check)
+{
+	const bitmap_t *p_expected = &p_check->expected;
+
+	/* Don't let a previous result hide the pixels left untouched */
+	for (int i = 0; i < p_expected->height; ++i) {
+		memset(bitmap_row(&p_check->result, i), 0,
+		       p_expected->width * sizeof(pixel_t));
+	}
+	if (compress_bitmap_parallel(&p_check->result, &p_check->image,
+	                             p_check->threshold,
+	                             &p_check->workspace) != 0) {
+		++p_check->failed;
+		return;
+	}
+	for (int i = 0; i < p_expected->height; ++i) {
+		if (memcmp(bitmap_row(&p_check->result, i),
+		           bitmap_row(p_expected, i),
+		           p_expected->width * sizeof(pixel_t)) != 0) {
+			++p_check->failed;
+			return;
+		}
+	}
+}
+
+/**
+ *    Band function compressing every check of the rows [@begin, @end) from
+ * inside parallel_rows, where the pool is busy with this very call.
+ */
+static void nested_band(void *arg, int begin, int end)
+{
+	check_t *checks = arg;
+	for (int k = begin; k < end; ++k) check_parallel(&checks[k]);
+}
+
+/**
+ *    Thread compressing its check while the main thread compresses the
+ * others, so that the pool is busy with another caller.
+ */
+static void *concurrent_worker(void *arg)
+{
+	for (int r = 0; r < CHECK_REPETITIONS; ++r) check_parallel(arg);
+	return NULL;
+}
+
+/**
+ *    Prepare the images and their serial compression.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int initialize_checks(check_t checks[IMAGE_COUNT])
+{
+	memset(checks, 0, IMAGE_COUNT * sizeof(check_t));
+	for (int k = 0; k < IMAGE_COUNT; ++k) {
+		check_t *p_check = &checks[k];
+		int w = images[k][0], h = images[k][1];
+		p_check->threshold = images[k][2];
+		if (initialize_compress_workspace(&p_check->workspace) != 0
+		    || initialize_bitmap(&p_check->image, w, h) != 0
+		    || initialize_bitmap(&p_check->expected, w, h) != 0
+		    || initialize_bitmap(&p_check->result, w, h) != 0) {
+			return 1;
+		}
+		generate_image(&p_check->image, 0x9E3779B9u + k);
+		if (compress_bitmap(&p_check->expected, &p_check->image,
+		                    p_check->threshold) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void clear_checks(check_t checks[IMAGE_COUNT])
+{
+	for (int k = 0; k < IMAGE_COUNT; ++k) {
+		clear_bitmap(&checks[k].image);
+		clear_bitmap(&checks[k].expected);
+		clear_bitmap(&checks[k].result);
+		clear_compress_workspace(&checks[k].workspace);
+	}
+}
+
+/**
+ *    Report the mismatches of @checks for the case @name and reset them.
+ *    @return the number of images that failed;
+ */
+static int report(check_t checks[IMAGE_COUNT], const char *name)
+{
+	int failed = 0;
+
+	for (int k = 0; k < IMAGE_COUNT; ++k) {
+		if (checks[k].failed == 0) continue;
+		fprintf(stderr, "%s: the %dx%d image differs from the serial "
+			"compression\n", name, checks[k].image.width,
+			checks[k].image.height);
+		checks[k].failed = 0;
+		++failed;
+	}
+	printf("%s: %s\n", name, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+int main(void)
+{
+	check_t checks[IMAGE_COUNT];
+	pthread_t threads[IMAGE_COUNT];
+	int started = 1, failed = 0;
+
+	/* The expected results come from the serial raster order fill */
+	threadpool_set_threads(1);
+	if (initialize_checks(checks) != 0) {
+		fprintf(stderr, "Can't prepare the images\n");
+		clear_checks(checks);
+		return 1;
+	}
+	threadpool_set_threads(CHECK_THREADS);
+
+	/* The pool splits the rows */
+	for (int k = 0; k < IMAGE_COUNT; ++k) check_parallel(&checks[k]);
+	failed += report(checks, "parallel");
+
+	/* parallel_rows runs on the calling thread from inside a band */
+	parallel_rows(IMAGE_COUNT, 1, nested_band, checks);
+	failed += report(checks, "nested");
+
+	/* Other callers hold the pool */
+	while (started < IMAGE_COUNT
+	       && pthread_create(&threads[started], NULL, concurrent_worker,
+	                         &checks[started]) == 0) {
+		++started;
+	}
+	concurrent_worker(&checks[0]);
+	for (int k = 1; k < started; ++k) pthread_join(threads[k], NULL);
+	if (started < IMAGE_COUNT) {
+		fprintf(stderr, "Can't start the threads\n");
+		++failed;
+	}
+	failed += report(checks, "concurrent");
+
+	clear_checks(checks);
+	threadpool_shutdown();
+	return failed != 0;
+}
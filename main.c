@@ -1,8 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "bmplib.h"
 #include "stack.h"
+#include "threadpool.h"
 
 #define MAX_FILENAME 1024
 
@@ -13,10 +20,111 @@
 #define FILTER2_NAME_SUFFIX "_f2"
 #define FILTER3_NAME_SUFFIX "_f3"
 
+#define COMPRESSED_FILENAME "compressed.bin"
+#define DECOMPRESSED_FILENAME "decompressed.bmp"
+
+/*   Suffixes of the results of tasks 3 and 4 in batch mode   */
+#define COMPRESSED_NAME_SUFFIX "_compressed.bin"
+#define DECOMPRESSED_NAME_SUFFIX "_decompressed"
+
+#define FILTER_COUNT 3
+
+/*   Stages of process_image timed for the stats   */
+#define STAGE_READ 0
+#define STAGE_STREAM 1
+#define STAGE_GRAYSCALE 2
+#define STAGE_FILTER 3
+#define STAGE_WRITE 4
+#define STAGE_BLUR 5
+#define STAGE_COMPRESS 6
+#define STAGE_WRITE_COMPRESSED 7
+#define STAGE_DECOMPRESS 8
+#define STAGE_COUNT 9
+
+static const char *stage_names[STAGE_COUNT] = {
+	"read", "stream", "grayscale", "filter", "write", "blur", "compress",
+	"write_compressed", "decompress"};
+
+static int filters[FILTER_COUNT][3][3] = {
+	{{-1, -1, -1},
+	 {-1, 8, -1},
+	 {-1, -1, -1}},
+	{{0, 1, 0},
+	 {1, -4, 1},
+	 {0, 1, 0}},
+	{{1, 0, -1},
+	 {0, 0, 0},
+	 {-1, 0, 1}}};
+static const char *filter_suffixes[FILTER_COUNT] = {
+	FILTER1_NAME_SUFFIX, FILTER2_NAME_SUFFIX, FILTER3_NAME_SUFFIX};
+
+/*   Structures declarations   */
+/**
+ *    An image to process, as described by the input file: the bmp file, the
+ * threshold of its compression and the compressed file to decompress.
+ */
+typedef struct {
+	char file_name[MAX_FILENAME];
+	int threshold;
+	char compression_file_name[MAX_FILENAME];
+} image_job_t;
+
+/*   Options of the command line, see parse_options   */
+typedef struct {
+	int version;
+	int encoding;
+	int stream;
+	int tiled_fill;
+	double blur;
+	const char *manifest;
+	const char *stats_file_name;
+	FILE *p_stats_file;
+} options_t;
+
+/**
+ *    The memory used to process an image, kept from an image to the next so
+ * that a worker of the batch mode only allocates when an image is larger than
+ * all the previous ones.
+ */
+typedef struct {
+	bitmap_t tmp_bitmap;
+	bitmap_t blur_bitmap;
+	plane_t gray_plane;
+	plane_t filter_planes[FILTER_COUNT];
+	compress_workspace_t workspace;
+} image_buffers_t;
+
+/**
+ *    What process_image measured for an image: the time of every stage, the
+ * sizes of the files read and written and the counters of the compression.
+ */
+typedef struct {
+	int width, height;
+	double stage_ns[STAGE_COUNT];
+	uint64_t bytes_read, bytes_written;
+	compress_stats_t compress;
+} image_stats_t;
+
+/*   The images of a batch, shared by its workers   */
+typedef struct {
+	const image_job_t *jobs;
+	int count;
+	const options_t *p_options;
+	int next;
+	int failed;
+} batch_t;
+
 void split_file_name(char name[], char extension[], const char file_name[])
 {
-	int i, stride;
-	for (i = 0; file_name[i] != '\0' && file_name[i] != '.'; ++i) {
+	int i, stride, dot = 0;
+
+	/* The extension starts at the first dot of the last path component */
+	for (i = 0; file_name[i] != '\0'; ++i) {
+		if (file_name[i] == '/') dot = i + 1;
+	}
+	while (file_name[dot] != '\0' && file_name[dot] != '.') ++dot;
+
+	for (i = 0; i < dot; ++i) {
 		name[i] = file_name[i];
 	}
 	name[i] = '\0';
@@ -27,164 +135,635 @@ void split_file_name(char name[], char extension[], const char file_name[])
 	extension[i - stride] = '\0';
 }
 
-int main(void)
+/**
+ *    Parse the command line options into @p_options:
+ *    -j <count>, --threads <count>   number of threads used by the kernels,
+ * or number of workers in batch mode
+ *    -f <format>, --format <format>  format of the compressed file: v1 (the
+ * default) or v2
+ *    -e <encoding>, --encoding <encoding>  encoding of the rows of a v2 file:
+ * runs (the default), compact or rans; implies -f v2
+ *    -s, --stream   solve tasks 1 and 2 reading the bmp file row by row
+ *    --tile <bytes>   width in bytes of the tiles that the rows of wide
+ * images are split in, 0 to never split them
+ *    --tiled-fill   look for the regions of task 3 tile by tile, on one
+ * thread, instead of in raster order
+ *    --blur <sigma>   compress a Gaussian blur of standard deviation sigma
+ * of the image at task 3, which has far fewer regions
+ *    -b <manifest>, --batch <manifest>   process all the images listed in
+ * the manifest instead of the one of INPUT_FILENAME
+ *    --stats <file>   append a line of JSON with the stats of every image to
+ * the file, or to the standard output for "-"
+ *    @return 0 if successful or an error code otherwise;
+ */
+int parse_options(int argc, char *argv[], options_t *p_options)
 {
-	FILE *p_file;
+	const char *encodings[] = {"runs", "compact", "rans"};
 
-	char file_name[MAX_FILENAME], tmp_file_name[MAX_FILENAME];
-	char compression_file_name[MAX_FILENAME];
-	char name[MAX_FILENAME], extension[MAX_FILENAME];
+	p_options->version = COMPRESSED_V1;
+	p_options->encoding = COMPRESSED_RUNS;
+	p_options->stream = 0;
+	p_options->tiled_fill = 0;
+	p_options->blur = 0;
+	p_options->manifest = NULL;
+	p_options->stats_file_name = NULL;
+	p_options->p_stats_file = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if ((strcmp(argv[i], "-j") == 0
+		     || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+			if (threadpool_set_threads(atoi(argv[++i])) != 0) {
+				return 1;
+			}
+		} else if ((strcmp(argv[i], "-f") == 0
+		            || strcmp(argv[i], "--format") == 0)
+		           && i + 1 < argc) {
+			++i;
+			if (strcmp(argv[i], "v1") == 0) {
+				p_options->version = COMPRESSED_V1;
+			} else if (strcmp(argv[i], "v2") == 0) {
+				p_options->version = COMPRESSED_V2;
+			} else {
+				fprintf(stderr, "Unknown format %s\n", argv[i]);
+				return 1;
+			}
+		} else if ((strcmp(argv[i], "-e") == 0
+		            || strcmp(argv[i], "--encoding") == 0)
+		           && i + 1 < argc) {
+			int k = COMPRESSED_RUNS;
+			++i;
+			while (k <= COMPRESSED_COMPACT_RANS
+			       && strcmp(argv[i], encodings[k]) != 0) {
+				++k;
+			}
+			if (k > COMPRESSED_COMPACT_RANS) {
+				fprintf(stderr, "Unknown encoding %s\n",
+					argv[i]);
+				return 1;
+			}
+			p_options->version = COMPRESSED_V2;
+			p_options->encoding = k;
+		} else if (strcmp(argv[i], "-s") == 0
+		           || strcmp(argv[i], "--stream") == 0) {
+			p_options->stream = 1;
+		} else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+			if (threadpool_set_tile_bytes(atoi(argv[++i])) != 0) {
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--tiled-fill") == 0) {
+			p_options->tiled_fill = 1;
+		} else if (strcmp(argv[i], "--blur") == 0 && i + 1 < argc) {
+			p_options->blur = atof(argv[++i]);
+			if (!(p_options->blur > 0)
+			    || p_options->blur > BLUR_MAX_RADIUS) {
+				fprintf(stderr, "Invalid blur %s\n", argv[i]);
+				return 1;
+			}
+		} else if ((strcmp(argv[i], "-b") == 0
+		            || strcmp(argv[i], "--batch") == 0)
+		           && i + 1 < argc) {
+			p_options->manifest = argv[++i];
+		} else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+			p_options->stats_file_name = argv[++i];
+		} else {
+			fprintf(stderr, "Usage: %s [-j <threads>] [-f v1|v2] "
+				"[-e runs|compact|rans] [-s] [--tile <bytes>] "
+				"[--tiled-fill] [--blur <sigma>] "
+				"[-b <manifest>] [--stats <file>]\n", argv[0]);
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	int filter1[3][3] = {
-		{-1, -1, -1},
-		{-1, 8, -1},
-		{-1, -1, -1}};
-	int filter2[3][3] = {
-		{0, 1, 0},
-		{1, -4, 1},
-		{0, 1, 0}};
-	int filter3[3][3] = {
-		{1, 0, -1},
-		{0, 0, 0},
-		{-1, 0, 1}};
-	int threshold;
+/**
+ *    Read a line of at most MAX_FILENAME characters of @p_file into @line,
+ * without its end of line.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int read_line(FILE *p_file, char line[])
+{
+	if (fgets(line, MAX_FILENAME, p_file) == NULL) return 1;
+	line[strcspn(line, "\r\n")] = '\0';
+	return 0;
+}
 
-	bmp_file_header_t file_header;
-	bmp_info_header_t info_header;
-	bitmap_t bitmap, gray_bitmap, tmp_bitmap;
-	bitmap.pixels = NULL;
-	gray_bitmap.pixels = NULL;
-	tmp_bitmap.pixels = NULL;
+/**
+ *    Read the three lines describing an image from @p_file into @p_job,
+ * skipping the empty lines before them.
+ *    @return 0 if successful, -1 if there is no image left or an error code
+ * otherwise;
+ */
+int read_job(FILE *p_file, image_job_t *p_job)
+{
+	do {
+		if (read_line(p_file, p_job->file_name) != 0) return -1;
+	} while (p_job->file_name[0] == '\0');
+	if (fscanf(p_file, "%d", &p_job->threshold) != 1) {
+		fprintf(stderr, "Can't read the threshold of %s\n",
+			p_job->file_name);
+		return 1;
+	}
+	fgetc(p_file);
+	if (read_line(p_file, p_job->compression_file_name) != 0) {
+		fprintf(stderr, "Can't read the compressed file of %s\n",
+			p_job->file_name);
+		return 1;
+	}
+	return 0;
+}
 
-	int e;
+/**
+ *    Read all the images of the manifest located at @file_name, which has the
+ * three lines of an input file for every image, into the array @p_jobs of
+ * @p_count elements. The array must be freed by the caller.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int read_manifest(const char file_name[], image_job_t **p_jobs, int *p_count)
+{
+	FILE *p_file;
+	image_job_t *jobs = NULL;
+	int count = 0, capacity = 0, e;
 
-	/* Read the input file */
-	p_file = fopen(INPUT_FILENAME, "r");
+	p_file = fopen(file_name, "r");
 	if (p_file == NULL) {
-		fprintf(stderr, "Can't open the input file\n");
-		goto exit_failure;
+		fprintf(stderr, "Can't open the manifest %s\n", file_name);
+		return 1;
 	}
-	if (fgets(file_name, MAX_FILENAME, p_file) == NULL) {
-		fprintf(stderr, "Can't read first line of the input file\n");
-		fclose(p_file);
-		goto exit_failure;
+	for (;;) {
+		if (count == capacity) {
+			image_job_t *grown;
+			capacity = capacity > 0 ? 2 * capacity : 64;
+			grown = realloc(jobs, capacity * sizeof(image_job_t));
+			if (grown == NULL) {
+				fprintf(stderr, "Not enough memory\n");
+				e = 1;
+				break;
+			}
+			jobs = grown;
+		}
+		e = read_job(p_file, &jobs[count]);
+		if (e != 0) break;
+		++count;
 	}
-	if (fscanf(p_file, "%d", &threshold) != 1) {
-		fprintf(stderr, "Can't read second line of the input file\n");
-		fclose(p_file);
-		goto exit_failure;
+	fclose(p_file);
+
+	if (e > 0) {
+		free(jobs);
+		return 1;
 	}
-	fgetc(p_file);
-	if (fgets(compression_file_name, MAX_FILENAME, p_file) == NULL) {
-		fprintf(stderr, "Can't read third line of the input file\n");
-		fclose(p_file);
-		goto exit_failure;
+	*p_jobs = jobs;
+	*p_count = count;
+	return 0;
+}
+
+/**
+ *    Initialize empty @p_buffers, which grow with the images.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int initialize_image_buffers(image_buffers_t *p_buffers)
+{
+	memset(p_buffers, 0, sizeof(image_buffers_t));
+	return initialize_compress_workspace(&p_buffers->workspace);
+}
+
+/**
+ *    Deallocate @p_buffers.
+ */
+void clear_image_buffers(image_buffers_t *p_buffers)
+{
+	clear_bitmap(&p_buffers->tmp_bitmap);
+	clear_bitmap(&p_buffers->blur_bitmap);
+	clear_plane(&p_buffers->gray_plane);
+	for (int k = 0; k < FILTER_COUNT; ++k) {
+		clear_plane(&p_buffers->filter_planes[k]);
+	}
+	clear_compress_workspace(&p_buffers->workspace);
+}
+
+/**
+ *    Get the time of the monotonic clock in nanoseconds.
+ */
+double now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/**
+ *    Add the time elapsed since @start to the @stage of @p_stats.
+ */
+void end_stage(image_stats_t *p_stats, int stage, double start)
+{
+	p_stats->stage_ns[stage] += now_ns() - start;
+}
+
+/**
+ *    Get the size of the file located at @file_name.
+ *    @return the size or 0 if the file can't be found;
+ */
+uint64_t file_size(const char file_name[])
+{
+	struct stat st;
+	return stat(file_name, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/**
+ *    Solve the four tasks for @p_job with the memory of @p_buffers, storing
+ * the results of tasks 3 and 4 in @compressed_file_name and
+ * @decompressed_file_name. The time of every stage, the bytes read and
+ * written and the counters of the compression are stored in @p_stats.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int process_image(const image_job_t *p_job,
+                  const char compressed_file_name[],
+                  const char decompressed_file_name[],
+                  const options_t *p_options,
+                  image_buffers_t *p_buffers,
+                  image_stats_t *p_stats)
+{
+	char name[MAX_FILENAME], extension[MAX_FILENAME];
+	char gray_file_name[MAX_FILENAME];
+	char filter_file_names[FILTER_COUNT][MAX_FILENAME];
+	const char *p_filter_file_names[FILTER_COUNT];
+	plane_t *p_filter_planes[FILTER_COUNT];
+	bmp_file_header_t file_header;
+	bmp_info_header_t info_header;
+	bitmap_t bitmap;
+	double start;
+	int e;
+
+	memset(p_stats, 0, sizeof(image_stats_t));
+	split_file_name(name, extension, p_job->file_name);
+	gray_file_name[0] = '\0';
+	strcat(gray_file_name, name);
+	strcat(gray_file_name, GRAYSCALE_NAME_SUFFIX);
+	strcat(gray_file_name, extension);
+	for (int k = 0; k < FILTER_COUNT; ++k) {
+		filter_file_names[k][0] = '\0';
+		strcat(filter_file_names[k], name);
+		strcat(filter_file_names[k], filter_suffixes[k]);
+		strcat(filter_file_names[k], extension);
+		p_filter_file_names[k] = filter_file_names[k];
+		p_filter_planes[k] = &p_buffers->filter_planes[k];
+	}
+
+	/* Solve tasks 1 and 2 without loading the image */
+	if (p_options->stream) {
+		start = now_ns();
+		e = filter_bmp_stream(p_job->file_name, gray_file_name,
+			p_filter_file_names, filters, FILTER_COUNT);
+		end_stage(p_stats, STAGE_STREAM, start);
+		if (e != 0) {
+			fprintf(stderr, "Error while writing files at tasks "
+				"1 and 2\n");
+			return 1;
+		}
+		p_stats->bytes_read += file_size(p_job->file_name);
+		p_stats->bytes_written += file_size(gray_file_name);
+		for (int k = 0; k < FILTER_COUNT; ++k) {
+			p_stats->bytes_written +=
+				file_size(filter_file_names[k]);
+		}
 	}
-	file_name[strlen(file_name) - 1] = '\0';
-	compression_file_name[strlen(compression_file_name) - 1] = '\0';
-	split_file_name(name, extension, file_name);
-	fclose(p_file);
 
 	/* Read the bmp file and initialize bitmaps*/
-	e = read_bmp(file_name, &file_header, &info_header, &bitmap);
+	start = now_ns();
+	e = read_bmp_mapped(p_job->file_name, &file_header, &info_header,
+		&bitmap);
+	end_stage(p_stats, STAGE_READ, start);
 	if (e != 0) {
 		fprintf(stderr, "Error while reading file\n");
-		goto exit_failure;
+		return 1;
 	}
-	e = initialize_bitmap(&tmp_bitmap, bitmap.width, bitmap.height);
-	if (e != 0) {
-		fprintf(stderr, "Error initializing a bitmap\n");
-		goto exit_failure;
+	p_stats->width = bitmap.width;
+	p_stats->height = bitmap.height;
+	p_stats->bytes_read += file_size(p_job->file_name);
+	e = reserve_bitmap(&p_buffers->tmp_bitmap, bitmap.width,
+		bitmap.height);
+	if (e == 0 && p_options->blur > 0) {
+		e = reserve_bitmap(&p_buffers->blur_bitmap, bitmap.width,
+			bitmap.height);
 	}
-	e = initialize_bitmap(&gray_bitmap, bitmap.width, bitmap.height);
 	if (e != 0) {
 		fprintf(stderr, "Error initializing a bitmap\n");
 		goto exit_failure;
 	}
-
-	/* Solve task 1 */
-	grayscale_bitmap(&gray_bitmap, &bitmap);
-	tmp_file_name[0] = '\0';
-	strcat(tmp_file_name, name);
-	strcat(tmp_file_name, GRAYSCALE_NAME_SUFFIX);
-	strcat(tmp_file_name, extension);
-	e = write_bmp(tmp_file_name, &file_header, &info_header, &gray_bitmap);
-	if (e != 0) {
-		fprintf(stderr, "Error while writing file at task1\n");
-		goto exit_failure;
+	for (int k = 0; k <= FILTER_COUNT && !p_options->stream; ++k) {
+		plane_t *p_plane = k == 0 ? &p_buffers->gray_plane
+			: p_filter_planes[k - 1];
+		e = reserve_plane(p_plane, bitmap.width, bitmap.height);
+		if (e != 0) {
+			fprintf(stderr, "Error initializing a plane\n");
+			goto exit_failure;
+		}
 	}
 
-	/* Solve task 2 */
-	filter_bitmap(&tmp_bitmap, &gray_bitmap, filter1);
-	tmp_file_name[0] = '\0';
-	strcat(tmp_file_name, name);
-	strcat(tmp_file_name, FILTER1_NAME_SUFFIX);
-	strcat(tmp_file_name, extension);
-	e = write_bmp(tmp_file_name, &file_header, &info_header, &tmp_bitmap);
-	if (e != 0) {
-		fprintf(stderr, "Error while writing file at task2\n");
-		goto exit_failure;
+	/* Solve task 1, keeping only the gray values */
+	if (!p_options->stream) {
+		start = now_ns();
+		grayscale_plane(&p_buffers->gray_plane, &bitmap);
+		end_stage(p_stats, STAGE_GRAYSCALE, start);
+		start = now_ns();
+		e = write_plane_bmp(gray_file_name, &file_header,
+			&info_header, &p_buffers->gray_plane);
+		end_stage(p_stats, STAGE_WRITE, start);
+		if (e != 0) {
+			fprintf(stderr, "Error while writing file at task1\n");
+			goto exit_failure;
+		}
+		p_stats->bytes_written += file_size(gray_file_name);
 	}
 
-	filter_bitmap(&tmp_bitmap, &gray_bitmap, filter2);
-	tmp_file_name[0] = '\0';
-	strcat(tmp_file_name, name);
-	strcat(tmp_file_name, FILTER2_NAME_SUFFIX);
-	strcat(tmp_file_name, extension);
-	e = write_bmp(tmp_file_name, &file_header, &info_header, &tmp_bitmap);
-	if (e != 0) {
-		fprintf(stderr, "Error while writing file at task2\n");
-		goto exit_failure;
+	/* Solve task 2, computing all the filters in a single pass */
+	if (!p_options->stream) {
+		start = now_ns();
+		filter_plane_multi(p_filter_planes, &p_buffers->gray_plane,
+			filters, FILTER_COUNT);
+		end_stage(p_stats, STAGE_FILTER, start);
+	}
+	for (int k = 0; k < FILTER_COUNT && !p_options->stream; ++k) {
+		start = now_ns();
+		e = write_plane_bmp(filter_file_names[k], &file_header,
+			&info_header, p_filter_planes[k]);
+		end_stage(p_stats, STAGE_WRITE, start);
+		if (e != 0) {
+			fprintf(stderr, "Error while writing file at task2\n");
+			goto exit_failure;
+		}
+		p_stats->bytes_written += file_size(filter_file_names[k]);
 	}
 
-	filter_bitmap(&tmp_bitmap, &gray_bitmap, filter3);
-	tmp_file_name[0] = '\0';
-	strcat(tmp_file_name, name);
-	strcat(tmp_file_name, FILTER3_NAME_SUFFIX);
-	strcat(tmp_file_name, extension);
-	e = write_bmp(tmp_file_name, &file_header, &info_header, &tmp_bitmap);
-	if (e != 0) {
-		fprintf(stderr, "Error while writing file at task2\n");
-		goto exit_failure;
+	/* Blur the image compressed at task 3, which merges its regions */
+	if (p_options->blur > 0) {
+		start = now_ns();
+		e = gaussian_blur_bitmap(&p_buffers->blur_bitmap, &bitmap,
+			p_options->blur);
+		end_stage(p_stats, STAGE_BLUR, start);
+		if (e != 0) {
+			fprintf(stderr, "Error while blurring at task3\n");
+			goto exit_failure;
+		}
 	}
 
-	/* Solve task 3 */
-	e = compress_bitmap(&tmp_bitmap, &bitmap, threshold);
+	/* Solve task 3, writing the boundary found by the compression */
+	p_buffers->workspace.tiled = p_options->tiled_fill;
+	start = now_ns();
+	e = compress_bitmap_workspace(&p_buffers->tmp_bitmap,
+		p_options->blur > 0 ? &p_buffers->blur_bitmap : &bitmap,
+		p_job->threshold, &p_buffers->workspace);
+	end_stage(p_stats, STAGE_COMPRESS, start);
 	if (e != 0) {
 		fprintf(stderr, "Error while compressing at task3\n");
 		goto exit_failure;
 	}
-	e = write_compressed_bmp("compressed.bin", &file_header, &info_header,
-		&tmp_bitmap);
+	p_stats->compress = p_buffers->workspace.stats;
+	start = now_ns();
+	e = write_compressed_bmp_boundary(compressed_file_name, &file_header,
+		&info_header, &p_buffers->tmp_bitmap, &p_buffers->workspace,
+		p_options->version, p_options->encoding);
+	end_stage(p_stats, STAGE_WRITE_COMPRESSED, start);
 	if (e != 0) {
 		fprintf(stderr, "Error while writing file at task3\n");
 		goto exit_failure;
 	}
+	p_stats->bytes_written += file_size(compressed_file_name);
+	clear_bitmap(&bitmap);
 
-	/* Solve task 4 */
-	clear_bitmap(&tmp_bitmap);
-	e = read_compressed_bmp(compression_file_name, &file_header,
-		&info_header, &tmp_bitmap);
+	/* Solve task 4, streaming the rows to the bmp file */
+	start = now_ns();
+	e = convert_compressed_bmp(p_job->compression_file_name,
+		decompressed_file_name);
+	end_stage(p_stats, STAGE_DECOMPRESS, start);
 	if (e != 0) {
-		fprintf(stderr, "Error while reading file at task4\n");
-		goto exit_failure;
+		fprintf(stderr, "Error while decompressing file at task4\n");
+		return 1;
 	}
-	e = write_bmp("decompressed.bmp", &file_header, &info_header,
-		&tmp_bitmap);
-	if (e != 0) {
-		fprintf(stderr, "Error while writing file at task4\n");
-		goto exit_failure;
-	}
-
-	clear_bitmap(&bitmap);
-	clear_bitmap(&tmp_bitmap);
-	clear_bitmap(&gray_bitmap);
+	p_stats->bytes_read += file_size(p_job->compression_file_name);
+	p_stats->bytes_written += file_size(decompressed_file_name);
 	return 0;
 
 exit_failure:
 	clear_bitmap(&bitmap);
-	clear_bitmap(&tmp_bitmap);
-	clear_bitmap(&gray_bitmap);
 	return 1;
 }
 
+/**
+ *    Write @string to @p_file as a JSON string.
+ */
+void put_json_string(FILE *p_file, const char *string)
+{
+	fputc('"', p_file);
+	for (const unsigned char *c = (const unsigned char *)string; *c != '\0';
+	     ++c) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(p_file, "\\%c", *c);
+		} else if (*c < 0x20) {
+			fprintf(p_file, "\\u%04x", *c);
+		} else {
+			fputc(*c, p_file);
+		}
+	}
+	fputc('"', p_file);
+}
+
+/**
+ *    Write the stats of @p_job, processed with the result @e, as a single
+ * line of JSON to @p_file. The peak RSS is the one of the whole process.
+ */
+void write_stats(FILE *p_file, const image_job_t *p_job, int e,
+                 const image_stats_t *p_stats)
+{
+	struct rusage usage;
+	double total = 0;
+
+	getrusage(RUSAGE_SELF, &usage);
+	flockfile(p_file);
+	fputs("{\"image\":", p_file);
+	put_json_string(p_file, p_job->file_name);
+	fprintf(p_file, ",\"ok\":%s,\"width\":%d,\"height\":%d,"
+		"\"threshold\":%d,\"stages_ns\":{", e == 0 ? "true" : "false",
+		p_stats->width, p_stats->height, p_job->threshold);
+	for (int k = 0; k < STAGE_COUNT; ++k) {
+		fprintf(p_file, "%s\"%s\":%.0f", k > 0 ? "," : "",
+			stage_names[k], p_stats->stage_ns[k]);
+		total += p_stats->stage_ns[k];
+	}
+	fprintf(p_file, "},\"total_ns\":%.0f,\"bytes_read\":%" PRIu64
+		",\"bytes_written\":%" PRIu64 ",\"peak_rss_bytes\":%" PRIu64
+		",\"compress\":{\"regions\":%" PRIu64 ",\"pixels_visited\":%"
+		PRIu64 ",\"max_stack_depth\":%" PRIu64 ",\"boundary_points\":%"
+		PRIu64 "}}\n", total, p_stats->bytes_read,
+		p_stats->bytes_written, (uint64_t)usage.ru_maxrss * 1024,
+		p_stats->compress.regions, p_stats->compress.pixels_visited,
+		p_stats->compress.max_stack_depth,
+		p_stats->compress.boundary_points);
+	fflush(p_file);
+	funlockfile(p_file);
+}
+
+/**
+ *    Process the images of the batch @arg until there is none left, with
+ * buffers of its own. The results of tasks 3 and 4 are named after the image.
+ */
+void *batch_worker(void *arg)
+{
+	batch_t *p_batch = arg;
+	image_buffers_t buffers;
+	image_stats_t stats;
+	char name[MAX_FILENAME], extension[MAX_FILENAME];
+	char compressed_file_name[MAX_FILENAME
+		+ sizeof(COMPRESSED_NAME_SUFFIX)];
+	char decompressed_file_name[2 * MAX_FILENAME
+		+ sizeof(DECOMPRESSED_NAME_SUFFIX)];
+	int k;
+
+	/* Leave the images to the other workers if there is no memory */
+	if (initialize_image_buffers(&buffers) != 0) return NULL;
+
+	while ((k = __atomic_fetch_add(&p_batch->next, 1, __ATOMIC_RELAXED))
+	       < p_batch->count) {
+		const image_job_t *p_job = &p_batch->jobs[k];
+		split_file_name(name, extension, p_job->file_name);
+		sprintf(compressed_file_name, "%s%s", name,
+			COMPRESSED_NAME_SUFFIX);
+		sprintf(decompressed_file_name, "%s%s%s", name,
+			DECOMPRESSED_NAME_SUFFIX, extension);
+		int e = process_image(p_job, compressed_file_name,
+			decompressed_file_name, p_batch->p_options, &buffers,
+			&stats);
+		if (e != 0) {
+			fprintf(stderr, "Failed to process %s\n",
+				p_job->file_name);
+			__atomic_fetch_add(&p_batch->failed, 1,
+			                   __ATOMIC_RELAXED);
+		}
+		if (p_batch->p_options->p_stats_file != NULL) {
+			write_stats(p_batch->p_options->p_stats_file, p_job, e,
+			            &stats);
+		}
+	}
+	clear_image_buffers(&buffers);
+	return NULL;
+}
+
+/**
+ *    Process all the images of the manifest of @p_options on a pool of
+ * workers, one image per worker at a time, so that the reading and writing of
+ * some images overlap the kernels of the others. The kernels of an image run
+ * on its worker alone. A failed image is reported and doesn't stop the batch.
+ *    @return 0 if all the images were processed or an error code otherwise;
+ */
+int run_batch(const options_t *p_options)
+{
+	batch_t batch;
+	image_job_t *jobs;
+	pthread_t *threads;
+	struct timespec start, end;
+	double seconds;
+	int count, workers, done;
+
+	if (read_manifest(p_options->manifest, &jobs, &count) != 0) return 1;
+	workers = threadpool_threads();
+	if (workers > count) workers = count;
+	if (workers < 1) workers = 1;
+	threads = malloc(workers * sizeof(pthread_t));
+	if (threads == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		free(jobs);
+		return 1;
+	}
+	threadpool_set_threads(1);
+
+	batch.jobs = jobs;
+	batch.count = count;
+	batch.p_options = p_options;
+	batch.next = 0;
+	batch.failed = 0;
+
+	/* The calling thread is the first worker */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int k = 1; k < workers; ++k) {
+		if (pthread_create(&threads[k], NULL, batch_worker, &batch)
+		    != 0) {
+			fprintf(stderr, "Can't start the workers\n");
+			workers = k;
+			break;
+		}
+	}
+	batch_worker(&batch);
+	for (int k = 1; k < workers; ++k) pthread_join(threads[k], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* No worker got the memory for the images left */
+	if (batch.next < count) batch.failed += count - batch.next;
+	done = count - batch.failed;
+
+	seconds = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) * 1e-9;
+	/* Keep the stats alone on stdout */
+	fprintf(p_options->p_stats_file == stdout ? stderr : stdout,
+		"%d images, %d failed, %d workers, %.3f s, %.2f images/s\n",
+		count, batch.failed, workers, seconds,
+		seconds > 0 ? done / seconds : 0.0);
+
+	free(threads);
+	free(jobs);
+	return batch.failed != 0;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *p_file;
+	options_t options;
+	image_job_t job;
+	image_buffers_t buffers;
+	image_stats_t stats;
+	int e;
+
+	if (parse_options(argc, argv, &options) != 0) return 1;
+	if (options.stats_file_name != NULL) {
+		options.p_stats_file = strcmp(options.stats_file_name, "-") == 0
+			? stdout : fopen(options.stats_file_name, "a");
+		if (options.p_stats_file == NULL) {
+			fprintf(stderr, "Can't open the stats file %s\n",
+				options.stats_file_name);
+			return 1;
+		}
+	}
+	if (options.manifest != NULL) {
+		e = run_batch(&options);
+		goto exit;
+	}
+
+	/* Read the input file */
+	p_file = fopen(INPUT_FILENAME, "r");
+	if (p_file == NULL) {
+		fprintf(stderr, "Can't open the input file\n");
+		e = 1;
+		goto exit;
+	}
+	e = read_job(p_file, &job);
+	fclose(p_file);
+	if (e != 0) {
+		fprintf(stderr, "Can't read the input file\n");
+		e = 1;
+		goto exit;
+	}
+
+	e = initialize_image_buffers(&buffers);
+	if (e == 0) {
+		e = process_image(&job, COMPRESSED_FILENAME,
+			DECOMPRESSED_FILENAME, &options, &buffers, &stats);
+		if (options.p_stats_file != NULL) {
+			write_stats(options.p_stats_file, &job, e, &stats);
+		}
+	}
+	clear_image_buffers(&buffers);
+
+exit:
+	if (options.p_stats_file != NULL && options.p_stats_file != stdout) {
+		fclose(options.p_stats_file);
+	}
+	return e;
+}
@@ -0,0 +1,186 @@
+#include <string.h>
+
+#include "rans.h"
+
+int rans_normalize(uint16_t freq[RANS_SYMBOLS],
+                   const uint64_t counts[RANS_SYMBOLS])
+{
+	uint64_t total = 0;
+	int sum = 0;
+
+	for (int s = 0; s < RANS_SYMBOLS; ++s) total += counts[s];
+	if (total == 0) return 1;
+
+	for (int s = 0; s < RANS_SYMBOLS; ++s) {
+		freq[s] = 0;
+		if (counts[s] == 0) continue;
+		uint64_t f = counts[s] * RANS_SCALE / total;
+		freq[s] = f > 0 ? f : 1;
+		sum += freq[s];
+	}
+
+	/* Give the rounding error to the most frequent bytes */
+	while (sum != RANS_SCALE) {
+		int largest = 0;
+		for (int s = 1; s < RANS_SYMBOLS; ++s) {
+			if (freq[s] > freq[largest]) largest = s;
+		}
+		if (sum < RANS_SCALE) {
+			freq[largest] += RANS_SCALE - sum;
+			sum = RANS_SCALE;
+		} else {
+			int d = sum - RANS_SCALE;
+			if (d > freq[largest] - 1) d = freq[largest] - 1;
+			freq[largest] -= d;
+			sum -= d;
+		}
+	}
+	return 0;
+}
+
+/**
+ *    Fill @p_symbol for a byte of frequency @freq starting at @cum, so that
+ * the state x becomes (x / freq) * RANS_SCALE + x % freq + cum, computed as
+ * x + bias + q * (RANS_SCALE - freq) where q is x / freq.
+ */
+static void init_symbol(rans_symbol_t *p_symbol, uint32_t cum, uint32_t freq)
+{
+	p_symbol->x_max = ((RANS_LOW >> RANS_SCALE_BITS) << 16) * freq;
+	p_symbol->cmpl_freq = RANS_SCALE - freq;
+	if (freq < 2) {
+		/* q = x, and the bias makes up for x % 1 = 0 */
+		p_symbol->rcp_freq = ~0u;
+		p_symbol->rcp_shift = 0;
+		p_symbol->bias = cum + RANS_SCALE - 1;
+	} else {
+		uint32_t shift = 0;
+		while (freq > (1u << shift)) ++shift;
+		p_symbol->rcp_freq = ((1ull << (shift + 31)) + freq - 1) / freq;
+		p_symbol->rcp_shift = shift - 1;
+		p_symbol->bias = cum;
+	}
+}
+
+int rans_build_table(rans_table_t *p_table,
+                     const uint16_t freq[RANS_SYMBOLS])
+{
+	uint32_t cum = 0;
+
+	for (int s = 0; s < RANS_SYMBOLS; ++s) {
+		if (freq[s] > RANS_SCALE - cum) return 1;
+		p_table->freq[s] = freq[s];
+		if (freq[s] != 0) {
+			init_symbol(&p_table->symbols[s], cum, freq[s]);
+		}
+		for (uint32_t k = 0; k < freq[s]; ++k) {
+			p_table->slots[cum + k] = (uint32_t)(freq[s] - 1)
+				| k << 12 | (uint32_t)s << 24;
+		}
+		cum += freq[s];
+	}
+	return cum == RANS_SCALE ? 0 : 1;
+}
+
+/**
+ *    Code the byte described by @p_symbol in the state @p_x, outputting the
+ * low 16 bits of the state before @*p_out first.
+ */
+static inline void encode_symbol(uint32_t *p_x, uint8_t **p_out,
+                                 const rans_symbol_t *p_symbol)
+{
+	uint32_t x = *p_x;
+
+	if (x >= p_symbol->x_max) {
+		*p_out -= 2;
+		(*p_out)[0] = x & 0xFF;
+		(*p_out)[1] = x >> 8 & 0xFF;
+		x >>= 16;
+	}
+	uint32_t q = (uint32_t)(((uint64_t)x * p_symbol->rcp_freq) >> 32)
+		>> p_symbol->rcp_shift;
+	*p_x = x + p_symbol->bias + q * p_symbol->cmpl_freq;
+}
+
+/**
+ *    Decode the next byte of the state @x into @out, without renormalizing
+ * the state. It is then at least RANS_LOW >> RANS_SCALE_BITS, so that a single
+ * step of 16 bits brings it back above RANS_LOW.
+ *    @return the new state;
+ */
+static inline uint32_t decode_symbol(uint32_t x, uint8_t *out,
+                                     const rans_table_t *p_table)
+{
+	uint32_t slot = p_table->slots[x & (RANS_SCALE - 1)];
+
+	*out = slot >> 24;
+	return ((slot & 0xFFF) + 1) * (x >> RANS_SCALE_BITS)
+		+ (slot >> 12 & 0xFFF);
+}
+
+/**
+ *    Read 16 bits, the lowest first, at @in.
+ */
+static inline uint32_t read_word(const uint8_t *in)
+{
+	return in[0] | (uint32_t)in[1] << 8;
+}
+
+size_t rans_encode(uint8_t *out, size_t capacity, const uint8_t *in,
+                   size_t size, const rans_table_t *p_table)
+{
+	uint8_t *p = out + capacity;
+	uint32_t x0 = RANS_LOW, x1 = RANS_LOW;
+	size_t k = size;
+
+	/* The decoder reads the bytes forward, so they are encoded backward */
+	if (k % 2 == 1) {
+		--k;
+		encode_symbol(&x0, &p, &p_table->symbols[in[k]]);
+	}
+	while (k > 0) {
+		k -= 2;
+		encode_symbol(&x1, &p, &p_table->symbols[in[k + 1]]);
+		encode_symbol(&x0, &p, &p_table->symbols[in[k]]);
+	}
+	for (int s = 3; s >= 0; --s) *--p = x1 >> (8 * s);
+	for (int s = 3; s >= 0; --s) *--p = x0 >> (8 * s);
+	return out + capacity - p;
+}
+
+int rans_decode(uint8_t *out, size_t size, const uint8_t *in,
+                size_t in_size, const rans_table_t *p_table)
+{
+	const uint8_t *p, *end = in + in_size;
+	uint32_t x0, x1;
+	size_t k = 0;
+
+	if (in_size < 8) return 1;
+	x0 = read_word(in) | read_word(in + 2) << 16;
+	x1 = read_word(in + 4) | read_word(in + 6) << 16;
+	p = in + 8;
+
+	/* Both states take at most 4 bytes, which are read before knowing how
+	 * many are needed, so that the states don't wait for each other */
+	for (; k + 1 < size && end - p >= 4; k += 2) {
+		uint32_t w0 = read_word(p), w1 = read_word(p + 2);
+		x0 = decode_symbol(x0, &out[k], p_table);
+		x1 = decode_symbol(x1, &out[k + 1], p_table);
+		uint32_t n0 = x0 < RANS_LOW, n1 = x1 < RANS_LOW;
+		x0 = n0 ? x0 << 16 | w0 : x0;
+		x1 = n1 ? x1 << 16 | (n0 ? w1 : w0) : x1;
+		p += 2 * (n0 + n1);
+	}
+	for (; k < size; ++k) {
+		uint32_t x = decode_symbol(k % 2 ? x1 : x0, &out[k], p_table);
+		if (x < RANS_LOW) {
+			if (end - p < 2) return 1;
+			x = x << 16 | read_word(p);
+			p += 2;
+		}
+		if (k % 2) x1 = x;
+		else x0 = x;
+	}
+
+	/* The encoder started from RANS_LOW and used all the bytes */
+	return x0 == RANS_LOW && x1 == RANS_LOW && p == end ? 0 : 1;
+}
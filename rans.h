@@ -0,0 +1,93 @@
+#ifndef RANS_H
+#define RANS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*   The frequencies of a table add up to RANS_SCALE   */
+#define RANS_SCALE_BITS 12
+#define RANS_SCALE (1 << RANS_SCALE_BITS)
+
+/*   Number of symbols: the coder works on bytes   */
+#define RANS_SYMBOLS 256
+
+/**
+ *    Lower bound of the state, which stays below 2^31 and is renormalized 16
+ * bits at a time, so that a single step is needed after every byte.
+ */
+#define RANS_LOW (1u << 15)
+
+/*   Structures declarations   */
+/**
+ *    How the encoder codes a byte of frequency freq starting at cum: the
+ * division of the state by freq is done with the reciprocal @rcp_freq and
+ * @rcp_shift. @x_max is the state from which bytes are output first.
+ */
+typedef struct {
+	uint32_t x_max;
+	uint32_t rcp_freq;
+	uint32_t bias;
+	uint16_t cmpl_freq;
+	uint16_t rcp_shift;
+} rans_symbol_t;
+
+/**
+ *    An order 0 model: @freq is the normalized frequency of every byte and
+ * @symbols its encoder data. For the decoder, @slots maps every slot of
+ * [0, RANS_SCALE) to freq - 1, slot - cum and the byte, packed with 12, 12
+ * and 8 bits.
+ */
+typedef struct {
+	uint16_t freq[RANS_SYMBOLS];
+	rans_symbol_t symbols[RANS_SYMBOLS];
+	uint32_t slots[RANS_SCALE];
+} rans_table_t;
+
+/*   Functions declarations   */
+/**
+ *    Scale the @counts of the bytes of some data to frequencies adding up to
+ * RANS_SCALE, stored in @freq. Every byte that occurs keeps a frequency of at
+ * least 1.
+ *    @return 0 if successful or an error code otherwise (no byte occurs);
+ */
+int rans_normalize(uint16_t freq[RANS_SYMBOLS],
+                   const uint64_t counts[RANS_SYMBOLS]);
+
+/**
+ *    Build @p_table from the frequencies @freq, as read from a file.
+ *    @return 0 if successful or an error code otherwise (they don't add up
+ * to RANS_SCALE);
+ */
+int rans_build_table(rans_table_t *p_table,
+                     const uint16_t freq[RANS_SYMBOLS]);
+
+/**
+ *    Get the largest number of bytes rans_encode stores for @size bytes.
+ */
+static inline size_t rans_bound(size_t size)
+{
+	return size + size / 2 + 16;
+}
+
+/**
+ *    Encode the @size bytes at @in with @p_table, in which all of them must
+ * have a non-zero frequency. Two states are interleaved, for the even and odd
+ * bytes, so that the decoder can work on both at once. The output is stored
+ * at the end of the @capacity bytes at @out, which must be at least
+ * rans_bound(@size).
+ *    @return the number of stored bytes, which start at
+ * @out + @capacity - the result;
+ */
+size_t rans_encode(uint8_t *out, size_t capacity, const uint8_t *in,
+                   size_t size, const rans_table_t *p_table);
+
+/**
+ *    Decode @size bytes into @out from the @in_size bytes at @in, encoded by
+ * rans_encode with the same table. Malformed data is detected as far as the
+ * final state allows, and never read or written out of bounds.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int rans_decode(uint8_t *out, size_t size, const uint8_t *in,
+                size_t in_size, const rans_table_t *p_table);
+
+#endif
@@ -1,19 +1,47 @@
 #ifndef STACK_H
 #define STACK_H
 
-#define STACK_DEFAULT_CAPACITY 100
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STACK_DEFAULT_CAPACITY 1024
+/*   Largest chunk (in points) allocated when the stack grows   */
+#define STACK_MAX_CHUNK (1 << 20)
 
 /*   Structures declarations   */
 #pragma pack(1)
 typedef struct {
-	short x;
-	short y;
+	uint16_t x;
+	uint16_t y;
 } point_t;
 #pragma pack()
-typedef struct {
-	int size;
+
+/**
+ *    A piece of the stack. The chunks are linked in both directions: @prev
+ * holds the older points, while @next is a chunk that was emptied and is kept
+ * for the next growth. @size is the number of points of the chunk, saved when
+ * a newer chunk is used.
+ */
+typedef struct stack_chunk {
+	struct stack_chunk *prev;
+	struct stack_chunk *next;
 	int capacity;
-	point_t *data;
+	int size;
+	point_t data[];
+} stack_chunk_t;
+
+/**
+ *    The stack grows by chunks, so the points are never copied. @top is the
+ * next free slot of the current chunk, which spans [@base, @limit), and
+ * @below the number of points of the older chunks.
+ */
+typedef struct {
+	point_t *top;
+	point_t *base;
+	point_t *limit;
+	stack_chunk_t *chunk;
+	size_t below;
 } stack_t;
 
 /*   Functions declarations   */
@@ -21,43 +49,214 @@ typedef struct {
  *    Initialize @p_stack with a capacity equal with STACK_DEFAULT_CAPACITY.
  *    @return 0 if successful or an error code otherwise;
  */
-int initialize_stack(stack_t *p_stack);
+static inline int initialize_stack(stack_t *p_stack)
+{
+	stack_chunk_t *chunk = malloc(sizeof(stack_chunk_t)
+		+ STACK_DEFAULT_CAPACITY * sizeof(point_t));
+	p_stack->chunk = chunk;
+	if (chunk == NULL) {
+		p_stack->top = p_stack->base = p_stack->limit = NULL;
+		fprintf(stderr, "Stack initialization failed\n");
+		return 1;
+	}
+	chunk->prev = chunk->next = NULL;
+	chunk->capacity = STACK_DEFAULT_CAPACITY;
+	chunk->size = 0;
+	p_stack->top = p_stack->base = chunk->data;
+	p_stack->limit = chunk->data + chunk->capacity;
+	p_stack->below = 0;
+	return 0;
+}
+
+/**
+ *    Move @p_stack to a newer chunk with room for at least @count points,
+ * reusing the spare chunk when it is large enough.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static inline int stack_grow(stack_t *p_stack, int count)
+{
+	stack_chunk_t *chunk = p_stack->chunk;
+	stack_chunk_t *next = chunk->next;
+
+	if (next == NULL || next->capacity < count) {
+		int capacity = chunk->capacity < STACK_MAX_CHUNK / 2
+			? 2 * chunk->capacity : STACK_MAX_CHUNK;
+		if (capacity < count) capacity = count;
+		stack_chunk_t *tmp = malloc(sizeof(stack_chunk_t)
+			+ (size_t)capacity * sizeof(point_t));
+		if (tmp == NULL) {
+			fprintf(stderr, "Stack reallocation failed\n");
+			return 1;
+		}
+		tmp->capacity = capacity;
+		tmp->next = next;
+		tmp->prev = chunk;
+		if (next != NULL) next->prev = tmp;
+		chunk->next = tmp;
+		next = tmp;
+	}
+	chunk->size = p_stack->top - p_stack->base;
+	p_stack->below += chunk->size;
+	next->size = 0;
+	p_stack->chunk = next;
+	p_stack->top = p_stack->base = next->data;
+	p_stack->limit = next->data + next->capacity;
+	return 0;
+}
+
+/**
+ *    Make sure that @count points can be added to @p_stack with
+ * stack_push_unchecked.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static inline int stack_reserve(stack_t *p_stack, int count)
+{
+	if (p_stack->limit - p_stack->top >= count) return 0;
+	return stack_grow(p_stack, count);
+}
+
+/**
+ *    Add an element to @p_stack, which must have room for it (see
+ * stack_reserve).
+ */
+static inline void stack_push_unchecked(stack_t *p_stack, int x, int y)
+{
+	p_stack->top->x = x;
+	p_stack->top->y = y;
+	++p_stack->top;
+}
 
 /**
  *    Add an element to @p_stack. If the new element will exceed the current
- * capacity, the stack will be reallocated.
+ * capacity, a new chunk is added to the stack.
  *    @return 0 if successful or an error code otherwise;
  */
-int stack_push(stack_t *p_stack, int x, int y);
+static inline int stack_push(stack_t *p_stack, int x, int y)
+{
+	if (stack_reserve(p_stack, 1) != 0) return 1;
+	stack_push_unchecked(p_stack, x, y);
+	return 0;
+}
+
+/**
+ *    Go back to the previous chunk of @p_stack while the current one is empty,
+ * so that the newest element is at top - 1. The emptied chunks are kept.
+ */
+static inline void stack_settle(stack_t *p_stack)
+{
+	while (p_stack->top == p_stack->base && p_stack->chunk->prev != NULL) {
+		stack_chunk_t *chunk = p_stack->chunk->prev;
+		p_stack->below -= chunk->size;
+		p_stack->chunk = chunk;
+		p_stack->base = chunk->data;
+		p_stack->top = chunk->data + chunk->size;
+		p_stack->limit = chunk->data + chunk->capacity;
+	}
+}
+
+/**
+ *    Check if the stack is empty.
+ *    @return 1 if the stack is empty or 0 otherwise;
+ */
+static inline int stack_is_empty(stack_t *p_stack)
+{
+	if (p_stack->top == p_stack->base) stack_settle(p_stack);
+	return p_stack->top == p_stack->base;
+}
+
+/**
+ *    Get the number of points of @p_stack.
+ */
+static inline size_t stack_size(const stack_t *p_stack)
+{
+	return p_stack->below + (p_stack->top - p_stack->base);
+}
+
+/**
+ *    Remove the newest element of @p_stack, which must not be empty (see
+ * stack_is_empty), and return it.
+ */
+static inline point_t stack_pop_point(stack_t *p_stack)
+{
+	return *--p_stack->top;
+}
 
 /**
  *    Remove an element from @p_stack.
  *    @return 0 if successful or an error code otherwise;
  */
-int stack_pop(stack_t *p_stack);
+static inline int stack_pop(stack_t *p_stack)
+{
+	if (stack_is_empty(p_stack)) {
+		fprintf(stderr, "Trying to pop an empty stack\n");
+		return 1;
+	}
+	stack_pop_point(p_stack);
+	return 0;
+}
+
+/**
+ *    Query the newest element of @p_stack.
+ *    @return the desired element or (0, 0) if there is no element in the
+ * stack;
+ */
+static inline point_t stack_query(stack_t *p_stack)
+{
+	point_t none = {0, 0};
+	if (stack_is_empty(p_stack)) {
+		fprintf(stderr, "Trying to query an empty stack\n");
+		return none;
+	}
+	return p_stack->top[-1];
+}
 
 /**
  *    Query the x member of the newest element of @p_stack.
  *    @return the desired value or 0 if there is no element in the stack;
  */
-short stack_query_x(stack_t *p_stack);
+static inline int stack_query_x(stack_t *p_stack)
+{
+	return stack_query(p_stack).x;
+}
 
 /**
  *    Query the y member of the newest element of @p_stack.
  *    @return the desired value or 0 if there is no element in the stack;
  */
-short stack_query_y(stack_t *p_stack);
+static inline int stack_query_y(stack_t *p_stack)
+{
+	return stack_query(p_stack).y;
+}
 
 /**
- *    Check if the stack is empty.
- *    @return 1 if the stack is empty or 0 otherwise;
+ *    Remove all the elements of @p_stack, keeping its memory.
  */
-short stack_is_empty(stack_t *p_stack);
+static inline void stack_reset(stack_t *p_stack)
+{
+	while (p_stack->chunk->prev != NULL) {
+		p_stack->chunk = p_stack->chunk->prev;
+	}
+	p_stack->base = p_stack->top = p_stack->chunk->data;
+	p_stack->limit = p_stack->chunk->data + p_stack->chunk->capacity;
+	p_stack->below = 0;
+}
 
 /**
- *    Deallocate the data of the stack and set both capacity and size to 0.
+ *    Deallocate the data of the stack.
  *    @return 0 if successful or an error code otherwise;
  */
-int clear_stack(stack_t *p_stack);
+static inline int clear_stack(stack_t *p_stack)
+{
+	if (p_stack == NULL) return 0;
+	if (p_stack->chunk == NULL) return 0;
+	stack_reset(p_stack);
+	while (p_stack->chunk != NULL) {
+		stack_chunk_t *next = p_stack->chunk->next;
+		free(p_stack->chunk);
+		p_stack->chunk = next;
+	}
+	p_stack->top = p_stack->base = p_stack->limit = NULL;
+	return 0;
+}
 
 #endif
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+/*   Bands left to a thread, on their own cache line   */
+typedef struct {
+	int next;
+	int end;
+	char padding[64 - 2 * sizeof(int)];
+} band_queue_t;
+
+/*   State of the pool, protected by lock   */
+static struct {
+	pthread_mutex_t lock;
+	pthread_mutex_t job_lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	pthread_t *threads;
+	band_queue_t *queues;
+	int count;
+	int started;
+	int stop;
+	unsigned generation;
+	unsigned first_generation;
+	int running;
+
+	/* The current job */
+	band_fn_t fn;
+	void *arg;
+	int rows;
+	int band;
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL, NULL, 0, 0, 0, 0, 0, 0, NULL, NULL, 0, 0
+};
+
+/*   Set on the threads that are running bands   */
+static __thread int in_band;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/*   Width of the tiles, see tile_columns   */
+static int tile_bytes = -1;
+static pthread_once_t tile_once = PTHREAD_ONCE_INIT;
+
+static void init_count(void)
+{
+	const char *env = getenv(THREADS_ENV);
+	if (pool.count > 0) return;
+	if (env != NULL) pool.count = atoi(env);
+	if (pool.count <= 0) pool.count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (pool.count <= 0) pool.count = 1;
+	atexit(threadpool_shutdown);
+}
+
+/**
+ *    Take a band from the queue @q.
+ *    @return the band or -1 if the queue is empty;
+ */
+static int take_band(band_queue_t *q)
+{
+	int b;
+	if (__atomic_load_n(&q->next, __ATOMIC_RELAXED) >= q->end) return -1;
+	b = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+	return b < q->end ? b : -1;
+}
+
+/**
+ *    Run the bands of the thread @self, then steal from the other threads.
+ */
+static void run_bands(int self)
+{
+	in_band = 1;
+	for (int k = 0; k < pool.count; ++k) {
+		band_queue_t *q = &pool.queues[(self + k) % pool.count];
+		int b;
+		while ((b = take_band(q)) >= 0) {
+			int begin = b * pool.band;
+			int end = begin + pool.band;
+			pool.fn(pool.arg, begin, end < pool.rows ? end : pool.rows);
+		}
+	}
+	in_band = 0;
+}
+
+static void *worker(void *arg)
+{
+	int self = (int)(size_t)arg;
+	unsigned seen = pool.first_generation;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.stop && pool.generation == seen) {
+			pthread_cond_wait(&pool.start, &pool.lock);
+		}
+		if (pool.stop) break;
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		run_bands(self);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0) pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+/**
+ *    Start the threads of the pool, if they are not running.
+ *    @return 0 if successful or an error code otherwise;
+ */
+static int start_pool(void)
+{
+	if (pool.started) return 0;
+
+	pool.queues = calloc(pool.count, sizeof(band_queue_t));
+	pool.threads = calloc(pool.count, sizeof(pthread_t));
+	if (pool.queues == NULL || pool.threads == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		free(pool.queues);
+		free(pool.threads);
+		return 1;
+	}
+
+	pool.stop = 0;
+	pool.first_generation = pool.generation;
+	for (int k = 1; k < pool.count; ++k) {
+		if (pthread_create(&pool.threads[k], NULL, worker,
+		                   (void *)(size_t)k) != 0) {
+			fprintf(stderr, "Can't start the thread pool\n");
+			pool.count = k;
+			break;
+		}
+	}
+	pool.started = 1;
+	return 0;
+}
+
+int threadpool_set_threads(int count)
+{
+	if (count <= 0) {
+		fprintf(stderr, "Invalid number of threads\n");
+		return 1;
+	}
+	pthread_once(&init_once, init_count);
+	threadpool_shutdown();
+	pool.count = count;
+	return 0;
+}
+
+static void init_tile_bytes(void)
+{
+	const char *env = getenv(TILE_ENV);
+	if (tile_bytes >= 0) return;
+	if (env != NULL) tile_bytes = atoi(env);
+	if (tile_bytes < 0 || env == NULL) tile_bytes = TILE_BYTES;
+}
+
+int threadpool_set_tile_bytes(int bytes)
+{
+	if (bytes < 0) {
+		fprintf(stderr, "Invalid tile width\n");
+		return 1;
+	}
+	pthread_once(&tile_once, init_tile_bytes);
+	tile_bytes = bytes;
+	return 0;
+}
+
+int threadpool_tile_bytes(void)
+{
+	pthread_once(&tile_once, init_tile_bytes);
+	return tile_bytes;
+}
+
+int tile_columns(int width, size_t pixel_bytes)
+{
+	size_t columns;
+
+	pthread_once(&tile_once, init_tile_bytes);
+	columns = tile_bytes / pixel_bytes / 64 * 64;
+	if (columns < 64) columns = 64;
+	if (tile_bytes == 0 || (size_t)width <= columns) return width;
+	return columns;
+}
+
+int threadpool_threads(void)
+{
+	pthread_once(&init_once, init_count);
+	return pool.count;
+}
+
+void threadpool_shutdown(void)
+{
+	pthread_mutex_lock(&pool.job_lock);
+	if (pool.started) {
+		pthread_mutex_lock(&pool.lock);
+		pool.stop = 1;
+		pthread_cond_broadcast(&pool.start);
+		pthread_mutex_unlock(&pool.lock);
+		for (int k = 1; k < pool.count; ++k) {
+			pthread_join(pool.threads[k], NULL);
+		}
+		free(pool.threads);
+		free(pool.queues);
+		pool.threads = NULL;
+		pool.queues = NULL;
+		pool.started = 0;
+	}
+	pthread_mutex_unlock(&pool.job_lock);
+}
+
+int band_rows(size_t row_bytes)
+{
+	size_t rows = row_bytes > 0 ? BAND_BYTES / row_bytes : BAND_BYTES;
+	return rows > 0 ? (rows < 1 << 20 ? (int)rows : 1 << 20) : 1;
+}
+
+void parallel_rows(int rows, int band, band_fn_t fn, void *arg)
+{
+	int bands, per_thread;
+
+	if (rows <= 0) return;
+	if (band <= 0) band = 1;
+	bands = (rows + band - 1) / band;
+
+	/* Run on the calling thread when the pool can't help */
+	pthread_once(&init_once, init_count);
+	if (pool.count <= 1 || bands <= 1 || in_band
+	    || pthread_mutex_trylock(&pool.job_lock) != 0) {
+		fn(arg, 0, rows);
+		return;
+	}
+	if (start_pool() != 0) {
+		pthread_mutex_unlock(&pool.job_lock);
+		fn(arg, 0, rows);
+		return;
+	}
+
+	/* Give every thread a contiguous range of bands */
+	per_thread = (bands + pool.count - 1) / pool.count;
+	for (int k = 0; k < pool.count; ++k) {
+		int begin = k * per_thread;
+		int end = begin + per_thread;
+		pool.queues[k].next = begin < bands ? begin : bands;
+		pool.queues[k].end = end < bands ? end : bands;
+	}
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.rows = rows;
+	pool.band = band;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.running = pool.count - 1;
+	++pool.generation;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	/* The calling thread works too, then waits for the others */
+	run_bands(0);
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running > 0) pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.job_lock);
+}
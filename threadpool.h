@@ -0,0 +1,87 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stddef.h>
+
+/*   Environment variable with the number of threads of the pool   */
+#define THREADS_ENV "PC3_THREADS"
+
+/*   Approximate number of bytes touched by a band of rows   */
+#define BAND_BYTES (256 * 1024)
+
+/*   Environment variable with the width in bytes of the tiles   */
+#define TILE_ENV "PC3_TILE"
+
+/*   Width in bytes of the tiles by default, see tile_columns   */
+#define TILE_BYTES (32 * 1024)
+
+/*   Minimum number of rows of a band split in tiles   */
+#define TILE_ROWS 64
+
+/**
+ *    Work done on a band of rows: process the rows [@begin, @end) using @arg.
+ */
+typedef void (*band_fn_t)(void *arg, int begin, int end);
+
+/*   Functions declarations   */
+/**
+ *    Set the number of threads (the calling thread included) used by
+ * parallel_rows. By default, the value of THREADS_ENV is used or, if it is not
+ * set, the number of online CPUs. Should not be called while parallel_rows is
+ * running.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int threadpool_set_threads(int count);
+
+/**
+ *    Get the number of threads used by parallel_rows.
+ */
+int threadpool_threads(void);
+
+/**
+ *    Stop and join the threads of the pool. They are started again by the
+ * next call of parallel_rows.
+ */
+void threadpool_shutdown(void);
+
+/**
+ *    Get the number of rows of @row_bytes bytes that fit in a band of about
+ * BAND_BYTES bytes.
+ *    @return the number of rows, at least 1;
+ */
+int band_rows(size_t row_bytes);
+
+/**
+ *    Set the width in bytes of the tiles that the rows wider than it are
+ * split in, or 0 to never split the rows. By default, the value of TILE_ENV
+ * is used or, if it is not set, TILE_BYTES.
+ *    @return 0 if successful or an error code otherwise;
+ */
+int threadpool_set_tile_bytes(int bytes);
+
+/**
+ *    Get the width in bytes of the tiles, 0 when the rows are never split.
+ */
+int threadpool_tile_bytes(void);
+
+/**
+ *    Get the number of columns of the tiles of a row of @width pixels of
+ * @pixel_bytes bytes. A row wider than the tile width is processed a tile at
+ * a time, the tiles of a band one after the other, so that the few rows
+ * around the current one that a kernel reads stay in the cache. The tiles
+ * have a multiple of 64 columns.
+ *    @return the number of columns, or @width if the row isn't split;
+ */
+int tile_columns(int width, size_t pixel_bytes);
+
+/**
+ *    Split the rows [0, @rows) in bands of @band rows and call @fn on every
+ * band, using the threads of the pool. Every thread starts with its own range
+ * of bands and steals bands from the others when it runs out of work. The
+ * bands run on the calling thread alone when the pool has one thread, when it
+ * is already busy (for example when called from a band) or when there is a
+ * single band.
+ */
+void parallel_rows(int rows, int band, band_fn_t fn, void *arg);
+
+#endif